@@ -0,0 +1,81 @@
+#include <ctime>
+
+import std;
+import vkvideo;
+
+using namespace vkvideo;
+using namespace vkvideo::medias;
+using namespace vkvideo::tp;
+
+constexpr i32 sample_rate = 48000;
+constexpr i32 frames_per_callback = 1024;
+
+// mixes the audio of the input with itself (each track starting a bit later
+// than the previous one), pulling the samples at the pace of a playback
+// device, and reports the CPU time used by the mixing and by the whole
+// process (mostly the feeder thread decoding the tracks)
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <input> [tracks=16] [seconds=10]"
+              << std::endl;
+    return 1;
+  }
+
+  auto num_tracks = argc > 2 ? std::atoi(argv[2]) : 16;
+  auto duration = argc > 3 ? std::atof(argv[3]) : 10.0;
+
+  ffmpeg::Instance ffmpeg;
+  AudioFormat format{
+      .sample_fmt = ffmpeg::SampleFormat::AV_SAMPLE_FMT_FLT,
+      .ch_layout = ffmpeg::ch_layout_stereo,
+      .sample_rate = sample_rate,
+  };
+
+  std::vector<AudioMixerSource> sources;
+  for (i32 i = 0; i < num_tracks; ++i)
+    sources.push_back(AudioMixerSource{
+        .audio = std::make_unique<AudioStream>(argv[1], format),
+        .gain = 1.0f / static_cast<float>(num_tracks),
+        .start = static_cast<i64>(i) * 100'000'000,
+    });
+  AudioMixer mixer{format, std::move(sources)};
+
+  auto num_channels = format.ch_layout->nb_channels;
+  std::vector<float> output(frames_per_callback * num_channels);
+  // like AVFrame::data, only the first one is used by interleaved samples
+  std::array<u8 *, 8> planes{reinterpret_cast<u8 *>(output.data())};
+
+  SteadyClock clock;
+  auto period = std::chrono::nanoseconds{static_cast<i64>(1e9) *
+                                         frames_per_callback / sample_rate};
+  auto num_callbacks =
+      static_cast<i32>(duration * sample_rate / frames_per_callback);
+  std::chrono::nanoseconds mix_time{0};
+  auto cpu_start = std::clock();
+  auto start = std::chrono::steady_clock::now();
+  for (i32 i = 0; i < num_callbacks; ++i) {
+    std::this_thread::sleep_until(start + i * period);
+    auto before = std::chrono::steady_clock::now();
+    mixer.get_samples(frames_per_callback, planes.data());
+    mix_time += std::chrono::steady_clock::now() - before;
+  }
+  auto wall_time = std::chrono::duration<double>{
+      std::chrono::steady_clock::now() - start}
+                       .count();
+  auto cpu_time = static_cast<double>(std::clock() - cpu_start) /
+                  CLOCKS_PER_SEC;
+
+  std::println("{} tracks, {} kernels", num_tracks, mix_kernel_name());
+  std::println("mixing: {:.3f} ms per callback, {:.2f}% of a core",
+               std::chrono::duration<double, std::milli>{mix_time}.count() /
+                   num_callbacks,
+               100.0 * std::chrono::duration<double>{mix_time}.count() /
+                   wall_time);
+  std::println("process: {:.2f}% of a core", 100.0 * cpu_time / wall_time);
+
+  auto offsets = mixer.get_sync_offsets(clock);
+  for (std::size_t i = 0; i < offsets.size(); ++i)
+    std::println("track {}: {:+.2f} ms ahead of the clock", i,
+                 static_cast<double>(offsets[i]) / 1e6);
+  return 0;
+}
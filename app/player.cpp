@@ -23,12 +23,21 @@ int main(int argc, char *argv[]) {
   namespace vkr = vk::raii;
 
   if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <input.mkv>" << std::endl;
+    std::cerr << "Usage: " << argv[0] << " <input.mkv> [overlay...]"
+              << std::endl;
     return 1;
   }
 
   ffmpeg::Instance ffmpeg;
 
+  // the steps up to the first frame that do not depend on each other run on
+  // worker threads, VKVIDEO_STARTUP_TIMES=1 prints how long each one took
+  StartupScheduler startup;
+  auto print_startup_times = []() {
+    auto env = std::getenv("VKVIDEO_STARTUP_TIMES");
+    return env && std::strcmp(env, "1") == 0;
+  }();
+
   auto vkfw = vkfw::initUnique([&]() {
     auto force_x11 = []() {
       auto env = std::getenv("VKVIDEO_FORCE_X11");
@@ -39,14 +48,61 @@ int main(int argc, char *argv[]) {
     };
   }());
 
-  auto window = vkfw::createWindowUnique(640, 360, "vkvideo_player");
-  VkContext vk{};
+  // the player never encodes, so the encode queues are not created
+  auto vk_future = startup.spawn("create vulkan context", []() {
+    return std::make_unique<VkContext>(VkContextOptions{.video_encode = false});
+  });
+  auto probe_future = startup.spawn(
+      "probe video", [path = std::string_view{argv[1]}]()
+                         -> std::optional<RawFFmpegStream> {
+        if (is_webp_path(path))
+          return std::nullopt;
+        return RawFFmpegStream{path, ffmpeg::MediaType::Video};
+      });
+  auto shaders_future =
+      startup.spawn("compile video shaders", &VideoPipeline::prepare_shaders);
+  // only the decoders, playback starts with the clock. The audio of the
+  // input and of the overlays is mixed, decoded ahead of the audio thread.
+  auto audio_future = startup.spawn(
+      "open audio", [&]() -> std::unique_ptr<medias::Audio> {
+        AudioFormat format{
+            .sample_fmt = sample_fmt,
+            .ch_layout = ch_layout,
+            .sample_rate = sample_rate,
+        };
+        std::vector<AudioMixerSource> sources;
+        for (i32 i = 1; i < argc; ++i) {
+          try {
+            sources.push_back(AudioMixerSource{
+                .audio = std::make_unique<medias::AudioStream>(argv[i],
+                                                               format),
+            });
+          } catch (std::exception &ex) {
+            std::println("Error opening audio stream of {}: {}", argv[i],
+                         ex.what());
+          }
+        }
+        if (sources.empty())
+          return nullptr;
+        return std::make_unique<AudioMixer>(format, std::move(sources));
+      });
+
+  auto window = startup.run("create window", []() {
+    return vkfw::createWindowUnique(640, 360, "vkvideo_player");
+  });
+  auto vk_ptr = vk_future.get();
+  auto &vk = *vk_ptr;
 
   auto surface = vk::raii::SurfaceKHR{
       vk.get_instance(),
       vkfw::createWindowSurface(*vk.get_instance(), *window)};
 
-  auto video = medias::open_video(vk, argv[1]);
+  auto video = startup.run("open video", [&]() {
+    medias::VideoArgs args{.clip_cache_dir = medias::ClipCache::default_dir()};
+    if (auto probed = probe_future.get())
+      return medias::open_video(vk, std::move(*probed), args);
+    return medias::open_video(vk, argv[1], args);
+  });
 
   vkr::CommandPool pool{
       vk.get_device(),
@@ -185,23 +241,72 @@ int main(int argc, char *argv[]) {
   }
 
   VideoPipelineCache pipelines;
+  // views stay cached for more frames than there are in flight
+  ImageViewCache image_views;
   SteadyClock clock;
+  // frame locks live for one iteration, they are created in here
+  FrameArena frame_arena;
+  // reused every frame
+  std::vector<vk::SemaphoreSubmitInfo> wait_sem_info, sig_sem_info;
+
+  // with VKVIDEO_CHECK_ALLOCATIONS=<n>, the player exits after n frames (past
+  // the warm-up ones), and fails if one of them allocated on this thread.
+  // The library must be built with VKVIDEO_TRACK_ALLOCATIONS. ctest runs the
+  // same check headless (tests/frame_loop_allocations.cpp).
+  static constexpr i32 alloc_check_warmup = 120;
+  auto alloc_check_frames = []() -> std::optional<i32> {
+    auto env = std::getenv("VKVIDEO_CHECK_ALLOCATIONS");
+    return env ? std::optional{std::atoi(env)} : std::nullopt;
+  }();
+  if (alloc_check_frames.has_value() && !allocation_tracking) {
+    std::println(std::cerr, "VKVIDEO_CHECK_ALLOCATIONS needs a build with "
+                            "VKVIDEO_TRACK_ALLOCATIONS");
+    return 1;
+  }
+
+  // overlays are composited on top of the input, as a column of tiles on the
+  // right side of the window
+  std::unique_ptr<Compositor> compositor;
+  std::vector<CompositedFrames> composited_frames(FIF_CNT);
+  if (argc > 2) {
+    compositor = std::make_unique<Compositor>(vk, swapchain_format, FIF_CNT);
+    compositor->layers.push_back(CompositorLayer{.video = std::move(video)});
+    auto num_overlays = argc - 2;
+    auto tile_size = std::min(0.25f, 1.0f / static_cast<float>(num_overlays));
+    for (i32 i = 0; i < num_overlays; ++i) {
+      compositor->layers.push_back(CompositorLayer{
+          .video = medias::open_video(
+              vk, argv[i + 2],
+              {
+                  .clip_cache_dir = medias::ClipCache::default_dir(),
+                  // tiles are heavily downscaled
+                  .resident_mipmaps = true,
+              }),
+          .transform =
+              {
+                  .position = {1.0f - tile_size,
+                               static_cast<float>(i) * tile_size},
+                  .size = {tile_size, tile_size},
+              },
+          .opacity = 0.9f,
+          .z_order = 1,
+      });
+    }
+  }
 
-  std::unique_ptr<medias::Audio> audio = nullptr;
+  shaders_future.get();
   UniqueAny audio_system{};
-  try {
-    audio = std::make_unique<medias::AudioStream>(
-        argv[1], AudioFormat{
-                     .sample_fmt = sample_fmt,
-                     .ch_layout = ch_layout,
-                     .sample_rate = sample_rate,
-                 });
-    audio_system = launch_audio_playback(std::move(audio), clock);
-  } catch (std::exception &ex) {
-    std::println("Error opening audio stream: {}", ex.what());
+  if (auto audio = audio_future.get()) {
+    try {
+      audio_system = launch_audio_playback(std::move(audio), clock);
+    } catch (std::exception &ex) {
+      std::println("Error opening audio stream: {}", ex.what());
+    }
   }
 
+  int exit_code = 0;
   for (i32 i = 0; !window->shouldClose(); ++i) {
+    AllocationCounter allocations;
     vkfw::pollEvents();
     vk.get_temp_pools().garbage_collect();
 
@@ -210,34 +315,43 @@ int main(int argc, char *argv[]) {
                                    std::numeric_limits<i64>::max());
     // once work is done, we can free all dependencies
     cmd_buf_dependencies[fif_idx].clear();
+    composited_frames[fif_idx].clear();
+    // every lock is gone before the arena is reset (even if the last frame
+    // was interrupted)
+    for (auto &composited : composited_frames)
+      composited.unlock();
+    frame_arena.reset();
+    image_views.next_frame();
+    pipelines.collect();
     try {
       auto [result, img_idx] = swapchain.acquireNextImage(
           std::numeric_limits<u64>::max(), image_acquire_sems[fif_idx]);
-      auto video_frame = video->get_frame(clock.get_time());
-      auto locked_frame_data =
-          video_frame.transform([](auto &frame) { return frame.data->lock(); });
+      auto video_frame = compositor
+                             ? std::nullopt
+                             : video->get_frame(clock.get_time());
+      auto locked_frame_data = video_frame.transform(
+          [&](auto &frame) { return frame.data->lock(&frame_arena); });
       auto planes =
           locked_frame_data
               .transform([](auto &data) { return data->get_planes(); })
-              .value_or(std::vector<VideoFramePlane *>{});
-      auto pipeline = pipelines.get(
+              .value_or(VideoFramePlanes{});
+      // nothing is drawn while the pipeline is being created
+      auto pipeline = pipelines.try_get(
           VideoPipelineInfo{
               .plane_formats =
                   planes | std::ranges::views::transform([](const auto &plane) {
                     return plane->get_format();
                   }) |
-                  std::ranges::to<std::vector>(),
+                  std::ranges::to<VideoPlaneFormats>(),
               .color_attachment_format = swapchain_format,
               .pixel_format = video_frame.has_value()
                                   ? video_frame->frame_format
                                   : AV_PIX_FMT_NONE,
           },
           vk.get_device(), FIF_CNT);
-      auto views =
-          planes | std::ranges::views::transform([&](const auto &plane) {
-            return pipeline->create_image_view(vk.get_device(), *plane);
-          }) |
-          std::ranges::to<std::vector>();
+      if (pipeline)
+        pipeline->mark_used(cmd_buf_end_sems[fif_idx],
+                            cmd_buf_sem_values[fif_idx] + 1);
       if (video_frame.has_value()) {
         (*locked_frame_data)
             ->layout_transition(video_frame->frame_index,
@@ -246,23 +360,13 @@ int main(int argc, char *argv[]) {
                                 vk::PipelineStageFlagBits2::eFragmentShader,
                                 vk::AccessFlagBits2::eShaderSampledRead,
                                 vk::ImageLayout::eShaderReadOnlyOptimal);
-
-        vk::DescriptorImageInfo desc_sampler{
-            .sampler = pipeline->sampler,
-            .imageView = views.front(),
-            .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
-        };
-
-        // update desc set
-        vk.get_device().updateDescriptorSets(
-            vk::WriteDescriptorSet{
-                .dstSet = *pipeline->descriptor_sets[fif_idx],
-                .dstBinding = 0,
-                .descriptorCount = 1,
-                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-                .pImageInfo = &desc_sampler,
-            },
-            {});
+      }
+      if (video_frame.has_value() && pipeline) {
+        pipeline->bind_image(
+            vk.get_device(), fif_idx,
+            pipeline->get_image_view(vk.get_device(), image_views,
+                                     *planes.front(),
+                                     video_frame->data->get_image_owner()));
       }
 
       // record cmdbuf
@@ -307,7 +411,7 @@ int main(int argc, char *argv[]) {
           .layerCount = 1,
       }
                                  .setColorAttachments(color_attachment));
-      if (locked_frame_data.has_value()) {
+      if (locked_frame_data.has_value() && pipeline) {
         auto &data = **locked_frame_data;
         cmd_buf.setViewport(
             0, vk::Viewport{
@@ -343,6 +447,14 @@ int main(int argc, char *argv[]) {
         cmd_buf.draw(3, 1, 0, 0);
       }
 
+      auto &composited = composited_frames[fif_idx];
+      if (compositor)
+        compositor->record(cmd_buf, fif_idx, clock.get_time(),
+                           swapchain_extent, composited, &frame_arena);
+      std::span<VideoFramePlane *const> submit_planes = planes;
+      if (compositor)
+        submit_planes = composited.planes;
+
       cmd_buf.endRendering();
 
       // transition: eTransferDstOptimal -> ePresentSrcKHR
@@ -372,13 +484,13 @@ int main(int argc, char *argv[]) {
         vk::CommandBufferSubmitInfo cmd_buf_info{
             .commandBuffer = cmd_buf,
         };
-        std::vector<vk::SemaphoreSubmitInfo> wait_sem_info{
+        wait_sem_info.assign({
             {
                 .semaphore = image_acquire_sems[fif_idx],
                 .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
             },
-        };
-        std::vector<vk::SemaphoreSubmitInfo> sig_sem_info{
+        });
+        sig_sem_info.assign({
             {
                 .semaphore = cmd_buf_end_sems[fif_idx],
                 .value = ++cmd_buf_sem_values[fif_idx],
@@ -388,8 +500,8 @@ int main(int argc, char *argv[]) {
                 .semaphore = image_present_sems[img_idx],
                 .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
             },
-        };
-        for (auto &plane : planes) {
+        });
+        for (auto *plane : submit_planes) {
           wait_sem_info.push_back(plane->wait_sem_info());
           sig_sem_info.push_back(plane->signal_sem_info(
               vk::PipelineStageFlagBits2::eFragmentShader));
@@ -405,11 +517,8 @@ int main(int argc, char *argv[]) {
         }
 
         cmd_buf_dependencies[fif_idx].push_back(std::move(video_frame));
-        cmd_buf_dependencies[fif_idx].push_back(std::move(views));
-        // for now the pipeline is cached indefinitely, but if we use some
-        // strategy like LRU caching, we must ensure that the pipeline live at
-        // least as long as command buffer execution
-        cmd_buf_dependencies[fif_idx].push_back(std::move(pipeline));
+        // the composited frames are kept until the commands are done
+        composited.unlock();
       }
 
       {
@@ -420,13 +529,29 @@ int main(int argc, char *argv[]) {
                 .setImageIndices(img_idx)
                 .setSwapchains(*swapchain));
       }
+      if (i == 0) {
+        startup.mark("first frame");
+        if (print_startup_times)
+          startup.print();
+      }
     } catch (vk::OutOfDateKHRError) {
       recreate_swapchain();
     }
+
+    if (alloc_check_frames.has_value() && i >= alloc_check_warmup) {
+      if (auto count = allocations.get(); count > 0) {
+        std::println(std::cerr, "Frame {} made {} heap allocation(s)", i,
+                     count);
+        exit_code = 1;
+        break;
+      }
+      if (i + 1 >= alloc_check_warmup + *alloc_check_frames)
+        break;
+    }
   }
 
   vk.get_device().waitIdle();
-  return 0;
+  return exit_code;
 }
 
 template <class T> class WeightedRunningAvg {
@@ -0,0 +1,105 @@
+import std;
+import vulkan_hpp;
+import vkvideo;
+
+using namespace vkvideo;
+using namespace vkvideo::medias;
+using namespace vkvideo::graphics;
+using namespace vkvideo::tp;
+
+// measures the time to the first frame of a video, the way vkvideo_player
+// starts up, but headless (no window, no audio device), and prints how long
+// each step took
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0]
+              << " <input.mkv> [--serial] [--no-validation]" << std::endl;
+    return 1;
+  }
+
+  bool parallel = true, validation = true;
+  for (i32 i = 2; i < argc; ++i) {
+    std::string_view arg{argv[i]};
+    if (arg == "--serial") {
+      parallel = false;
+    } else if (arg == "--no-validation") {
+      validation = false;
+    } else {
+      std::println(std::cerr, "Unknown argument: {}", arg);
+      return 1;
+    }
+  }
+
+  ffmpeg::Instance ffmpeg;
+  StartupScheduler startup{parallel};
+  std::string_view path{argv[1]};
+
+  auto vk_future = startup.spawn("create vulkan context", [&]() {
+    return std::make_unique<VkContext>(VkContextOptions{
+        .headless = true,
+        .validation = validation,
+        .video_encode = false,
+    });
+  });
+  auto probe_future =
+      startup.spawn("probe video", [&]() -> std::optional<RawFFmpegStream> {
+        if (is_webp_path(path))
+          return std::nullopt;
+        return RawFFmpegStream{path, ffmpeg::MediaType::Video};
+      });
+  auto shaders_future =
+      startup.spawn("compile video shaders", &VideoPipeline::prepare_shaders);
+  auto audio_future =
+      startup.spawn("open audio", [&]() -> std::unique_ptr<Audio> {
+        try {
+          return std::make_unique<AudioStream>(
+              path, AudioFormat{
+                        .sample_fmt = ffmpeg::SampleFormat::AV_SAMPLE_FMT_FLT,
+                        .ch_layout = ffmpeg::ch_layout_stereo,
+                        .sample_rate = 48000,
+                    });
+        } catch (std::exception &) {
+          // e.g. no audio stream
+          return nullptr;
+        }
+      });
+
+  auto vk_ptr = vk_future.get();
+  auto &vk = *vk_ptr;
+
+  auto video = startup.run("open video", [&]() {
+    if (auto probed = probe_future.get())
+      return open_video(vk, std::move(*probed));
+    return open_video(vk, path);
+  });
+  auto frame = startup.run("decode first frame",
+                           [&]() { return video->get_frame(0); });
+  if (!frame.has_value()) {
+    std::println(std::cerr, "No frame in {}", path);
+    return 1;
+  }
+
+  shaders_future.get();
+  VideoPipelineCache pipelines;
+  startup.run("create video pipeline", [&]() {
+    auto data = frame->data->lock();
+    auto planes = data->get_planes();
+    pipelines.get(
+        VideoPipelineInfo{
+            .plane_formats =
+                planes | std::ranges::views::transform([](const auto &plane) {
+                  return plane->get_format();
+                }) |
+                std::ranges::to<VideoPlaneFormats>(),
+            .color_attachment_format = vk::Format::eR8G8B8A8Unorm,
+            .pixel_format = frame->frame_format,
+        },
+        vk.get_device(), 1);
+  });
+  audio_future.get();
+  startup.mark("first frame");
+
+  startup.print();
+  vk.get_device().waitIdle();
+  return 0;
+}
@@ -0,0 +1,43 @@
+import std;
+import vkvideo;
+
+using namespace vkvideo;
+using namespace vkvideo::medias;
+using namespace vkvideo::tp;
+
+// writes a scrub bar sprite sheet (<input stem>_thumbnails.png, in the
+// current directory) for every input, the inputs are decoded in parallel
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    std::cerr << "Usage: " << argv[0] << " <interval (seconds)> <input>..."
+              << std::endl;
+    return 1;
+  }
+
+  ffmpeg::Instance ffmpeg;
+
+  PreviewOptions options{
+      .interval = static_cast<i64>(std::atof(argv[1]) * 1e9),
+  };
+  if (options.interval <= 0) {
+    std::println(std::cerr, "Invalid interval: {}", argv[1]);
+    return 1;
+  }
+
+  std::vector<std::string> paths{argv + 2, argv + argc};
+  auto start = std::chrono::steady_clock::now();
+  auto previews = extract_previews(paths, options);
+
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    auto output = std::filesystem::path{paths[i]}.stem().string() +
+                  "_thumbnails.png";
+    make_preview_atlas(previews[i], options).write(output);
+    std::println("{}: {} tiles", output, previews[i].size());
+  }
+
+  std::println("done in {:.2f}s",
+               std::chrono::duration<double>{
+                   std::chrono::steady_clock::now() - start}
+                   .count());
+  return 0;
+}
@@ -1,4 +1,5 @@
 extern "C" {
+#include <libavcodec/avcodec.h>
 #include <libavutil/hwcontext.h>
 #include <libavutil/hwcontext_vulkan.h>
 }
@@ -19,49 +20,236 @@ using namespace vkvideo::tp;
 constexpr vk::Format RENDER_TARGET_FORMAT = vk::Format::eR32G32B32A32Sfloat;
 constexpr vk::Extent2D RENDER_TARGET_EXTENT{1920, 1080};
 constexpr i64 FPS = 60, DURATION = 10e9, NUM_FRAMES = DURATION / 1e9 * FPS;
-constexpr ffmpeg::PixelFormat SW_PIX_FMT = ffmpeg::PixelFormat::AV_PIX_FMT_NV12;
 
-ffmpeg::BufferRef init_codec_ctx(ffmpeg::CodecContext &cc,
-                                 AVBufferRef *hw_device_ctx) {
-  cc->width = RENDER_TARGET_EXTENT.width;
-  cc->height = RENDER_TARGET_EXTENT.height;
-  cc->time_base = {1, FPS};
-  cc->framerate = {FPS, 1};
-  cc->sample_aspect_ratio = {1, 1};
-  cc->pix_fmt = ffmpeg::PixelFormat::AV_PIX_FMT_VULKAN;
-  cc->sw_pix_fmt = SW_PIX_FMT;
-  // 0.1 bit per pixel
-  cc->bit_rate =
-      RENDER_TARGET_EXTENT.width * RENDER_TARGET_EXTENT.height * FPS * 0.1;
+// Vulkan frames of the given software format, in the output extent
+ffmpeg::BufferRef create_frames_ctx(AVBufferRef *hw_device_ctx,
+                                    ffmpeg::PixelFormat sw_format,
+                                    vk::ImageUsageFlags usage) {
   ffmpeg::BufferRef hw_frames_ctx{av_hwframe_ctx_alloc(hw_device_ctx)};
-  assert(cc->hw_frames_ctx = av_buffer_ref(hw_frames_ctx.get()));
+  assert(hw_frames_ctx);
   auto &frames_ctx =
       *reinterpret_cast<AVHWFramesContext *>(hw_frames_ctx->data);
   frames_ctx.format = tp::ffmpeg::PixelFormat::AV_PIX_FMT_VULKAN;
-  frames_ctx.sw_format = cc->sw_pix_fmt;
-  frames_ctx.width = cc->width;
-  frames_ctx.height = cc->height;
+  frames_ctx.sw_format = sw_format;
+  frames_ctx.width = RENDER_TARGET_EXTENT.width;
+  frames_ctx.height = RENDER_TARGET_EXTENT.height;
   auto vk_frames_ctx = static_cast<AVVulkanFramesContext *>(frames_ctx.hwctx);
   vk_frames_ctx->usage = static_cast<decltype(vk_frames_ctx->usage)>(
-      static_cast<VkImageUsageFlags>(
-          vk::ImageUsageFlagBits::eStorage |
-          vk::ImageUsageFlagBits::eTransferSrc |
-          vk::ImageUsageFlagBits::eVideoEncodeSrcKHR));
+      static_cast<VkImageUsageFlags>(usage));
   if (auto [w, h, d] =
           vk::blockExtent(static_cast<vk::Format>(vk_frames_ctx->format[0]));
       w * h * d > 1) {
     vk_frames_ctx->img_flags |= static_cast<decltype(vk_frames_ctx->img_flags)>(
         vk::ImageCreateFlagBits::eBlockTexelViewCompatible);
   }
-  ffmpeg::av_call(av_hwframe_ctx_init(cc->hw_frames_ctx));
+  ffmpeg::av_call(av_hwframe_ctx_init(hw_frames_ctx.get()));
+  return hw_frames_ctx;
+}
+
+// software encoders are fed through a FrameReadback
+bool is_hw_encoder(ffmpeg::Codec codec) {
+  return codec->capabilities & AV_CODEC_CAP_HARDWARE;
+}
+
+// the YUV format the frames are converted to on the GPU, for software
+// encoders the first of their formats that the rescalers can write
+ffmpeg::PixelFormat choose_sw_format(ffmpeg::Codec codec) {
+  const void *configs = nullptr;
+  int num_configs = 0;
+  ffmpeg::av_call(avcodec_get_supported_config(nullptr, codec,
+                                               AV_CODEC_CONFIG_PIX_FORMAT, 0,
+                                               &configs, &num_configs));
+  if (is_hw_encoder(codec) || !configs)
+    return ffmpeg::PixelFormat::AV_PIX_FMT_NV12;
+  for (auto fmt : std::span{static_cast<const ffmpeg::PixelFormat *>(configs),
+                            static_cast<std::size_t>(num_configs)})
+    if (fmt == AV_PIX_FMT_NV12 || fmt == AV_PIX_FMT_YUV420P)
+      return fmt;
+  throw std::runtime_error{
+      std::format("encoder {} does not take NV12 or YUV420P", codec->name)};
+}
+
+// returns the frames context that the GPU writes the output frames to
+ffmpeg::BufferRef init_codec_ctx(ffmpeg::CodecContext &cc, ffmpeg::Codec codec,
+                                 ffmpeg::PixelFormat sw_pix_fmt,
+                                 AVBufferRef *hw_device_ctx) {
+  cc->width = RENDER_TARGET_EXTENT.width;
+  cc->height = RENDER_TARGET_EXTENT.height;
+  cc->time_base = {1, FPS};
+  cc->framerate = {FPS, 1};
+  cc->sample_aspect_ratio = {1, 1};
+  // 0.1 bit per pixel
+  cc->bit_rate =
+      RENDER_TARGET_EXTENT.width * RENDER_TARGET_EXTENT.height * FPS * 0.1;
+
+  vk::ImageUsageFlags usage = vk::ImageUsageFlagBits::eStorage |
+                              vk::ImageUsageFlagBits::eTransferSrc |
+                              vk::ImageUsageFlagBits::eTransferDst;
+  if (!is_hw_encoder(codec)) {
+    cc->pix_fmt = sw_pix_fmt;
+    // one thread per core, frame threading where the encoder supports it
+    cc->thread_count = static_cast<int>(std::thread::hardware_concurrency());
+    cc->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    return create_frames_ctx(hw_device_ctx, sw_pix_fmt, usage);
+  }
+
+  cc->pix_fmt = ffmpeg::PixelFormat::AV_PIX_FMT_VULKAN;
+  cc->sw_pix_fmt = sw_pix_fmt;
+  auto hw_frames_ctx = create_frames_ctx(
+      hw_device_ctx, sw_pix_fmt,
+      usage | vk::ImageUsageFlagBits::eVideoEncodeSrcKHR);
+  assert(cc->hw_frames_ctx = av_buffer_ref(hw_frames_ctx.get()));
   return hw_frames_ctx;
 }
 
+// identifies the source frame an output frame is made from
+struct FrameSource {
+  // kept alive, so that the pointer can not be reused by another frame
+  std::shared_ptr<VideoFrameData> data;
+  std::optional<i32> frame_index;
+
+  bool operator==(const FrameSource &) const = default;
+
+  static FrameSource of(const std::optional<VideoFrame> &video_frame) {
+    if (!video_frame.has_value())
+      return {};
+    return {video_frame->data, video_frame->frame_index};
+  }
+};
+
+// how a video frame gets into the output frame
+enum class FrameRoute {
+  eRender, // drawn by the VideoPipeline, then converted back to YUV
+  eCopy,   // decoded in the output format and extent, copied as is
+  eResize, // decoded in the output format, resized plane by plane
+};
+
+// decoded frames that need no compositing skip the RGBA32F render target
+FrameRoute choose_route(const VideoFrame &video_frame,
+                        const LockedVideoFrameData &data,
+                        ffmpeg::PixelFormat sw_pix_fmt) {
+  if (video_frame.frame_format != sw_pix_fmt ||
+      !dynamic_cast<FFmpegVideoFrameData *>(video_frame.data.get()))
+    return FrameRoute::eRender;
+  auto [width, height] = data.get_extent();
+  if (width == static_cast<i32>(RENDER_TARGET_EXTENT.width) &&
+      height == static_cast<i32>(RENDER_TARGET_EXTENT.height))
+    return FrameRoute::eCopy;
+  return FrameRoute::eResize;
+}
+
+// draws the video frame (if any) into the render target, the commands are
+// done once render_sem reaches render_value
+void record_render(VkContext &vk, vk::raii::CommandBuffer &render_cmd,
+                   TimelineSemaphore &render_sem, u64 render_value,
+                   VideoPipelineCache &pipelines, ImageViewCache &image_views,
+                   const std::optional<VideoFrame> &video_frame,
+                   std::optional<ArenaPtr<LockedVideoFrameData>>
+                       &locked_video_frame_data,
+                   const VideoFramePlanes &planes,
+                   vk::Image render_target,
+                   const vk::raii::ImageView &render_target_view) {
+  auto pipeline = pipelines.get(
+      VideoPipelineInfo{
+          .plane_formats =
+              planes | std::ranges::views::transform([](const auto &plane) {
+                return plane->get_format();
+              }) |
+              std::ranges::to<VideoPlaneFormats>(),
+          .color_attachment_format = RENDER_TARGET_FORMAT,
+          .pixel_format = video_frame.has_value() ? video_frame->frame_format
+                                                  : AV_PIX_FMT_NONE,
+      },
+      vk.get_device(), 1);
+  pipeline->mark_used(render_sem, render_value);
+  if (video_frame.has_value())
+    pipeline->bind_image(
+        vk.get_device(), 0,
+        pipeline->get_image_view(vk.get_device(), image_views, *planes.front(),
+                                 video_frame->data->get_image_owner()));
+
+  // transition: eUndefined -> eColorAttachmentOptimal
+  {
+    vk::ImageMemoryBarrier2 sc_img_trans{
+        .srcStageMask = vk::PipelineStageFlagBits2::eNone,
+        .srcAccessMask = vk::AccessFlagBits2::eNone,
+        .dstStageMask = vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+        .dstAccessMask = vk::AccessFlagBits2::eColorAttachmentWrite |
+                         vk::AccessFlagBits2::eColorAttachmentRead,
+        .oldLayout = vk::ImageLayout::eUndefined,
+        .newLayout = vk::ImageLayout::eColorAttachmentOptimal,
+        .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
+        .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
+        .image = render_target,
+        .subresourceRange = {
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .levelCount = 1,
+            .layerCount = 1,
+        }};
+    render_cmd.pipelineBarrier2(
+        vk::DependencyInfo{}.setImageMemoryBarriers(sc_img_trans));
+  }
+
+  // here we use the huge ass graphics pipeline
+  vk::RenderingAttachmentInfo color_attachment{
+      .imageView = render_target_view,
+      .imageLayout = vk::ImageLayout::eColorAttachmentOptimal,
+      .loadOp = vk::AttachmentLoadOp::eClear,
+      .storeOp = vk::AttachmentStoreOp::eStore,
+      .clearValue = {vk::ClearColorValue{
+          .float32 = std::array<float, 4>{0.0f, 0.0f, 0.2f, 1.0f},
+      }},
+  };
+  render_cmd.beginRendering(vk::RenderingInfo{
+      .renderArea = {{0, 0}, RENDER_TARGET_EXTENT},
+      .layerCount = 1,
+  }
+                                .setColorAttachments(color_attachment));
+  if (locked_video_frame_data.has_value()) {
+    auto &data = **locked_video_frame_data;
+    render_cmd.setViewport(
+        0, vk::Viewport{
+               .x = 0,
+               .y = 0,
+               .width = static_cast<float>(RENDER_TARGET_EXTENT.width),
+               .height = static_cast<float>(RENDER_TARGET_EXTENT.height),
+           });
+    render_cmd.setScissor(0, vk::Rect2D{
+                                 .offset = {0, 0},
+                                 .extent = RENDER_TARGET_EXTENT,
+                             });
+    render_cmd.bindPipeline(vk::PipelineBindPoint::eGraphics,
+                            pipeline->pipeline);
+    render_cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                  pipeline->pipeline_layout, 0,
+                                  *pipeline->descriptor_sets.front(), {});
+    auto [width, height] = data.get_extent();
+    auto [padded_width, padded_height] = data.get_padded_extent();
+    render_cmd.pushConstants<FrameInfoPushConstants>(
+        pipeline->pipeline_layout, vk::ShaderStageFlagBits::eFragment, 0,
+        FrameInfoPushConstants{
+            .uv_max =
+                {
+                    static_cast<float>(width) /
+                        static_cast<float>(padded_width),
+                    static_cast<float>(height) /
+                        static_cast<float>(padded_height),
+                },
+            .frame_index =
+                static_cast<float>(video_frame->frame_index.value_or(0.0f)),
+        });
+    render_cmd.draw(3, 1, 0, 0);
+  }
+
+  render_cmd.endRendering();
+}
+
 int main(int argc, char *argv[]) {
   namespace vkr = vk::raii;
 
   if (argc < 3) {
-    std::cerr << "Usage: " << argv[0] << " <input.mkv> <output.mkv>"
+    std::cerr << "Usage: " << argv[0]
+              << " <input.mkv> <output.mkv> [encoder=h264_vulkan]"
               << std::endl;
     return 1;
   }
@@ -69,14 +257,47 @@ int main(int argc, char *argv[]) {
   ffmpeg::Instance ffmpeg;
   VkContext vk{true};
 
-  auto video = medias::open_video(vk, argv[1]);
-
-  OutputContext output_ctx{argv[2]};
-  auto &&[stream, codec_ctx] =
-      output_ctx.add_stream(ffmpeg::find_enc_codec("h264_vulkan"));
-  auto hw_frames_ctx = init_codec_ctx(codec_ctx, vk.get_hwaccel_ctx().get());
+  // streamed with hwaccel, so that decoded frames can skip the render target
+  auto video =
+      medias::open_video(vk, argv[1], {.mode = medias::DecodeMode::eStream});
+
+  // encoding and muxing must not stall the render loop. Pipes (e.g. pipe:1)
+  // get a fragmented MP4 with one-second segments, that readers can play
+  // while the transcode is running
+  bool streaming = std::string_view{argv[2]}.starts_with("pipe:");
+  OutputOptions output_options{.async = true};
+  if (streaming)
+    output_options.streaming = StreamingOptions{
+        .segment_duration = 1.0,
+        .on_segment =
+            [](const SegmentInfo &info) {
+              std::cerr << std::format("segment {}: {:.2f}s, {} bytes",
+                                       info.index, info.duration, info.bytes)
+                        << std::endl;
+            },
+    };
+  OutputContext output_ctx{argv[2], std::move(output_options)};
+  auto codec = ffmpeg::find_enc_codec(argc > 3 ? argv[3] : "h264_vulkan");
+  if (!codec) {
+    std::cerr << "Encoder not found" << std::endl;
+    return 1;
+  }
+  auto sw_pix_fmt = choose_sw_format(codec);
+  auto &&[stream, codec_ctx] = output_ctx.add_stream(codec);
+  auto hw_frames_ctx = init_codec_ctx(codec_ctx, codec, sw_pix_fmt,
+                                      vk.get_hwaccel_ctx().get());
+  // segments are cut on keyframes
+  if (streaming)
+    codec_ctx->gop_size = FPS;
   output_ctx.init(stream.index);
 
+  // frames for software encoders are read back while the next ones render
+  std::unique_ptr<FrameReadback> readback = nullptr;
+  if (!is_hw_encoder(codec))
+    readback = std::make_unique<FrameReadback>(
+        vk, sw_pix_fmt, RENDER_TARGET_EXTENT.width,
+        RENDER_TARGET_EXTENT.height);
+
   vkr::CommandPool pool{
       vk.get_device(),
       vk::CommandPoolCreateInfo{
@@ -136,189 +357,157 @@ int main(int argc, char *argv[]) {
   TimelineSemaphore render_sem{vk.get_device(), 0, "render_sem"};
 
   VideoPipelineCache pipelines;
+  ImageViewCache image_views;
   std::unique_ptr<HwVideoRescaler> video_rescaler = nullptr;
+  std::unique_ptr<YuvVideoResizer> video_resizer = nullptr;
 
   output_ctx.begin();
 
+  // the source of the last rendered output frame, and that frame (for
+  // hardware encoders, software ones keep it in the readback)
+  std::optional<FrameSource> last_source;
+  ffmpeg::Frame last_output = nullptr;
+
   for (i32 i = 0; i < NUM_FRAMES; ++i) {
     vk.get_temp_pools().garbage_collect();
+    pipelines.collect();
+    image_views.next_frame();
+
+    // when up-converting the frame rate, the same source frame is returned
+    // several times in a row, and the last output frame is sent again (which
+    // encoders turn into cheap skipped blocks) instead of rendering it again
+    auto video_frame = video->get_frame(i * 1e9 / FPS);
+    auto source = FrameSource::of(video_frame);
+    if (source == last_source) {
+      if (readback) {
+        while (readback->full())
+          output_ctx.write_frame(readback->take(), 0);
+        readback->submit_duplicate(i);
+      } else {
+        auto duplicate = ffmpeg::Frame::create();
+        duplicate.ref_to(last_output);
+        duplicate->pts = i;
+        output_ctx.write_frame(duplicate, 0);
+      }
+      continue;
+    }
+    last_source = std::move(source);
 
     auto out_frame = ffmpeg::Frame::create();
     ffmpeg::av_call(
         av_hwframe_get_buffer(hw_frames_ctx.get(), out_frame.get(), 0));
     out_frame->pts = i;
     auto &frame_data = *reinterpret_cast<AVVkFrame *>(out_frame->data[0]);
-    get_cached_hw_rescaler(video_rescaler, vk.get_device(), SW_PIX_FMT);
     std::vector<vk::Image> images;
     for (auto img : frame_data.img)
       if (img)
         images.push_back(static_cast<vk::Image>(img));
-    auto rescale_deps =
-        video_rescaler->bind_images(vk.get_device(), *render_target, images);
     FFmpegVideoFrameData output_frame{std::move(out_frame)};
+    // image views must outlive the commands
+    UniqueAny rescale_deps;
+    // layout of the output frame after the commands
+    vk::ImageLayout output_layout;
 
     {
       auto locked_output_frame = output_frame.lock();
 
-      auto video_frame = video->get_frame(i * 1e9 / FPS);
       auto locked_video_frame_data =
           video_frame.transform([](auto &frame) { return frame.data->lock(); });
       auto planes =
           locked_video_frame_data
               .transform([](auto &data) { return data->get_planes(); })
-              .value_or(std::vector<VideoFramePlane *>{});
-      auto pipeline = pipelines.get(
-          VideoPipelineInfo{
-              .plane_formats =
-                  planes | std::ranges::views::transform([](const auto &plane) {
-                    return plane->get_format();
-                  }) |
-                  std::ranges::to<std::vector>(),
-              .color_attachment_format = RENDER_TARGET_FORMAT,
-              .pixel_format = video_frame.has_value()
-                                  ? video_frame->frame_format
-                                  : AV_PIX_FMT_NONE,
-          },
-          vk.get_device(), 1);
-      auto views =
-          planes | std::ranges::views::transform([&](const auto &plane) {
-            return pipeline->create_image_view(vk.get_device(), *plane);
-          }) |
-          std::ranges::to<std::vector>();
-
-      if (video_frame.has_value()) {
+              .value_or(VideoFramePlanes{});
+      auto route = video_frame.has_value()
+                       ? choose_route(*video_frame, **locked_video_frame_data,
+                                      sw_pix_fmt)
+                       : FrameRoute::eRender;
+
+      // how the video frame is read, and how the output frame is written
+      vk::PipelineStageFlags2 input_stage, output_stage;
+      vk::AccessFlags2 input_access, output_access;
+      vk::ImageLayout input_layout;
+      switch (route) {
+      case FrameRoute::eRender:
+        get_cached_hw_rescaler(video_rescaler, vk.get_device(), sw_pix_fmt);
+        rescale_deps = video_rescaler->bind_images(vk.get_device(),
+                                                   *render_target, images);
+        input_stage = vk::PipelineStageFlagBits2::eFragmentShader;
+        input_access = vk::AccessFlagBits2::eShaderSampledRead;
+        input_layout = vk::ImageLayout::eShaderReadOnlyOptimal;
+        output_stage = video_rescaler->pipeline_stage_flags();
+        output_access = video_rescaler->output_access_flags();
+        output_layout = vk::ImageLayout::eGeneral;
+        break;
+      case FrameRoute::eCopy:
+        input_stage = output_stage = vk::PipelineStageFlagBits2::eTransfer;
+        input_access = vk::AccessFlagBits2::eTransferRead;
+        input_layout = vk::ImageLayout::eTransferSrcOptimal;
+        output_access = vk::AccessFlagBits2::eTransferWrite;
+        output_layout = vk::ImageLayout::eTransferDstOptimal;
+        break;
+      case FrameRoute::eResize:
+        if (!video_resizer)
+          video_resizer =
+              std::make_unique<YuvVideoResizer>(vk.get_device(), sw_pix_fmt);
+        rescale_deps = video_resizer->bind_images(
+            vk.get_device(),
+            planes | std::ranges::views::transform([](const auto &plane) {
+              return plane->get_image();
+            }) | std::ranges::to<std::vector>(),
+            images, video_frame->data->get_image_owner());
+        input_stage = output_stage = video_resizer->pipeline_stage_flags();
+        input_access = video_resizer->source_access_flags();
+        input_layout = video_resizer->source_image_layout();
+        output_access = video_resizer->target_access_flags();
+        output_layout = video_resizer->target_image_layout();
+        break;
+      }
+
+      if (video_frame.has_value())
         (*locked_video_frame_data)
             ->layout_transition(video_frame->frame_index,
                                 vk.get_queues().get_qf_graphics(),
-                                vk.get_temp_pools(),
-                                vk::PipelineStageFlagBits2::eFragmentShader,
-                                vk::AccessFlagBits2::eShaderSampledRead,
-                                vk::ImageLayout::eShaderReadOnlyOptimal);
-
-        vk::DescriptorImageInfo desc_sampler{
-            .sampler = pipeline->sampler,
-            .imageView = views.front(),
-            .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
-        };
-
-        // update desc set
-        vk.get_device().updateDescriptorSets(
-            vk::WriteDescriptorSet{
-                .dstSet = *pipeline->descriptor_sets.front(),
-                .dstBinding = 0,
-                .descriptorCount = 1,
-                .descriptorType = vk::DescriptorType::eCombinedImageSampler,
-                .pImageInfo = &desc_sampler,
-            },
-            {});
-      }
+                                vk.get_temp_pools(), input_stage, input_access,
+                                input_layout);
 
       // record cmdbuf
       render_cmd.begin(vk::CommandBufferBeginInfo{
           .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
 
-      // transition: eUndefined -> eTransferDstOptimal
-      {
-        vk::ImageMemoryBarrier2 sc_img_trans{
-            .srcStageMask = vk::PipelineStageFlagBits2::eNone,
-            .srcAccessMask = vk::AccessFlagBits2::eNone,
-            .dstStageMask = vk::PipelineStageFlagBits2::eColorAttachmentOutput,
-            .dstAccessMask = vk::AccessFlagBits2::eColorAttachmentWrite |
-                             vk::AccessFlagBits2::eColorAttachmentRead,
-            .oldLayout = vk::ImageLayout::eUndefined,
-            .newLayout = vk::ImageLayout::eColorAttachmentOptimal,
-            .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
-            .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
-            .image = *render_target,
-            .subresourceRange = {
-                .aspectMask = vk::ImageAspectFlagBits::eColor,
-                .levelCount = 1,
-                .layerCount = 1,
-            }};
-        render_cmd.pipelineBarrier2(
-            vk::DependencyInfo{}.setImageMemoryBarriers(sc_img_trans));
-      }
-
-      // here we use the huge ass graphics pipeline
-      vk::RenderingAttachmentInfo color_attachment{
-          .imageView = render_target_views,
-          .imageLayout = vk::ImageLayout::eColorAttachmentOptimal,
-          .loadOp = vk::AttachmentLoadOp::eClear,
-          .storeOp = vk::AttachmentStoreOp::eStore,
-          .clearValue = {vk::ClearColorValue{
-              .float32 = std::array<float, 4>{0.0f, 0.0f, 0.2f, 1.0f},
-          }},
-      };
-      render_cmd.beginRendering(vk::RenderingInfo{
-          .renderArea = {{0, 0}, RENDER_TARGET_EXTENT},
-          .layerCount = 1,
-      }
-                                    .setColorAttachments(color_attachment));
-      if (locked_video_frame_data.has_value()) {
-        auto &data = **locked_video_frame_data;
-        render_cmd.setViewport(
-            0, vk::Viewport{
-                   .x = 0,
-                   .y = 0,
-                   .width = static_cast<float>(RENDER_TARGET_EXTENT.width),
-                   .height = static_cast<float>(RENDER_TARGET_EXTENT.height),
-               });
-        render_cmd.setScissor(0, vk::Rect2D{
-                                     .offset = {0, 0},
-                                     .extent = RENDER_TARGET_EXTENT,
-                                 });
-        render_cmd.bindPipeline(vk::PipelineBindPoint::eGraphics,
-                                pipeline->pipeline);
-        render_cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
-                                      pipeline->pipeline_layout, 0,
-                                      *pipeline->descriptor_sets.front(), {});
-        auto [width, height] = data.get_extent();
-        auto [padded_width, padded_height] = data.get_padded_extent();
-        render_cmd.pushConstants<FrameInfoPushConstants>(
-            pipeline->pipeline_layout, vk::ShaderStageFlagBits::eFragment, 0,
-            FrameInfoPushConstants{
-                .uv_max =
-                    {
-                        static_cast<float>(width) /
-                            static_cast<float>(padded_width),
-                        static_cast<float>(height) /
-                            static_cast<float>(padded_height),
-                    },
-                .frame_index =
-                    static_cast<float>(video_frame->frame_index.value_or(0.0f)),
-            });
-        render_cmd.draw(3, 1, 0, 0);
-      }
-
-      render_cmd.endRendering();
+      if (route == FrameRoute::eRender)
+        record_render(vk, render_cmd, render_sem, i + 1, pipelines,
+                      image_views, video_frame, locked_video_frame_data,
+                      planes, *render_target, render_target_views);
 
       {
         std::vector<vk::ImageMemoryBarrier2> barriers;
 
-        barriers.push_back(vk::ImageMemoryBarrier2{
-            .srcStageMask = vk::PipelineStageFlagBits2::eColorAttachmentOutput,
-            .srcAccessMask = vk::AccessFlagBits2::eColorAttachmentWrite |
-                             vk::AccessFlagBits2::eColorAttachmentRead,
-            .dstStageMask = video_rescaler->pipeline_stage_flags(),
-            .dstAccessMask = video_rescaler->input_access_flags(),
-            .oldLayout = vk::ImageLayout::eColorAttachmentOptimal,
-            .newLayout = vk::ImageLayout::eGeneral,
-            .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
-            .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
-            .image = *render_target,
-            .subresourceRange = {
-                .aspectMask = vk::ImageAspectFlagBits::eColor,
-                .levelCount = 1,
-                .layerCount = 1,
-            }});
+        if (route == FrameRoute::eRender)
+          barriers.push_back(vk::ImageMemoryBarrier2{
+              .srcStageMask =
+                  vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+              .srcAccessMask = vk::AccessFlagBits2::eColorAttachmentWrite |
+                               vk::AccessFlagBits2::eColorAttachmentRead,
+              .dstStageMask = video_rescaler->pipeline_stage_flags(),
+              .dstAccessMask = video_rescaler->input_access_flags(),
+              .oldLayout = vk::ImageLayout::eColorAttachmentOptimal,
+              .newLayout = vk::ImageLayout::eGeneral,
+              .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
+              .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
+              .image = *render_target,
+              .subresourceRange = {
+                  .aspectMask = vk::ImageAspectFlagBits::eColor,
+                  .levelCount = 1,
+                  .layerCount = 1,
+              }});
         for (auto &plane : locked_output_frame->get_planes()) {
           barriers.push_back(vk::ImageMemoryBarrier2{
               .srcStageMask = plane->get_stage_flag(),
               .srcAccessMask = plane->get_access_flag(),
-              .dstStageMask = video_rescaler->pipeline_stage_flags(),
-              .dstAccessMask = video_rescaler->output_access_flags(),
+              .dstStageMask = output_stage,
+              .dstAccessMask = output_access,
               .oldLayout = vk::ImageLayout::eUndefined,
-              .newLayout = vk::ImageLayout::eGeneral,
+              .newLayout = output_layout,
               // TODO: assuming no queue family transfer needed
               .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
               .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
@@ -336,9 +525,35 @@ int main(int argc, char *argv[]) {
             vk::DependencyInfo{}.setImageMemoryBarriers(barriers));
       }
 
-      if (video_frame.has_value())
-        video_rescaler->rescale(render_cmd, RENDER_TARGET_EXTENT.width,
-                                RENDER_TARGET_EXTENT.height);
+      switch (route) {
+      case FrameRoute::eRender:
+        if (video_frame.has_value())
+          video_rescaler->rescale(render_cmd, RENDER_TARGET_EXTENT.width,
+                                  RENDER_TARGET_EXTENT.height);
+        break;
+      case FrameRoute::eCopy:
+        copy_frame_planes(
+            render_cmd,
+            planes | std::ranges::views::transform([](const auto &plane) {
+              return plane->get_image();
+            }) | std::ranges::to<std::vector>(),
+            input_layout, images, output_layout, sw_pix_fmt,
+            RENDER_TARGET_EXTENT.width, RENDER_TARGET_EXTENT.height);
+        break;
+      case FrameRoute::eResize: {
+        auto &data = **locked_video_frame_data;
+        auto [width, height] = data.get_extent();
+        auto [padded_width, padded_height] = data.get_padded_extent();
+        video_resizer->resize(
+            render_cmd,
+            {
+                static_cast<float>(width) / static_cast<float>(padded_width),
+                static_cast<float>(height) / static_cast<float>(padded_height),
+            },
+            RENDER_TARGET_EXTENT.width, RENDER_TARGET_EXTENT.height);
+        break;
+      }
+      }
 
       render_cmd.end();
 
@@ -353,8 +568,7 @@ int main(int argc, char *argv[]) {
       }};
       for (auto &plane : planes) {
         wait_sem_info.push_back(plane->wait_sem_info());
-        sig_sem_info.push_back(plane->signal_sem_info(
-            vk::PipelineStageFlagBits2::eFragmentShader));
+        sig_sem_info.push_back(plane->signal_sem_info(input_stage));
         plane->set_semaphore_value(plane->get_semaphore_value() + 1);
       }
 
@@ -367,11 +581,29 @@ int main(int argc, char *argv[]) {
       }
     }
 
+    if (readback) {
+      // encode the oldest frame on the CPU while this one renders
+      while (readback->full())
+        output_ctx.write_frame(readback->take(), 0);
+      readback->submit(output_frame.get(), output_layout,
+                       vk::SemaphoreSubmitInfo{
+                           .semaphore = render_sem,
+                           .value = static_cast<u64>(i + 1),
+                       });
+    }
+
     // FIXME: there are still some race conditions
     render_sem.wait(i + 1, std::numeric_limits<i64>::max());
-    output_ctx.write_frame(output_frame.get(), 0);
+    if (!readback) {
+      output_ctx.write_frame(output_frame.get(), 0);
+      last_output = ffmpeg::Frame::create();
+      last_output.ref_to(output_frame.get());
+    }
   }
 
+  while (readback && !readback->empty())
+    output_ctx.write_frame(readback->take(), 0);
+
   vk.get_device().waitIdle();
   output_ctx.end();
   return 0;
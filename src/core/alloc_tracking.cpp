@@ -0,0 +1,67 @@
+module;
+
+#include <cstdlib>
+#include <new>
+
+module vkvideo.core;
+
+import std;
+
+// only compiled with VKVIDEO_TRACK_ALLOCATIONS. The replaced operators are
+// linked into the program as long as it uses get_thread_allocation_count(),
+// as they are in the same object file.
+
+namespace {
+thread_local vkvideo::u64 thread_allocation_count = 0;
+
+void *allocate(std::size_t size, std::size_t alignment) {
+  ++thread_allocation_count;
+  size = std::max<std::size_t>(size, 1);
+  void *ptr;
+  if (alignment <= alignof(std::max_align_t)) {
+    ptr = std::malloc(size);
+  } else {
+    // aligned_alloc needs a multiple of the alignment
+    ptr = std::aligned_alloc(alignment,
+                             (size + alignment - 1) / alignment * alignment);
+  }
+  if (!ptr)
+    throw std::bad_alloc{};
+  return ptr;
+}
+} // namespace
+
+namespace vkvideo {
+u64 get_thread_allocation_count() { return thread_allocation_count; }
+} // namespace vkvideo
+
+// the replacements must be attached to the global module
+extern "C++" {
+void *operator new(std::size_t size) {
+  return allocate(size, alignof(std::max_align_t));
+}
+void *operator new[](std::size_t size) {
+  return allocate(size, alignof(std::max_align_t));
+}
+void *operator new(std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+void *operator new[](std::size_t size, std::align_val_t alignment) {
+  return allocate(size, static_cast<std::size_t>(alignment));
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+void operator delete[](void *ptr) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::size_t) noexcept { std::free(ptr); }
+void operator delete(void *ptr, std::align_val_t) noexcept { std::free(ptr); }
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete(void *ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+void operator delete[](void *ptr, std::size_t, std::align_val_t) noexcept {
+  std::free(ptr);
+}
+}
@@ -0,0 +1,34 @@
+export module vkvideo.core:alloc_tracking;
+
+import std;
+import :types;
+
+export namespace vkvideo {
+
+// heap allocations (through operator new) are only counted if the library is
+// built with VKVIDEO_TRACK_ALLOCATIONS, which replaces the global operator
+// new of the program
+#ifdef VKVIDEO_TRACK_ALLOCATIONS
+inline constexpr bool allocation_tracking = true;
+
+// number of allocations made by the calling thread so far
+u64 get_thread_allocation_count();
+#else
+inline constexpr bool allocation_tracking = false;
+
+inline u64 get_thread_allocation_count() { return 0; }
+#endif
+
+// counts the allocations made by the calling thread during its lifetime,
+// e.g. by one iteration of a frame loop
+class AllocationCounter {
+public:
+  AllocationCounter() : start{get_thread_allocation_count()} {}
+
+  u64 get() const { return get_thread_allocation_count() - start; }
+
+private:
+  u64 start;
+};
+
+} // namespace vkvideo
@@ -0,0 +1,97 @@
+export module vkvideo.core:arena;
+
+import std;
+import :types;
+
+export namespace vkvideo {
+
+// memory for short-lived objects (e.g. the frame locks of one frame), freed
+// all at once by reset(). Allocations come from a buffer allocated once, so
+// they are just pointer bumps, and only go to the heap if the buffer is
+// exhausted.
+class FrameArena {
+public:
+  FrameArena(std::size_t size = 16 * 1024)
+      : buffer{std::make_unique<std::byte[]>(size)},
+        resource{buffer.get(), size} {}
+
+  FrameArena(const FrameArena &) = delete;
+  FrameArena &operator=(const FrameArena &) = delete;
+
+  void *allocate(std::size_t size, std::size_t alignment) {
+    return resource.allocate(size, alignment);
+  }
+
+  // every object allocated from the arena must be destroyed before this
+  void reset() { resource.release(); }
+
+  std::pmr::memory_resource *get_resource() { return &resource; }
+
+private:
+  std::unique_ptr<std::byte[]> buffer;
+  std::pmr::monotonic_buffer_resource resource;
+};
+
+// destroys objects created by make_arena_ptr: the ones created in an arena
+// are only destroyed (their memory goes away with the arena), the others are
+// deleted
+struct ArenaDeleter {
+  bool in_arena = false;
+
+  template <class T> void operator()(T *ptr) const {
+    if (in_arena)
+      std::destroy_at(ptr);
+    else
+      delete ptr;
+  }
+};
+
+template <class T> using ArenaPtr = std::unique_ptr<T, ArenaDeleter>;
+
+// creates the object in the arena, or on the heap if arena is null
+template <class T, class... Args>
+ArenaPtr<T> make_arena_ptr(FrameArena *arena, Args &&...args) {
+  if (!arena)
+    return ArenaPtr<T>{new T(std::forward<Args>(args)...), ArenaDeleter{}};
+
+  auto memory = arena->allocate(sizeof(T), alignof(T));
+  return ArenaPtr<T>{
+      std::construct_at(static_cast<T *>(memory), std::forward<Args>(args)...),
+      ArenaDeleter{.in_arena = true}};
+}
+
+// allocates from a pool shared by every copy of the allocator, e.g. for
+// std::allocate_shared: the pool recycles the memory of freed objects, and
+// is kept alive by the objects allocated from it. The pool is synchronized,
+// so the objects can be freed from any thread.
+template <class T> class SharedPoolAllocator {
+public:
+  using value_type = T;
+
+  SharedPoolAllocator()
+      : pool{std::make_shared<std::pmr::synchronized_pool_resource>()} {}
+
+  template <class U>
+  SharedPoolAllocator(const SharedPoolAllocator<U> &other) noexcept
+      : pool{other.pool} {}
+
+  T *allocate(std::size_t n) {
+    return static_cast<T *>(pool->allocate(n * sizeof(T), alignof(T)));
+  }
+
+  void deallocate(T *ptr, std::size_t n) noexcept {
+    pool->deallocate(ptr, n * sizeof(T), alignof(T));
+  }
+
+  template <class U>
+  bool operator==(const SharedPoolAllocator<U> &other) const noexcept {
+    return pool == other.pool;
+  }
+
+private:
+  template <class U> friend class SharedPoolAllocator;
+
+  std::shared_ptr<std::pmr::synchronized_pool_resource> pool;
+};
+
+} // namespace vkvideo
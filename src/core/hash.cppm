@@ -0,0 +1,16 @@
+export module vkvideo.core:hash;
+
+import std;
+import :types;
+
+export namespace vkvideo {
+// FNV-1a, 64-bit
+u64 fnv1a(std::span<const u8> data) {
+  u64 hash = 0xcbf29ce484222325;
+  for (auto byte : data) {
+    hash ^= byte;
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+} // namespace vkvideo
@@ -0,0 +1,125 @@
+module;
+
+#include <cassert>
+
+export module vkvideo.core:inplace_vector;
+
+import std;
+
+export namespace vkvideo {
+
+// a vector with a fixed capacity and inline storage (like std::inplace_vector
+// of C++26), for the small lists built every frame (e.g. planes of a frame,
+// semaphores of a submit) without allocating
+template <class T, std::size_t N> class InplaceVector {
+public:
+  using value_type = T;
+  using size_type = std::size_t;
+  using reference = T &;
+  using const_reference = const T &;
+  using iterator = T *;
+  using const_iterator = const T *;
+
+  InplaceVector() = default;
+
+  InplaceVector(std::initializer_list<T> values) {
+    for (const auto &value : values)
+      push_back(value);
+  }
+
+  InplaceVector(const InplaceVector &other) {
+    for (const auto &value : other)
+      push_back(value);
+  }
+
+  InplaceVector(InplaceVector &&other) noexcept(
+      std::is_nothrow_move_constructible_v<T>) {
+    for (auto &value : other)
+      push_back(std::move(value));
+    other.clear();
+  }
+
+  InplaceVector &operator=(const InplaceVector &other) {
+    if (this != &other) {
+      clear();
+      for (const auto &value : other)
+        push_back(value);
+    }
+    return *this;
+  }
+
+  InplaceVector &operator=(InplaceVector &&other) noexcept(
+      std::is_nothrow_move_constructible_v<T>) {
+    if (this != &other) {
+      clear();
+      for (auto &value : other)
+        push_back(std::move(value));
+      other.clear();
+    }
+    return *this;
+  }
+
+  ~InplaceVector() { clear(); }
+
+  static constexpr size_type capacity() { return N; }
+  static constexpr size_type max_size() { return N; }
+  size_type size() const { return count; }
+  bool empty() const { return count == 0; }
+  bool full() const { return count == N; }
+
+  T *data() { return std::launder(reinterpret_cast<T *>(storage)); }
+  const T *data() const {
+    return std::launder(reinterpret_cast<const T *>(storage));
+  }
+
+  iterator begin() { return data(); }
+  iterator end() { return data() + count; }
+  const_iterator begin() const { return data(); }
+  const_iterator end() const { return data() + count; }
+
+  T &operator[](size_type i) {
+    assert(i < count);
+    return data()[i];
+  }
+  const T &operator[](size_type i) const {
+    assert(i < count);
+    return data()[i];
+  }
+
+  T &front() { return (*this)[0]; }
+  const T &front() const { return (*this)[0]; }
+  T &back() { return (*this)[count - 1]; }
+  const T &back() const { return (*this)[count - 1]; }
+
+  template <class... Args> T &emplace_back(Args &&...args) {
+    assert(!full() && "InplaceVector capacity exceeded");
+    auto ptr = std::construct_at(reinterpret_cast<T *>(storage) + count,
+                                 std::forward<Args>(args)...);
+    ++count;
+    return *ptr;
+  }
+
+  void push_back(const T &value) { emplace_back(value); }
+  void push_back(T &&value) { emplace_back(std::move(value)); }
+
+  void pop_back() {
+    assert(!empty());
+    std::destroy_at(&back());
+    --count;
+  }
+
+  void clear() {
+    std::destroy_n(data(), count);
+    count = 0;
+  }
+
+  bool operator==(const InplaceVector &other) const {
+    return std::ranges::equal(*this, other);
+  }
+
+private:
+  alignas(T) std::byte storage[N * sizeof(T)];
+  size_type count = 0;
+};
+
+} // namespace vkvideo
@@ -3,3 +3,9 @@ export module vkvideo.core;
 export import :types;
 export import :clock;
 export import :unique_any;
+export import :parallel;
+export import :inplace_vector;
+export import :arena;
+export import :alloc_tracking;
+export import :startup;
+export import :hash;
@@ -0,0 +1,45 @@
+export module vkvideo.core:parallel;
+
+import std;
+import :types;
+
+export namespace vkvideo {
+
+// runs task(i) for every i in [0, count) using up to num_threads threads
+// (0 means one thread per core). The calling thread takes part in the work.
+// If a task throws, the remaining tasks are skipped and the first exception is
+// rethrown once every thread is joined.
+template <class F>
+void parallel_for(std::size_t count, F &&task, std::size_t num_threads = 0) {
+  if (num_threads == 0)
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  num_threads = std::min(num_threads, count);
+
+  std::atomic<std::size_t> next{0};
+  std::exception_ptr error = nullptr;
+  std::mutex error_mutex;
+  auto worker = [&]() {
+    for (std::size_t i; (i = next++) < count;) {
+      try {
+        task(i);
+      } catch (...) {
+        std::scoped_lock _lck{error_mutex};
+        if (!error)
+          error = std::current_exception();
+        next = count;
+      }
+    }
+  };
+
+  {
+    std::vector<std::jthread> threads;
+    for (std::size_t i = 1; i < num_threads; ++i)
+      threads.emplace_back(worker);
+    worker();
+  }
+
+  if (error)
+    std::rethrow_exception(error);
+}
+
+} // namespace vkvideo
@@ -0,0 +1,132 @@
+export module vkvideo.core:startup;
+
+import std;
+import :types;
+
+export namespace vkvideo {
+
+// runs the initialization steps of an application, overlapping the
+// independent ones on worker threads (e.g. probing the input while the
+// Vulkan device is created), and records when each of them ran, so the time
+// to the first frame can be broken down per phase.
+class StartupScheduler {
+public:
+  struct Phase {
+    std::string name;
+    // 0 for the thread that created the scheduler, then 1, 2, ... for the
+    // other threads, in the order they ran a phase
+    i32 thread;
+    // since the scheduler was created
+    std::chrono::nanoseconds start, end;
+  };
+
+  // if parallel is false, spawned steps run right away on the calling thread,
+  // e.g. to measure what the overlapping saves
+  StartupScheduler(bool parallel = true)
+      : parallel{parallel}, start_time{std::chrono::steady_clock::now()},
+        main_thread{std::this_thread::get_id()} {}
+
+  StartupScheduler(const StartupScheduler &) = delete;
+  StartupScheduler &operator=(const StartupScheduler &) = delete;
+
+  // runs the step on a worker thread. Exceptions are rethrown by get() on
+  // the returned future, which must be waited for before the scheduler (and
+  // whatever the step references) is destroyed.
+  template <class F>
+  std::future<std::invoke_result_t<F>> spawn(std::string name, F &&step) {
+    auto future = std::async(
+        parallel ? std::launch::async : std::launch::deferred,
+        [this, name = std::move(name), step = std::forward<F>(step)]() mutable {
+          return timed(name, step);
+        });
+    if (!parallel)
+      future.wait();
+    return future;
+  }
+
+  // runs the step on the calling thread
+  template <class F>
+  std::invoke_result_t<F> run(std::string_view name, F &&step) {
+    return timed(name, step);
+  }
+
+  // records an instant, e.g. when the first frame is presented
+  void mark(std::string name) {
+    auto now = elapsed();
+    record(Phase{.name = std::move(name), .start = now, .end = now});
+  }
+
+  std::vector<Phase> get_phases() const {
+    std::scoped_lock _lck{mutex};
+    return phases;
+  }
+
+  // prints the phases in the order they started, and the total time
+  void print() const {
+    auto sorted = get_phases();
+    std::ranges::stable_sort(sorted, {}, &Phase::start);
+    auto to_ms = [](std::chrono::nanoseconds duration) {
+      return std::chrono::duration<double, std::milli>{duration}.count();
+    };
+
+    std::println("{:<32} {:>6} {:>10} {:>10}", "phase", "thread", "start ms",
+                 "time ms");
+    std::chrono::nanoseconds total{0};
+    for (const auto &phase : sorted) {
+      std::println("{:<32} {:>6} {:>10.2f} {:>10.2f}", phase.name,
+                   phase.thread, to_ms(phase.start),
+                   to_ms(phase.end - phase.start));
+      total = std::max(total, phase.end);
+    }
+    std::println("{:<32} {:>6} {:>10} {:>10.2f}", "total", "", "",
+                 to_ms(total));
+  }
+
+private:
+  bool parallel;
+  std::chrono::steady_clock::time_point start_time;
+  std::thread::id main_thread;
+
+  mutable std::mutex mutex;
+  std::vector<Phase> phases;
+  std::vector<std::thread::id> worker_threads;
+
+  std::chrono::nanoseconds elapsed() const {
+    return std::chrono::steady_clock::now() - start_time;
+  }
+
+  template <class F>
+  std::invoke_result_t<F> timed(std::string_view name, F &step) {
+    struct Record {
+      StartupScheduler &scheduler;
+      std::string_view name;
+      std::chrono::nanoseconds start;
+
+      // also recorded if the step throws
+      ~Record() {
+        scheduler.record(Phase{
+            .name = std::string{name},
+            .start = start,
+            .end = scheduler.elapsed(),
+        });
+      }
+    } record{*this, name, elapsed()};
+    return step();
+  }
+
+  void record(Phase phase) {
+    std::scoped_lock _lck{mutex};
+    auto id = std::this_thread::get_id();
+    if (id == main_thread) {
+      phase.thread = 0;
+    } else {
+      auto it = std::ranges::find(worker_threads, id);
+      if (it == worker_threads.end())
+        it = worker_threads.insert(it, id);
+      phase.thread = static_cast<i32>(it - worker_threads.begin()) + 1;
+    }
+    phases.push_back(std::move(phase));
+  }
+};
+
+} // namespace vkvideo
@@ -4,34 +4,109 @@ import std;
 
 export namespace vkvideo {
 
+// owns a value of any (movable) type. Small values are stored inline, so
+// keeping e.g. a frame alive until its commands are done does not allocate.
 class UniqueAny {
 public:
-  constexpr UniqueAny() = default;
-  constexpr UniqueAny(UniqueAny &&other) noexcept = default;
-  constexpr UniqueAny &operator=(UniqueAny &&rhs) noexcept = default;
+  // values up to this size, that can be moved without throwing, are stored
+  // inline instead of on the heap
+  static constexpr std::size_t inline_size = 6 * sizeof(void *);
+
+  UniqueAny() = default;
+
+  UniqueAny(UniqueAny &&other) noexcept { move_from(other); }
+
+  UniqueAny &operator=(UniqueAny &&rhs) noexcept {
+    if (this != &rhs) {
+      reset();
+      move_from(rhs);
+    }
+    return *this;
+  }
 
   UniqueAny(const UniqueAny &) noexcept = delete;
   UniqueAny &operator=(const UniqueAny &) noexcept = delete;
 
   template <class T>
-  UniqueAny(T &&value)
-      : impl{std::make_unique<StorageImpl<T>>(std::forward<T>(value))} {}
+    requires(!std::same_as<std::remove_cvref_t<T>, UniqueAny>)
+  UniqueAny(T &&value) {
+    emplace(std::forward<T>(value));
+  }
 
-  template <class T> UniqueAny &operator=(T &&value) {
-    impl = std::make_unique<StorageImpl<T>>(std::forward<T>(value));
+  template <class T>
+    requires(!std::same_as<std::remove_cvref_t<T>, UniqueAny>)
+  UniqueAny &operator=(T &&value) {
+    reset();
+    emplace(std::forward<T>(value));
     return *this;
   }
 
+  ~UniqueAny() { reset(); }
+
+  bool has_value() const { return ops != nullptr; }
+
+  void reset() {
+    if (ops) {
+      ops->destroy(*this);
+      ops = nullptr;
+    }
+  }
+
 private:
-  struct Storage {
-    virtual ~Storage() = default;
+  template <class T>
+  static constexpr bool stored_inline =
+      sizeof(T) <= inline_size && alignof(T) <= alignof(std::max_align_t) &&
+      std::is_nothrow_move_constructible_v<T>;
+
+  struct Ops {
+    void (*destroy)(UniqueAny &self);
+    // moves the value of src into the (empty) storage of dst
+    void (*move)(UniqueAny &dst, UniqueAny &src) noexcept;
   };
-  template <class T> struct StorageImpl : Storage {
-    T value;
-    StorageImpl(T &&value) : value{std::forward<T>(value)} {}
-    ~StorageImpl() = default;
+
+  template <class T> static constexpr Ops inline_ops{
+      .destroy =
+          [](UniqueAny &self) {
+            std::destroy_at(std::launder(reinterpret_cast<T *>(self.buffer)));
+          },
+      .move =
+          [](UniqueAny &dst, UniqueAny &src) noexcept {
+            auto value = std::launder(reinterpret_cast<T *>(src.buffer));
+            std::construct_at(reinterpret_cast<T *>(dst.buffer),
+                              std::move(*value));
+            std::destroy_at(value);
+          },
+  };
+
+  template <class T> static constexpr Ops heap_ops{
+      .destroy = [](UniqueAny &self) { delete static_cast<T *>(self.heap); },
+      .move = [](UniqueAny &dst,
+                 UniqueAny &src) noexcept { dst.heap = src.heap; },
   };
 
-  std::unique_ptr<Storage> impl;
+  template <class T> void emplace(T &&value) {
+    using Value = std::remove_cvref_t<T>;
+    if constexpr (stored_inline<Value>) {
+      std::construct_at(reinterpret_cast<Value *>(buffer),
+                        std::forward<T>(value));
+      ops = &inline_ops<Value>;
+    } else {
+      heap = new Value(std::forward<T>(value));
+      ops = &heap_ops<Value>;
+    }
+  }
+
+  void move_from(UniqueAny &other) noexcept {
+    if (other.ops) {
+      other.ops->move(*this, other);
+      ops = std::exchange(other.ops, nullptr);
+    }
+  }
+
+  union {
+    alignas(std::max_align_t) std::byte buffer[inline_size];
+    void *heap;
+  };
+  const Ops *ops = nullptr;
 };
 } // namespace vkvideo
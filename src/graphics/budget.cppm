@@ -0,0 +1,188 @@
+module;
+
+#include <cassert>
+
+export module vkvideo.graphics:budget;
+
+import std;
+import vulkan_hpp;
+import vk_mem_alloc_hpp;
+import vkvideo.core;
+
+export namespace vkvideo::graphics {
+// keeps track of device-local memory: how much of it is still available
+// (from VMA budget queries, exact if VK_EXT_memory_budget is enabled, and
+// estimated from heap sizes otherwise) and which resources are resident
+// but could give their memory back (e.g. fully loaded clips that can be
+// streamed instead).
+class MemoryBudget {
+public:
+  class Residency {
+  public:
+    Residency() = default;
+    Residency(const Residency &) = delete;
+    Residency &operator=(const Residency &) = delete;
+    Residency(Residency &&other)
+        : budget{std::exchange(other.budget, nullptr)}, id{other.id} {}
+    Residency &operator=(Residency &&other) {
+      release();
+      budget = std::exchange(other.budget, nullptr);
+      id = other.id;
+      return *this;
+    }
+    ~Residency() { release(); }
+
+    // mark as recently used
+    void touch() {
+      if (budget)
+        budget->touch(id);
+    }
+
+    void release() {
+      if (auto b = std::exchange(budget, nullptr))
+        b->untrack(id);
+    }
+
+  private:
+    friend class MemoryBudget;
+    Residency(MemoryBudget *budget, u64 id) : budget{budget}, id{id} {}
+
+    MemoryBudget *budget = nullptr;
+    u64 id = 0;
+  };
+
+  MemoryBudget(vma::Allocator allocator, bool exact)
+      : allocator{allocator}, exact{exact} {}
+
+  // whether VK_EXT_memory_budget is used
+  bool is_exact() const { return exact; }
+
+  // fraction of the heap budget we allow ourselves to use, leaving the rest
+  // to other processes and to allocations done outside of this service
+  void set_max_usage(float fraction) {
+    std::lock_guard lock{mutex};
+    max_usage = fraction;
+  }
+
+  // bytes that can still be allocated in the largest device-local heap
+  std::size_t headroom() const {
+    std::lock_guard lock{mutex};
+    return headroom_unlocked();
+  }
+
+  // registers resident memory, demote is called (without any lock held, on
+  // the thread calling make_room) when that memory should be given back, so
+  // it should only ask the owner to give it back. It must not outlive this
+  // object.
+  Residency track(std::size_t bytes, std::function<void()> demote) {
+    std::lock_guard lock{mutex};
+    auto id = next_id++;
+    residents.emplace(id, Resident{
+                              .bytes = bytes,
+                              .last_used = ++clock,
+                              .demote = std::move(demote),
+                          });
+    return Residency{this, id};
+  }
+
+  // demote the least recently used residents until bytes fit in the
+  // headroom, returns whether they fit. Nothing is demoted if they would not
+  // fit even with every resident demoted.
+  // (make_room(0) relieves pressure from other allocations)
+  bool make_room(std::size_t bytes) {
+    std::vector<std::function<void()>> demotes;
+    {
+      std::lock_guard lock{mutex};
+      auto headroom = headroom_unlocked();
+      auto fits = [&] { return headroom > 0 && headroom >= bytes; };
+      if (fits())
+        return true;
+
+      // demoted memory is only freed once the GPU (and whatever else holds
+      // the old frames) is done with it, so the headroom would not grow yet:
+      // the bytes of the demoted residents are counted instead
+      std::vector<std::pair<u64, u64>> by_age;
+      for (const auto &[id, resident] : residents)
+        by_age.emplace_back(resident.last_used, id);
+      std::ranges::sort(by_age);
+      std::vector<u64> demoted;
+      for (auto [last_used, id] : by_age) {
+        if (fits())
+          break;
+        headroom += residents.at(id).bytes;
+        demoted.push_back(id);
+      }
+      if (!fits())
+        return false;
+
+      for (auto id : demoted) {
+        auto it = residents.find(id);
+        demotes.push_back(std::move(it->second.demote));
+        residents.erase(it);
+      }
+    }
+
+    for (auto &demote : demotes)
+      demote();
+    return true;
+  }
+
+  std::size_t get_resident_bytes() const {
+    std::lock_guard lock{mutex};
+    std::size_t total = 0;
+    for (const auto &[id, resident] : residents)
+      total += resident.bytes;
+    return total;
+  }
+
+private:
+  struct Resident {
+    std::size_t bytes;
+    u64 last_used;
+    std::function<void()> demote;
+  };
+
+  vma::Allocator allocator;
+  bool exact;
+
+  mutable std::mutex mutex;
+  float max_usage = 0.8f;
+  u64 next_id = 0;
+  u64 clock = 0;
+  std::map<u64, Resident> residents;
+
+  std::size_t headroom_unlocked() const {
+    auto props = allocator.getMemoryProperties();
+    std::vector<vma::Budget> budgets(props->memoryHeapCount);
+    allocator.getHeapBudgets(budgets.data());
+
+    std::size_t headroom = 0;
+    for (u32 i = 0; i < props->memoryHeapCount; ++i) {
+      if (!(props->memoryHeaps[i].flags &
+            vk::MemoryHeapFlagBits::eDeviceLocal))
+        continue;
+      auto limit = static_cast<std::size_t>(budgets[i].budget * max_usage);
+      auto usage = static_cast<std::size_t>(budgets[i].usage);
+      if (limit > usage)
+        headroom = std::max(headroom, limit - usage);
+    }
+    return headroom;
+  }
+
+  void touch(u64 id) {
+    std::lock_guard lock{mutex};
+    if (auto it = residents.find(id); it != residents.end())
+      it->second.last_used = ++clock;
+  }
+
+  void untrack(u64 id) {
+    std::function<void()> demote;
+    std::lock_guard lock{mutex};
+    if (auto it = residents.find(id); it != residents.end()) {
+      // destroyed after unlocking, as it might own the Residency
+      demote = std::move(it->second.demote);
+      residents.erase(it);
+    }
+  }
+};
+} // namespace vkvideo::graphics
@@ -1,6 +1,8 @@
 export module vkvideo.graphics;
 
 export import :vkc;
+export import :budget;
+export import :view_cache;
 export import :queues;
 export import :temppools;
 export import :tlsem;
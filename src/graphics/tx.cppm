@@ -25,15 +25,28 @@ public:
     if (it == cmd_pools.end()) {
       std::tie(it, std::ignore) = cmd_pools.emplace(
           qf_idx,
-          vk::raii::CommandPool{
-              *device, vk::CommandPoolCreateInfo{
-                           .flags = vk::CommandPoolCreateFlagBits::eTransient,
-                           .queueFamilyIndex = static_cast<u32>(qf_idx),
-                       }});
+          CommandPool{
+              .pool = vk::raii::CommandPool{
+                  *device,
+                  vk::CommandPoolCreateInfo{
+                      // buffers are recycled, and reset by begin()
+                      .flags =
+                          vk::CommandPoolCreateFlagBits::eTransient |
+                          vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+                      .queueFamilyIndex = static_cast<u32>(qf_idx),
+                  }}});
     }
+
+    auto &free_buffers = it->second.free_buffers;
+    if (!free_buffers.empty()) {
+      auto cmd_buf = std::move(free_buffers.back());
+      free_buffers.pop_back();
+      return cmd_buf;
+    }
+
     vk::raii::CommandBuffers buffers{
         *device, vk::CommandBufferAllocateInfo{
-                     .commandPool = it->second,
+                     .commandPool = it->second.pool,
                      .level = vk::CommandBufferLevel::ePrimary,
                      .commandBufferCount = 1,
                  }};
@@ -48,14 +61,24 @@ public:
        const vk::ArrayProxy<const vk::SemaphoreSubmitInfo> &wait_sems = {},
        const vk::ArrayProxy<const vk::SemaphoreSubmitInfo> &signal_sems = {},
        vk::PipelineStageFlags2 additional_stage_mask = {}) {
-    static const u64 sem_value = 1;
     std::scoped_lock _lck{mutex};
-    auto name = std::format("task_sem[{}-{}]", qf_idx, 367);
-    auto sem = std::make_shared<TimelineSemaphore>(*device, 0, name.c_str());
+    // semaphores of finished operations are reused with a greater value, so
+    // waiting for the returned value stays valid
+    std::shared_ptr<TimelineSemaphore> sem;
+    u64 sem_value = 1;
+    if (!free_sems.empty()) {
+      std::tie(sem, sem_value) = std::move(free_sems.back());
+      free_sems.pop_back();
+      ++sem_value;
+    } else {
+      auto name = std::format("task_sem[{}]", num_sems++);
+      sem = std::make_shared<TimelineSemaphore>(*device, 0, name.c_str());
+    }
 
     auto &op = operations.emplace_back();
     op.sem = sem;
     op.sem_value = sem_value;
+    op.qf_idx = qf_idx;
     op.cmd_buf = std::move(cmd_buf);
     op.free_on_finish = std::move(free_on_finish);
 
@@ -63,8 +86,8 @@ public:
         .commandBuffer = *op.cmd_buf,
     };
 
-    std::vector<vk::SemaphoreSubmitInfo> signal_sem_infos{signal_sems.begin(),
-                                                          signal_sems.end()};
+    auto &signal_sem_infos = scratch_signal_sems;
+    signal_sem_infos.assign(signal_sems.begin(), signal_sems.end());
     signal_sem_infos.push_back(vk::SemaphoreSubmitInfo{
         .semaphore = *op.sem,
         .value = static_cast<u64>(sem_value),
@@ -83,8 +106,10 @@ public:
   void garbage_collect(i64 timeout = 0) {
     std::scoped_lock _lck{mutex};
 
-    std::vector<vk::Semaphore> wait_sems;
-    std::vector<u64> wait_sem_values;
+    auto &wait_sems = scratch_wait_sems;
+    auto &wait_sem_values = scratch_wait_values;
+    wait_sems.clear();
+    wait_sem_values.clear();
 
     for (auto &op : operations) {
       wait_sems.push_back(*op.sem);
@@ -100,7 +125,12 @@ public:
                                  timeout);
 
       std::erase_if(operations, [&](TransferPoolOperation &op) {
-        return op.sem->getCounterValue() >= op.sem_value;
+        if (op.sem->getCounterValue() < op.sem_value)
+          return false;
+        // recycle the command buffer and the semaphore
+        cmd_pools.at(op.qf_idx).free_buffers.push_back(std::move(op.cmd_buf));
+        free_sems.emplace_back(std::move(op.sem), op.sem_value);
+        return true;
       });
     }
   }
@@ -108,12 +138,19 @@ public:
 private:
   vk::raii::Device *device = nullptr;
   QueueManager *queues = nullptr;
-  std::unordered_map<i32, vk::raii::CommandPool> cmd_pools;
+  struct CommandPool {
+    vk::raii::CommandPool pool;
+    // buffers of finished operations (freed before the pool)
+    std::vector<vk::raii::CommandBuffer> free_buffers;
+  };
+
+  std::unordered_map<i32, CommandPool> cmd_pools;
   std::mutex mutex;
 
   struct TransferPoolOperation {
     std::shared_ptr<TimelineSemaphore> sem;
     u64 sem_value;
+    i32 qf_idx;
     vk::raii::CommandBuffer cmd_buf = nullptr;
     UniqueAny free_on_finish;
 
@@ -121,6 +158,13 @@ private:
   };
 
   std::vector<TransferPoolOperation> operations;
+  // semaphores of finished operations, with their last signalled value
+  std::vector<std::pair<std::shared_ptr<TimelineSemaphore>, u64>> free_sems;
+  u64 num_sems = 0;
+  // reused by every call, so that steady-state transfers do not allocate
+  std::vector<vk::SemaphoreSubmitInfo> scratch_signal_sems;
+  std::vector<vk::Semaphore> scratch_wait_sems;
+  std::vector<u64> scratch_wait_values;
 };
 } // namespace vkvideo::graphics
 
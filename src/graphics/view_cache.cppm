@@ -0,0 +1,121 @@
+export module vkvideo.graphics:view_cache;
+
+import std;
+import vulkan_hpp;
+import vkvideo.core;
+
+export namespace vkvideo::graphics {
+struct ImageViewKey {
+  vk::Image image;
+  vk::ImageViewType view_type;
+  vk::Format format;
+  vk::ImageSubresourceRange subresource_range;
+  // null if the view is not sampled through a YCbCr conversion
+  vk::SamplerYcbcrConversion conversion;
+
+  auto operator<=>(const ImageViewKey &) const = default;
+};
+
+struct CachedImageView {
+  vk::ImageView view;
+  // unique for every view the cache creates, unlike handles, which can be
+  // reused after a view is destroyed. Descriptor updates can be skipped if
+  // the id of the bound view did not change.
+  u64 id;
+};
+
+// image views reused across frames, instead of being created for every
+// frame. A view is destroyed once it has not been used for max_unused_frames
+// frames, which must be more than the number of frames in flight, so views
+// used by pending commands are never destroyed.
+// Cached views keep the owner passed to get() alive. It must keep the image
+// alive too (e.g. it is the pool the image is recycled in), otherwise a new
+// image could get the handle of a destroyed one while its view is cached.
+class ImageViewCache {
+public:
+  ImageViewCache(u64 max_unused_frames = 8)
+      : max_unused_frames{max_unused_frames} {}
+
+  CachedImageView get(const vk::raii::Device &device, const ImageViewKey &key,
+                      std::shared_ptr<const void> owner = nullptr) {
+    auto it = views.find(key);
+    if (it == views.end()) {
+      vk::SamplerYcbcrConversionInfo conv_info{.conversion = key.conversion};
+      vk::raii::ImageView view{
+          device, vk::ImageViewCreateInfo{
+                      .pNext = key.conversion ? &conv_info : nullptr,
+                      .image = key.image,
+                      .viewType = key.view_type,
+                      .format = key.format,
+                      .components =
+                          {
+                              vk::ComponentSwizzle::eIdentity,
+                              vk::ComponentSwizzle::eIdentity,
+                              vk::ComponentSwizzle::eIdentity,
+                              vk::ComponentSwizzle::eIdentity,
+                          },
+                      .subresourceRange = key.subresource_range,
+                  }};
+      Entry entry{
+          .view = std::move(view),
+          .owner = std::move(owner),
+          .id = ++last_id,
+      };
+      if (!free_nodes.empty()) {
+        // reuse the memory of a destroyed view
+        auto node = std::move(free_nodes.back());
+        free_nodes.pop_back();
+        node.key() = key;
+        node.mapped() = std::move(entry);
+        it = views.insert(std::move(node)).position;
+      } else {
+        it = views.emplace(key, std::move(entry)).first;
+      }
+    }
+    it->second.last_used = frame;
+    return {*it->second.view, it->second.id};
+  }
+
+  // destroys the views that were not used recently
+  void next_frame() {
+    ++frame;
+    for (auto it = views.begin(); it != views.end();) {
+      if (frame - it->second.last_used <= max_unused_frames) {
+        ++it;
+        continue;
+      }
+      auto node = views.extract(it++);
+      node.mapped() = Entry{};
+      if (free_nodes.size() < max_free_nodes)
+        free_nodes.push_back(std::move(node));
+    }
+  }
+
+  // destroys the views of the image, the caller must make sure that they
+  // are not used by pending commands
+  void invalidate(vk::Image image) {
+    std::erase_if(views,
+                  [&](const auto &item) { return item.first.image == image; });
+  }
+
+  void clear() { views.clear(); }
+
+private:
+  struct Entry {
+    vk::raii::ImageView view = nullptr;
+    std::shared_ptr<const void> owner;
+    u64 id = 0;
+    u64 last_used = 0;
+  };
+
+  // views of recycled images (e.g. decoder pools) are destroyed and created
+  // again as the pool cycles, their nodes are kept to avoid reallocating them
+  static constexpr std::size_t max_free_nodes = 64;
+
+  u64 max_unused_frames;
+  u64 frame = 0;
+  u64 last_id = 0;
+  std::map<ImageViewKey, Entry> views;
+  std::vector<std::map<ImageViewKey, Entry>::node_type> free_nodes;
+};
+} // namespace vkvideo::graphics
@@ -18,6 +18,7 @@ import vkfw;
 import vk_mem_alloc_hpp;
 import vkvideo.core;
 import vkvideo.third_party;
+import :budget;
 import :queues;
 import :temppools;
 import :vku;
@@ -60,9 +61,24 @@ inline VKAPI_ATTR vk::Bool32 VKAPI_CALL default_debug_callback(
                 // return true, will skip calling to driver)
 }
 
+struct VkContextOptions {
+  // no window system integration (surfaces, swapchains)
+  bool headless = false;
+  // the validation layer slows down startup (and everything else) a lot
+  bool validation = true;
+  // applications that never encode can skip the encode-only queue families
+  // and extensions, which are costly to set up on some drivers (queues can
+  // not be created after the device)
+  bool video_encode = true;
+};
+
 class VkContext {
 public:
-  VkContext(bool headless = false) {
+  VkContext(bool headless = false)
+      : VkContext{VkContextOptions{.headless = headless}} {}
+
+  explicit VkContext(const VkContextOptions &options) {
+    auto headless = options.headless;
     feature_chain.get<vk::PhysicalDeviceFeatures2>()
         .features.setVertexPipelineStoresAndAtomics(true)
         .setShaderInt64(true)
@@ -74,7 +90,10 @@ public:
         .setVulkanMemoryModel(true)
         .setVulkanMemoryModelDeviceScope(true)
         .setBufferDeviceAddress(true)
-        .setUniformAndStorageBuffer8BitAccess(true);
+        .setUniformAndStorageBuffer8BitAccess(true)
+        // texture arrays of the compositor
+        .setShaderSampledImageArrayNonUniformIndexing(true)
+        .setDescriptorBindingPartiallyBound(true);
     feature_chain.get<vk::PhysicalDeviceVulkan13Features>()
         .setSynchronization2(true)
         .setDynamicRendering(true);
@@ -103,7 +122,7 @@ public:
         .pfnUserCallback = default_debug_callback,
     };
 
-    static constexpr bool enable_validation = true;
+    auto enable_validation = options.validation;
 
     auto window_inst_exts = vkfw::getRequiredInstanceExtensions();
     std::vector<const char *> inst_exts;
@@ -135,7 +154,7 @@ public:
          std::views::split(std::string_view{layers}, std::string_view{":"}))
       add_layer(std::string_view{layer});
 
-    if constexpr (enable_validation) {
+    if (enable_validation) {
       add_layer("VK_LAYER_KHRONOS_validation");
       inst_exts.push_back(vk::EXTDebugUtilsExtensionName);
       inst_exts.push_back(vk::EXTLayerSettingsExtensionName);
@@ -182,7 +201,12 @@ public:
         vk::KHRVideoEncodeQueueExtensionName,
         vk::KHRVideoEncodeH264ExtensionName,
         vk::KHRVideoEncodeH265ExtensionName,
+        vk::EXTMemoryBudgetExtensionName,
     };
+    if (!options.video_encode)
+      std::erase_if(device_extensions, [](std::string_view ext) {
+        return ext.starts_with("VK_KHR_video_encode");
+      });
     if (!headless)
       device_extensions.push_back(vk::KHRSwapchainExtensionName);
 
@@ -262,6 +286,12 @@ public:
 
     std::vector<u32> video_qf_indices;
     for (u32 i = 0; i < qf_props.size(); ++i) {
+      auto flags = qf_props[i]
+                       .get<vk::QueueFamilyProperties2>()
+                       .queueFamilyProperties.queueFlags;
+      if (!options.video_encode &&
+          !(flags & vk::QueueFlagBits::eVideoDecodeKHR))
+        continue;
       if (qf_props[i]
               .get<vk::QueueFamilyVideoPropertiesKHR>()
               .videoCodecOperations) {
@@ -289,17 +319,25 @@ public:
           .queueCount = 1,
           .pQueuePriorities = &priority,
       });
+      auto flags = qf_props[index]
+                       .get<vk::QueueFamilyProperties2>()
+                       .queueFamilyProperties.queueFlags;
+      auto video_caps = qf_props[index]
+                            .get<vk::QueueFamilyVideoPropertiesKHR>()
+                            .videoCodecOperations;
+      // FFmpeg must not see what the disabled encode extensions provide
+      if (!options.video_encode) {
+        flags &= ~vk::QueueFlags{vk::QueueFlagBits::eVideoEncodeKHR};
+        video_caps &= vk::VideoCodecOperationFlagBitsKHR::eDecodeH264 |
+                      vk::VideoCodecOperationFlagBitsKHR::eDecodeH265 |
+                      vk::VideoCodecOperationFlagBitsKHR::eDecodeAv1;
+      }
       vk_device_ctx.qf[vk_device_ctx.nb_qf++] = AVVulkanDeviceQueueFamily{
           .idx = static_cast<int>(index),
           .num = 1,
-          .flags = static_cast<VkQueueFlagBits>(
-              static_cast<u32>(qf_props[index]
-                                   .get<vk::QueueFamilyProperties2>()
-                                   .queueFamilyProperties.queueFlags)),
+          .flags = static_cast<VkQueueFlagBits>(static_cast<u32>(flags)),
           .video_caps = static_cast<VkVideoCodecOperationFlagBitsKHR>(
-              static_cast<u32>(qf_props[index]
-                                   .get<vk::QueueFamilyVideoPropertiesKHR>()
-                                   .videoCodecOperations)),
+              static_cast<u32>(video_caps)),
       };
     };
 
@@ -357,7 +395,7 @@ public:
                  vk::QueueFlagBits::eVideoEncodeKHR;
         });
     vk_device_ctx.queue_family_encode_index =
-        it2 == video_qf_indices.end() ? -1 : *it2;
+        it2 == video_qf_indices.end() || !options.video_encode ? -1 : *it2;
     it2 = std::find_if(video_qf_indices.begin(), video_qf_indices.end(),
                        [&](u32 i) {
                          return qf_props[i]
@@ -448,10 +486,17 @@ public:
     };
 #endif
 
-    tp::ffmpeg::av_call(av_hwdevice_ctx_init(hwdevice_ctx.get()));
+    // av_hwdevice_ctx_init is done by get_hwaccel_ctx(), only if needed
     auto vkfuncs = vma::functionsFromDispatcher(instance.getDispatcher(),
                                                 device.getDispatcher());
+    bool has_memory_budget =
+        std::ranges::find(device_extensions,
+                          std::string_view{vk::EXTMemoryBudgetExtensionName}) !=
+        device_extensions.end();
     allocator = vma::createAllocatorUnique(vma::AllocatorCreateInfo{
+        .flags = has_memory_budget
+                     ? vma::AllocatorCreateFlagBits::eExtMemoryBudget
+                     : vma::AllocatorCreateFlags{},
         .physicalDevice = *physical_device,
         .device = *device,
         .pVulkanFunctions = &vkfuncs,
@@ -465,6 +510,7 @@ public:
     queues.init(device, qf_graphics, qf_compute, qf_transfer,
                 std::move(video_qf_indices));
     tx_pool.init(device, queues);
+    memory_budget.emplace(*allocator, has_memory_budget);
   }
 
   VkContext(const VkContext &) = delete;
@@ -480,9 +526,17 @@ public:
   vk::raii::PhysicalDevice &get_physical_device() { return physical_device; }
   vma::Allocator &get_vma_allocator() { return *allocator; }
 
-  const tp::ffmpeg::BufferRef &get_hwaccel_ctx() const { return hwdevice_ctx; }
+  // initialized on first use, as only hardware-accelerated decoding and
+  // encoding need it
+  const tp::ffmpeg::BufferRef &get_hwaccel_ctx() {
+    std::call_once(hwdevice_ctx_init, [&]() {
+      tp::ffmpeg::av_call(av_hwdevice_ctx_init(hwdevice_ctx.get()));
+    });
+    return hwdevice_ctx;
+  }
   QueueManager &get_queues() { return queues; }
   TempCommandPools &get_temp_pools() { return tx_pool; }
+  MemoryBudget &get_memory_budget() { return *memory_budget; }
 
   void set_debug_label(VulkanHandle handle, const char *name) {
     ::vkvideo::graphics::set_debug_label(device, handle, name);
@@ -496,6 +550,7 @@ private:
   vk::raii::PhysicalDevice physical_device = nullptr;
   vk::raii::Device device = nullptr;
   tp::ffmpeg::BufferRef hwdevice_ctx = nullptr;
+  std::once_flag hwdevice_ctx_init;
   std::vector<const char *> device_extensions;
   vk::StructureChain<
       vk::PhysicalDeviceFeatures2, vk::PhysicalDeviceVulkan11Features,
@@ -503,6 +558,7 @@ private:
       vk::PhysicalDeviceVideoMaintenance1FeaturesKHR>
       feature_chain;
   vma::UniqueAllocator allocator{nullptr};
+  std::optional<MemoryBudget> memory_budget;
 
   QueueManager queues;
   TempCommandPools tx_pool;
@@ -0,0 +1,124 @@
+module;
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define VKVIDEO_MIX_AVX2
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VKVIDEO_MIX_NEON
+#endif
+
+module vkvideo.medias;
+
+import std;
+
+namespace vkvideo::medias {
+
+namespace {
+
+void mix_scalar(float *dst, const float *src, std::size_t n, float gain) {
+  for (std::size_t i = 0; i < n; ++i)
+    dst[i] += src[i] * gain;
+}
+
+void mix_ramp_scalar(float *dst, const float *src, std::size_t n, float gain,
+                     float gain_step) {
+  for (std::size_t i = 0; i < n; ++i)
+    dst[i] += src[i] * (gain + static_cast<float>(i) * gain_step);
+}
+
+#ifdef VKVIDEO_MIX_AVX2
+// only called if the CPU supports it, the rest of the library is built for
+// the baseline
+__attribute__((target("avx2,fma"))) void
+mix_avx2(float *dst, const float *src, std::size_t n, float gain) {
+  auto gains = _mm256_set1_ps(gain);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(_mm256_loadu_ps(src + i), gains,
+                                              _mm256_loadu_ps(dst + i)));
+  mix_scalar(dst + i, src + i, n - i, gain);
+}
+
+__attribute__((target("avx2,fma"))) void
+mix_ramp_avx2(float *dst, const float *src, std::size_t n, float gain,
+              float gain_step) {
+  auto gains = _mm256_add_ps(
+      _mm256_set1_ps(gain),
+      _mm256_mul_ps(_mm256_set1_ps(gain_step),
+                    _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+  auto steps = _mm256_set1_ps(8 * gain_step);
+  std::size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(dst + i, _mm256_fmadd_ps(_mm256_loadu_ps(src + i), gains,
+                                              _mm256_loadu_ps(dst + i)));
+    gains = _mm256_add_ps(gains, steps);
+  }
+  mix_ramp_scalar(dst + i, src + i, n - i,
+                  gain + static_cast<float>(i) * gain_step, gain_step);
+}
+#endif
+
+#ifdef VKVIDEO_MIX_NEON
+void mix_neon(float *dst, const float *src, std::size_t n, float gain) {
+  auto gains = vdupq_n_f32(gain);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_f32(dst + i,
+              vmlaq_f32(vld1q_f32(dst + i), vld1q_f32(src + i), gains));
+  mix_scalar(dst + i, src + i, n - i, gain);
+}
+
+void mix_ramp_neon(float *dst, const float *src, std::size_t n, float gain,
+                   float gain_step) {
+  const float offsets[4] = {0, 1, 2, 3};
+  auto gains = vmlaq_f32(vdupq_n_f32(gain), vld1q_f32(offsets),
+                         vdupq_n_f32(gain_step));
+  auto steps = vdupq_n_f32(4 * gain_step);
+  std::size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(dst + i,
+              vmlaq_f32(vld1q_f32(dst + i), vld1q_f32(src + i), gains));
+    gains = vaddq_f32(gains, steps);
+  }
+  mix_ramp_scalar(dst + i, src + i, n - i,
+                  gain + static_cast<float>(i) * gain_step, gain_step);
+}
+#endif
+
+struct MixKernels {
+  void (*mix)(float *dst, const float *src, std::size_t n, float gain);
+  void (*mix_ramp)(float *dst, const float *src, std::size_t n, float gain,
+                   float gain_step);
+  std::string_view name;
+};
+
+// chosen once, for the CPU the program runs on
+const MixKernels &get_kernels() {
+  static const MixKernels kernels = []() -> MixKernels {
+#ifdef VKVIDEO_MIX_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+      return {mix_avx2, mix_ramp_avx2, "avx2"};
+#endif
+#ifdef VKVIDEO_MIX_NEON
+    return {mix_neon, mix_ramp_neon, "neon"};
+#endif
+    return {mix_scalar, mix_ramp_scalar, "scalar"};
+  }();
+  return kernels;
+}
+
+} // namespace
+
+void mix_samples(float *dst, const float *src, std::size_t n, float gain) {
+  get_kernels().mix(dst, src, n, gain);
+}
+
+void mix_samples_ramp(float *dst, const float *src, std::size_t n, float gain,
+                      float gain_step) {
+  get_kernels().mix_ramp(dst, src, n, gain, gain_step);
+}
+
+std::string_view mix_kernel_name() { return get_kernels().name; }
+
+} // namespace vkvideo::medias
@@ -0,0 +1,319 @@
+module;
+#include <cassert>
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+export module vkvideo.medias:audio_mixer;
+
+import std;
+import vkvideo.core;
+import vkvideo.third_party;
+import :audio;
+
+export namespace vkvideo::medias {
+
+// dst[i] += src[i] * gain for i in [0, n), with AVX2 or NEON if available
+// (see audio_mix_kernels.cpp)
+void mix_samples(float *dst, const float *src, std::size_t n, float gain);
+// same, but the gain goes from gain to gain + n * gain_step, so that gain
+// changes do not click
+void mix_samples_ramp(float *dst, const float *src, std::size_t n, float gain,
+                      float gain_step);
+// name of the kernels used by the functions above, e.g. "avx2"
+std::string_view mix_kernel_name();
+
+// single-producer single-consumer ring of interleaved float frames. The
+// positions count frames since the ring was created, they never wrap.
+class AudioRing {
+public:
+  AudioRing(u64 min_capacity, i32 num_channels)
+      : capacity{std::bit_ceil(min_capacity)}, num_channels{num_channels},
+        buffer(capacity * num_channels) {}
+
+  // consumer side
+  u64 get_read_pos() const { return read_pos.load(std::memory_order_relaxed); }
+  u64 readable() const {
+    return write_pos.load(std::memory_order_acquire) - get_read_pos();
+  }
+  void commit_read(u64 num_frames) {
+    read_pos.store(get_read_pos() + num_frames, std::memory_order_release);
+  }
+  // drops everything up to pos (at most the write position). The read
+  // position never moves backwards: if the reader is already past pos,
+  // nothing changes, as going back would make writable() underflow.
+  void skip_to(u64 pos) {
+    assert(pos <= write_pos.load(std::memory_order_acquire));
+    read_pos.store(std::max(get_read_pos(), pos), std::memory_order_release);
+  }
+
+  // producer side
+  u64 get_write_pos() const {
+    return write_pos.load(std::memory_order_relaxed);
+  }
+  u64 writable() const {
+    return capacity -
+           (get_write_pos() - read_pos.load(std::memory_order_acquire));
+  }
+  void commit_write(u64 num_frames) {
+    write_pos.store(get_write_pos() + num_frames, std::memory_order_release);
+  }
+
+  // the frames [pos, pos + num_frames) as at most two contiguous runs:
+  // f(samples, num_frames of the run, frames before the run)
+  template <class F> void for_each_run(u64 pos, u64 num_frames, F &&f) {
+    u64 done = 0;
+    while (done < num_frames) {
+      auto offset = (pos + done) & (capacity - 1);
+      auto run = std::min(num_frames - done, capacity - offset);
+      f(buffer.data() + offset * num_channels, run, done);
+      done += run;
+    }
+  }
+
+private:
+  u64 capacity;
+  i32 num_channels;
+  std::vector<float> buffer;
+  std::atomic<u64> read_pos{0}, write_pos{0};
+};
+
+struct AudioMixerSource {
+  // must output samples in the format of the mixer
+  std::unique_ptr<Audio> audio;
+  float gain = 1.0f;
+  // time of the mix (in nanoseconds) at which the source starts, negative
+  // values skip the beginning of the source
+  i64 start = 0;
+};
+
+// mixes several sources into one, for a single playback stream. Sources are
+// decoded and resampled (to the mixer format) ahead of time by a feeder
+// thread, so that get_samples, called by the real-time audio thread, only
+// has to sum them (without locking or allocating). Sources running dry are
+// played as silence.
+//
+// Only interleaved float samples are mixed: the playback converts them once
+// for the device, and compensates the drift of the mix against the Clock.
+class AudioMixer : public Audio {
+public:
+  // buffer_duration of every source is decoded ahead
+  AudioMixer(const AudioFormat &format, std::vector<AudioMixerSource> sources,
+             i64 buffer_duration = 200'000'000)
+      : sample_rate{format.sample_rate},
+        num_channels{format.ch_layout->nb_channels} {
+    if (format.sample_fmt != tp::ffmpeg::SampleFormat::AV_SAMPLE_FMT_FLT)
+      throw std::runtime_error{
+          "AudioMixer only supports interleaved float samples"};
+
+    auto capacity = static_cast<u64>(
+        std::max<i64>(to_frames(buffer_duration), 2 * chunk_frames));
+    for (auto &source : sources) {
+      auto &track = *tracks.emplace_back(std::make_unique<Track>(
+          std::move(source.audio), source.start, capacity, num_channels));
+      track.target_gain = source.gain;
+      track.gain = source.gain;
+      seek_track(track, 0);
+    }
+
+    // the first callbacks do not have to wait for the feeder
+    for (auto &track : tracks)
+      fill(*track);
+    feeder = std::jthread{[this](std::stop_token stop) { feed(stop); }};
+  }
+
+  std::size_t num_sources() const { return tracks.size(); }
+
+  // can be called from any thread, the gain ramps to the new value during the
+  // next get_samples
+  void set_gain(std::size_t source, float gain) {
+    tracks[source]->target_gain.store(gain, std::memory_order_relaxed);
+  }
+
+  // the sources are sought by the feeder, meanwhile silence is played
+  void seek(i64 time) override {
+    seek_time.store(time, std::memory_order_relaxed);
+    requested_generation.fetch_add(1, std::memory_order_release);
+    this->time.store(time, std::memory_order_relaxed);
+  }
+
+  i64 get_time() override { return time.load(std::memory_order_relaxed); }
+
+  i32 get_samples(i32 num_samples, u8 *const *data) override {
+    auto output = reinterpret_cast<float *>(data[0]);
+    auto num_floats = static_cast<std::size_t>(num_samples) * num_channels;
+    std::fill_n(output, num_floats, 0.0f);
+
+    auto requested = requested_generation.load(std::memory_order_acquire);
+    if (requested != applied_generation) {
+      if (acked_generation.load(std::memory_order_acquire) != requested)
+        return num_samples;
+      // the samples before the seek are dropped
+      for (auto &track : tracks)
+        track->ring.skip_to(
+            track->seek_start.load(std::memory_order_relaxed));
+      applied_generation = requested;
+    }
+
+    for (auto &track : tracks) {
+      auto target = track->target_gain.load(std::memory_order_relaxed);
+      auto gain_step = (target - track->gain) / static_cast<float>(num_floats);
+      auto num_frames = std::min<u64>(track->ring.readable(), num_samples);
+      track->ring.for_each_run(
+          track->ring.get_read_pos(), num_frames,
+          [&](const float *samples, u64 run, u64 done) {
+            auto offset = done * num_channels;
+            auto count = run * num_channels;
+            if (gain_step == 0.0f)
+              mix_samples(output + offset, samples, count, track->gain);
+            else
+              mix_samples_ramp(output + offset, samples, count,
+                               track->gain + gain_step * offset, gain_step);
+          });
+      track->ring.commit_read(num_frames);
+      track->gain = target;
+
+      // the write time goes with the write position, so the played time is
+      // off by at most a chunk if the feeder wrote in between
+      auto buffered = track->ring.readable();
+      track->played_time.store(
+          track->write_time.load(std::memory_order_relaxed) -
+              to_ns(static_cast<i64>(buffered)),
+          std::memory_order_relaxed);
+    }
+
+    time.fetch_add(to_ns(num_samples), std::memory_order_relaxed);
+    return num_samples;
+  }
+
+  // how far ahead of the clock (in nanoseconds) each source is, for the
+  // samples last mixed. The output latency of the device is not included, as
+  // the playback compensates it for the whole mix.
+  std::vector<i64> get_sync_offsets(Clock &clock) const {
+    auto now = clock.get_time();
+    std::vector<i64> offsets;
+    offsets.reserve(tracks.size());
+    for (auto &track : tracks)
+      offsets.push_back(track->played_time.load(std::memory_order_relaxed) -
+                        now);
+    return offsets;
+  }
+
+private:
+  // frames decoded at once per source
+  static constexpr i64 chunk_frames = 1024;
+
+  struct Track {
+    Track(std::unique_ptr<Audio> audio, i64 start, u64 capacity,
+          i32 num_channels)
+        : audio{std::move(audio)}, start{start},
+          ring{capacity, num_channels} {}
+
+    // feeder only
+    std::unique_ptr<Audio> audio;
+    i64 start;
+    i64 pending_silence = 0; // frames played before the source starts
+    bool ended = false;
+
+    AudioRing ring;
+    std::atomic<float> target_gain;
+    float gain; // get_samples only
+    // mix times of the frame at the write position, and the last mixed one
+    std::atomic<i64> write_time{0}, played_time{0};
+    // where the ring starts after the last seek
+    std::atomic<u64> seek_start{0};
+  };
+
+  i32 sample_rate, num_channels;
+  std::vector<std::unique_ptr<Track>> tracks;
+  std::atomic<i64> time{0}, seek_time{0};
+  // seeks requested by seek() and done by the feeder
+  std::atomic<u64> requested_generation{0}, acked_generation{0};
+  u64 applied_generation = 0; // get_samples only
+  // declared last, so that it is stopped (and joined) before the tracks are
+  // destroyed
+  std::jthread feeder;
+
+  i64 to_frames(i64 ns) const {
+    return ns * sample_rate / static_cast<i64>(1e9);
+  }
+  i64 to_ns(i64 frames) const {
+    return frames * static_cast<i64>(1e9) / sample_rate;
+  }
+
+  void seek_track(Track &track, i64 time) {
+    auto source_time = time - track.start;
+    track.audio->seek(std::max<i64>(source_time, 0));
+    track.pending_silence = std::max<i64>(to_frames(-source_time), 0);
+    track.ended = false;
+    track.write_time.store(time, std::memory_order_relaxed);
+    track.seek_start.store(track.ring.get_write_pos(),
+                           std::memory_order_relaxed);
+  }
+
+  // decodes until the ring is full, returns whether anything was written
+  bool fill(Track &track) {
+    bool progressed = false;
+    while (static_cast<i64>(track.ring.writable()) >= chunk_frames) {
+      i64 written = 0;
+      track.ring.for_each_run(
+          track.ring.get_write_pos(), chunk_frames,
+          [&](float *samples, u64 run, u64 done) {
+            // a run shorter than requested ends the chunk
+            if (written < static_cast<i64>(done))
+              return;
+            i64 count;
+            if (track.pending_silence > 0) {
+              count = std::min<i64>(run, track.pending_silence);
+              std::fill_n(samples, count * num_channels, 0.0f);
+              track.pending_silence -= count;
+            } else if (!track.ended) {
+              std::array<u8 *, AV_NUM_DATA_POINTERS> planes{};
+              planes[0] = reinterpret_cast<u8 *>(samples);
+              count = track.audio->get_samples(static_cast<i32>(run),
+                                               planes.data());
+              track.ended = count == 0;
+            } else {
+              count = 0;
+            }
+            written += count;
+          });
+      if (written == 0)
+        break;
+
+      auto write_time = track.write_time.load(std::memory_order_relaxed) +
+                        to_ns(written);
+      if (track.pending_silence == 0 && !track.ended)
+        // exact, the decoder knows where it is
+        write_time = track.audio->get_time() + track.start;
+      track.write_time.store(write_time, std::memory_order_relaxed);
+      track.ring.commit_write(written);
+      progressed = true;
+    }
+    return progressed;
+  }
+
+  void feed(std::stop_token stop) {
+    u64 handled_generation = 0;
+    while (!stop.stop_requested()) {
+      auto requested = requested_generation.load(std::memory_order_acquire);
+      if (requested != handled_generation) {
+        auto target = seek_time.load(std::memory_order_relaxed);
+        for (auto &track : tracks)
+          seek_track(*track, target);
+        handled_generation = requested;
+        acked_generation.store(requested, std::memory_order_release);
+      }
+
+      bool progressed = false;
+      for (auto &track : tracks)
+        progressed |= fill(*track);
+      // the rings are full (or the sources are done), wait for a few
+      // callbacks to drain them
+      if (!progressed)
+        std::this_thread::sleep_for(std::chrono::milliseconds{5});
+    }
+  }
+};
+
+} // namespace vkvideo::medias
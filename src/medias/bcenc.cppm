@@ -0,0 +1,181 @@
+module;
+#include <cmrc/cmrc.hpp>
+#include <shaderc/shaderc.hpp>
+
+#include <cassert>
+CMRC_DECLARE(vkvideo_shaders);
+
+export module vkvideo.medias:bcenc;
+
+import std;
+import vulkan_hpp;
+import vkvideo.core;
+import vkvideo.graphics;
+
+export namespace vkvideo::medias {
+
+// compute-shader-based BC1/BC3 compression of RGBA8 layers, used to keep
+// resident clips compressed in VRAM
+class BlockCompressor {
+private:
+  static std::vector<u32> compile_shader(bool has_alpha) {
+    // compiled once per variant, pipelines are cheap to create from SPIR-V
+    static std::mutex mutex;
+    static std::map<bool, std::vector<u32>> cache;
+    std::scoped_lock lock{mutex};
+    if (auto it = cache.find(has_alpha); it != cache.end())
+      return it->second;
+
+    auto fs = cmrc::vkvideo_shaders::get_filesystem();
+    auto bcenc = fs.open("medias/bcenc.comp");
+
+    shaderc::Compiler glslc;
+    shaderc::CompileOptions opts;
+    if (has_alpha)
+      opts.AddMacroDefinition("HAS_ALPHA");
+    opts.SetOptimizationLevel(shaderc_optimization_level_performance);
+
+    auto result = glslc.CompileGlslToSpv(bcenc.begin(), bcenc.size(),
+                                         shaderc_compute_shader,
+                                         "medias/bcenc.comp", opts);
+    if (!std::ranges::all_of(result.GetErrorMessage(),
+                             [](auto c) { return std::isspace(c); }))
+      std::println("Block compression shader message: {}",
+                   result.GetErrorMessage());
+    assert(result.GetCompilationStatus() == shaderc_compilation_status_success);
+
+    return cache
+        .emplace(has_alpha, std::vector<u32>{result.begin(), result.end()})
+        .first->second;
+  }
+
+  struct PushConstants {
+    i32 width, height;
+    i32 row_length;
+    i32 layer_size;
+    i32 first_layer;
+  };
+
+public:
+  // each compress call uses its own descriptor set, at most max_batches of
+  // them can be recorded
+  BlockCompressor(vk::raii::Device &device, bool has_alpha,
+                  u32 max_batches = 1)
+      : has_alpha{has_alpha} {
+    auto code = compile_shader(has_alpha);
+    vk::raii::ShaderModule module{device,
+                                  vk::ShaderModuleCreateInfo{
+                                      .codeSize = code.size() * sizeof(code[0]),
+                                      .pCode = code.data(),
+                                  }};
+    std::array<vk::DescriptorSetLayoutBinding, 2> bindings;
+    for (std::size_t i = 0; i < bindings.size(); ++i) {
+      bindings[i].binding = i;
+      bindings[i].descriptorType = vk::DescriptorType::eStorageBuffer;
+      bindings[i].descriptorCount = 1;
+      bindings[i].stageFlags = vk::ShaderStageFlagBits::eCompute;
+    }
+    vk::PushConstantRange push_const_range{
+        .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        .offset = 0,
+        .size = sizeof(PushConstants),
+    };
+    desc_set_layout = vk::raii::DescriptorSetLayout{
+        device, vk::DescriptorSetLayoutCreateInfo{}.setBindings(bindings)};
+    pipeline_layout = vk::raii::PipelineLayout{
+        device, vk::PipelineLayoutCreateInfo{}
+                    .setSetLayouts(*desc_set_layout)
+                    .setPushConstantRanges(push_const_range)};
+    pipeline = vk::raii::Pipeline{
+        device, nullptr,
+        vk::ComputePipelineCreateInfo{
+            .stage =
+                {
+                    .stage = vk::ShaderStageFlagBits::eCompute,
+                    .module = module,
+                    .pName = "main",
+                },
+            .layout = *pipeline_layout,
+        }};
+    vk::DescriptorPoolSize pool_size{
+        vk::DescriptorType::eStorageBuffer,
+        static_cast<u32>(bindings.size()) * max_batches};
+    desc_pool = vk::raii::DescriptorPool{
+        device,
+        vk::DescriptorPoolCreateInfo{
+            .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+            .maxSets = max_batches,
+        }
+            .setPoolSizes(pool_size)};
+  }
+
+  vk::Format output_format() const {
+    return has_alpha ? vk::Format::eBc3UnormBlock
+                     : vk::Format::eBc1RgbUnormBlock;
+  }
+
+  static std::size_t block_bytes(bool has_alpha) { return has_alpha ? 16 : 8; }
+
+  // size of the compressed data of one layer
+  static std::size_t layer_bytes(bool has_alpha, i32 width, i32 height) {
+    return static_cast<std::size_t>((width + 3) / 4) * ((height + 3) / 4) *
+           block_bytes(has_alpha);
+  }
+
+  // compress num_layers RGBA8 layers, starting at source.offset and
+  // layer_size texels apart. The blocks of the i-th layer are written at
+  // (first_layer + i) * layer_bytes(...) in blocks.
+  void compress(vk::raii::Device &device, vk::raii::CommandBuffer &cmd,
+                vk::DescriptorBufferInfo source, vk::Buffer blocks, i32 width,
+                i32 height, u32 row_length, u32 layer_size, i32 first_layer,
+                i32 num_layers) {
+    vk::raii::DescriptorSets sets{device,
+                                  vk::DescriptorSetAllocateInfo{
+                                      .descriptorPool = *desc_pool,
+                                  }
+                                      .setSetLayouts(*desc_set_layout)};
+    auto &desc_set = desc_sets.emplace_back(std::move(sets[0]));
+
+    std::array<vk::DescriptorBufferInfo, 2> buffer_infos{
+        source,
+        vk::DescriptorBufferInfo{.buffer = blocks, .range = vk::WholeSize},
+    };
+    std::array<vk::WriteDescriptorSet, 2> write_ops;
+    for (u32 i = 0; i < write_ops.size(); ++i)
+      write_ops[i] = vk::WriteDescriptorSet{
+          .dstSet = *desc_set,
+          .dstBinding = i,
+          .dstArrayElement = 0,
+          .descriptorCount = 1,
+          .descriptorType = vk::DescriptorType::eStorageBuffer,
+          .pBufferInfo = &buffer_infos[i],
+      };
+    device.updateDescriptorSets(write_ops, {});
+
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+    cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *pipeline_layout, 0,
+                           *desc_set, {});
+    cmd.pushConstants<PushConstants>(
+        *pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0,
+        PushConstants{
+            .width = width,
+            .height = height,
+            .row_length = static_cast<i32>(row_length),
+            .layer_size = static_cast<i32>(layer_size),
+            .first_layer = first_layer,
+        });
+    // 8x8 blocks per workgroup
+    cmd.dispatch((width + 31) / 32, (height + 31) / 32,
+                 static_cast<u32>(num_layers));
+  }
+
+private:
+  bool has_alpha;
+  vk::raii::DescriptorSetLayout desc_set_layout = nullptr;
+  vk::raii::DescriptorPool desc_pool = nullptr;
+  vk::raii::PipelineLayout pipeline_layout = nullptr;
+  vk::raii::Pipeline pipeline = nullptr;
+  std::vector<vk::raii::DescriptorSet> desc_sets;
+};
+
+} // namespace vkvideo::medias
@@ -0,0 +1,377 @@
+module;
+
+#include <cassert>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+export module vkvideo.medias:clip_cache;
+
+import std;
+import vulkan_hpp;
+import vkvideo.core;
+import vkvideo.third_party;
+import vkvideo.graphics;
+import :video_frame;
+
+namespace vkvideo::medias {
+// read-only memory mapping of a whole file
+class MappedFile {
+public:
+  MappedFile(const std::filesystem::path &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::system_error{errno, std::generic_category(),
+                              "unable to open " + path.string()};
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+      auto err = errno;
+      ::close(fd);
+      throw std::system_error{err, std::generic_category(),
+                              "unable to stat " + path.string()};
+    }
+
+    size = static_cast<std::size_t>(st.st_size);
+    if (size == 0) {
+      ::close(fd);
+      return;
+    }
+
+    ptr = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    auto err = errno;
+    ::close(fd);
+    if (ptr == MAP_FAILED)
+      throw std::system_error{err, std::generic_category(),
+                              "unable to map " + path.string()};
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (ptr != MAP_FAILED)
+      ::munmap(ptr, size);
+  }
+
+  std::span<const u8> data() const {
+    if (ptr == MAP_FAILED)
+      return {};
+    return {static_cast<const u8 *>(ptr), size};
+  }
+
+private:
+  void *ptr = MAP_FAILED;
+  std::size_t size = 0;
+};
+
+// file layout: header, timestamps, then the layers (see LayerLayout)
+struct ClipCacheHeader {
+  std::array<char, 8> magic;
+  u32 version;
+  i32 width, height;
+  i32 src_format;
+  i32 pix_fmt;
+  i32 vk_format;
+  i32 num_layers;
+  u64 layer_size;
+  u64 num_timestamps;
+};
+
+constexpr std::array<char, 8> clip_cache_magic{'V', 'K', 'V', 'C',
+                                               'L', 'I', 'P', '\0'};
+// bump whenever the layout or the conversion of frames changes
+constexpr u32 clip_cache_version = 3;
+
+// writes cache entries one at a time on a background thread, so that
+// uploading a clip does not wait for the disk. Writes still pending when the
+// program exits are finished first.
+class ClipCacheWriter {
+public:
+  static ClipCacheWriter &get() {
+    static ClipCacheWriter writer;
+    return writer;
+  }
+
+  void push(std::move_only_function<void()> job) {
+    std::lock_guard lock{mutex};
+    jobs.push_back(std::move(job));
+    cond.notify_all();
+  }
+
+  // waits until every pushed job is done
+  void flush() {
+    std::unique_lock lock{mutex};
+    cond.wait(lock, [&] { return jobs.empty() && !busy; });
+  }
+
+private:
+  ClipCacheWriter() {
+    worker = std::jthread{[this](std::stop_token stop) { run(stop); }};
+  }
+
+  std::mutex mutex;
+  std::condition_variable_any cond;
+  std::deque<std::move_only_function<void()>> jobs;
+  bool busy = false;
+  // declared last, so that it is joined before the jobs are destroyed
+  std::jthread worker;
+
+  void run(std::stop_token stop) {
+    std::unique_lock lock{mutex};
+    // once stopped, the remaining jobs are still run
+    while (cond.wait(lock, stop, [&] { return !jobs.empty(); })) {
+      auto job = std::move(jobs.front());
+      jobs.pop_front();
+      busy = true;
+      lock.unlock();
+      job();
+      lock.lock();
+      busy = false;
+      cond.notify_all();
+    }
+  }
+};
+} // namespace vkvideo::medias
+
+export namespace vkvideo::medias {
+struct CachedClip {
+  // same as VideoVRAM::timestamps
+  std::vector<i64> timestamps;
+  LayerImages layers;
+};
+
+// on-disk cache of fully decoded and converted clips (the layers that would
+// be uploaded to VRAM by VideoVRAM), so reopening a clip does not need any
+// decoding. Entries are keyed by the content hash of the source file and by
+// the conversion (the storage and the layer format), and stored as converted
+// (but not block-compressed) layers, so a load is an mmap plus one staging
+// copy.
+class ClipCache {
+public:
+  ClipCache(std::filesystem::path dir = default_dir()) : dir{std::move(dir)} {}
+
+  // $XDG_CACHE_HOME/vkvideo/clips, or ~/.cache/vkvideo/clips
+  static std::filesystem::path default_dir() {
+    std::filesystem::path base;
+    if (auto xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg)
+      base = xdg;
+    else if (auto home = std::getenv("HOME"); home && *home)
+      base = std::filesystem::path{home} / ".cache";
+    else
+      base = std::filesystem::temp_directory_path();
+    return base / "vkvideo" / "clips";
+  }
+
+  // key of the given source file, the conversion is added to it by load and
+  // store
+  std::string key_of(const std::filesystem::path &source) const {
+    MappedFile file{source};
+    return std::format("{:016x}-v{}", fnv1a(file.data()), clip_cache_version);
+  }
+
+  // layout of the entry that load would return, without reading its layers,
+  // e.g. to size the clip before loading it
+  std::optional<LayerLayout>
+  find(graphics::VkContext &vk, std::string_view key,
+       ResidentStorage storage = ResidentStorage::eRgb) const {
+    if (auto entry = find_entry(vk, key, storage))
+      return entry->layout;
+    return std::nullopt;
+  }
+
+  // returns nullopt on cache miss (or if the entry is unusable on this device
+  // with the given storage), mipmaps are generated after uploading (they are
+  // not cached)
+  std::optional<CachedClip>
+  load(graphics::VkContext &vk, std::string_view key,
+       ResidentStorage storage = ResidentStorage::eRgb,
+       bool mipmaps = false) const {
+    auto entry = find_entry(vk, key, storage);
+    if (!entry)
+      return std::nullopt;
+
+    try {
+      auto data = entry->file->data();
+      auto &header = entry->header;
+      CachedClip clip;
+      clip.timestamps.resize(header.num_timestamps);
+      std::memcpy(clip.timestamps.data(), data.data() + sizeof(header),
+                  header.num_timestamps * sizeof(i64));
+
+      auto layers = data.subspan(sizeof(header) +
+                                 header.num_timestamps * sizeof(i64));
+      auto fill = [&](u8 *dst) {
+        parallel_for(header.num_layers, [&](std::size_t i) {
+          std::memcpy(dst + i * header.layer_size,
+                      layers.data() + i * header.layer_size, header.layer_size);
+        });
+      };
+      clip.layers = upload_layers_to_gpu(vk, entry->layout, fill, mipmaps);
+      return clip;
+    } catch (std::exception &ex) {
+      std::println(std::cerr, "Unable to load cached clip {}: {}",
+                   entry->path.string(), ex.what());
+      return std::nullopt;
+    }
+  }
+
+  // the data is copied, and written to the file on a background thread (see
+  // flush()). storage is the one the layout was selected for. Failures are
+  // reported but not propagated, as the cache is only an optimization.
+  void store(std::string_view key, ResidentStorage storage,
+             std::span<const i64> timestamps, const LayerLayout &layout,
+             std::span<const u8> layers) const {
+    assert(layers.size() == layout.layer_size * layout.num_layers);
+    ClipCacheHeader header{
+        .magic = clip_cache_magic,
+        .version = clip_cache_version,
+        .width = layout.width,
+        .height = layout.height,
+        .src_format = static_cast<i32>(layout.src_format),
+        .pix_fmt = static_cast<i32>(layout.format.pix_fmt),
+        .vk_format = static_cast<i32>(layout.format.vk_format),
+        .num_layers = layout.num_layers,
+        .layer_size = layout.layer_size,
+        .num_timestamps = timestamps.size(),
+    };
+    ClipCacheWriter::get().push(
+        [dir = dir, path = entry_path(key, storage, header), header,
+         timestamps = std::vector<i64>{timestamps.begin(), timestamps.end()},
+         layers = std::vector<u8>{layers.begin(), layers.end()}] {
+          write_entry(dir, path, header, timestamps, layers);
+        });
+  }
+
+  // waits until the entries stored so far (by any ClipCache) are written
+  static void flush() { ClipCacheWriter::get().flush(); }
+
+private:
+  struct Entry {
+    std::filesystem::path path;
+    std::unique_ptr<MappedFile> file;
+    ClipCacheHeader header;
+    LayerLayout layout;
+  };
+
+  std::filesystem::path dir;
+
+  // e.g. <key>-<storage>-<pix_fmt>-<vk_format>.clip, where the storage is
+  // resolved for the source format, so that eAuto shares the entries of the
+  // storage it picks
+  std::filesystem::path entry_path(std::string_view key,
+                                   ResidentStorage storage,
+                                   const ClipCacheHeader &header) const {
+    auto src_format = static_cast<tp::ffmpeg::PixelFormat>(header.src_format);
+    return dir / std::format("{}-{}-{}-{}.clip", key,
+                             static_cast<i32>(resolve_storage(storage,
+                                                              src_format)),
+                             header.pix_fmt, header.vk_format);
+  }
+
+  // the mapped entry and its header, nullopt if it is not a valid entry of
+  // this version
+  static std::optional<std::pair<std::unique_ptr<MappedFile>, ClipCacheHeader>>
+  read_header(const std::filesystem::path &path) {
+    try {
+      auto file = std::make_unique<MappedFile>(path);
+      auto data = file->data();
+      ClipCacheHeader header;
+      if (data.size() < sizeof(header))
+        return std::nullopt;
+      std::memcpy(&header, data.data(), sizeof(header));
+      if (header.magic != clip_cache_magic ||
+          header.version != clip_cache_version || header.num_layers <= 0)
+        return std::nullopt;
+      return std::pair{std::move(file), header};
+    } catch (std::exception &) {
+      return std::nullopt;
+    }
+  }
+
+  // the entries of a source only differ by their conversion, so any of them
+  // tells which conversion would be used now, and thus which entry to load
+  std::optional<Entry> find_entry(graphics::VkContext &vk,
+                                  std::string_view key,
+                                  ResidentStorage storage) const {
+    auto prefix = std::format("{}-", key);
+    std::optional<ClipCacheHeader> source_header;
+    std::error_code ec;
+    for (const auto &dir_entry : std::filesystem::directory_iterator{dir, ec}) {
+      auto name = dir_entry.path().filename().string();
+      if (!name.starts_with(prefix) || !name.ends_with(".clip"))
+        continue;
+      if (auto result = read_header(dir_entry.path())) {
+        source_header = result->second;
+        break;
+      }
+    }
+    if (!source_header)
+      return std::nullopt;
+
+    // the layer format depends on the device and on the storage, so the
+    // entry is only valid if the same format would be chosen now
+    auto src_format =
+        static_cast<tp::ffmpeg::PixelFormat>(source_header->src_format);
+    auto format = select_layer_format(vk, source_header->width,
+                                      source_header->height, src_format,
+                                      storage);
+    source_header->pix_fmt = static_cast<i32>(format.pix_fmt);
+    source_header->vk_format = static_cast<i32>(format.vk_format);
+    auto path = entry_path(key, storage, *source_header);
+
+    auto result = read_header(path);
+    if (!result)
+      return std::nullopt;
+    auto &[file, header] = *result;
+    auto layout = make_layer_layout(header.width, header.height, src_format,
+                                    format, header.num_layers);
+    auto layers_offset = sizeof(header) + header.num_timestamps * sizeof(i64);
+    if (header.pix_fmt != source_header->pix_fmt ||
+        header.vk_format != source_header->vk_format ||
+        layout.layer_size != header.layer_size ||
+        file->data().size() !=
+            layers_offset + layout.layer_size * layout.num_layers)
+      return std::nullopt;
+    return Entry{
+        .path = std::move(path),
+        .file = std::move(file),
+        .header = header,
+        .layout = layout,
+    };
+  }
+
+  static void write_entry(const std::filesystem::path &dir,
+                          const std::filesystem::path &path,
+                          const ClipCacheHeader &header,
+                          std::span<const i64> timestamps,
+                          std::span<const u8> layers) {
+    // write to a temporary file first, so that concurrent readers never see
+    // a partial entry
+    auto tmp_path = path;
+    tmp_path += std::format(".{}.tmp", ::getpid());
+
+    try {
+      std::filesystem::create_directories(dir);
+      {
+        std::ofstream output{tmp_path, std::ios::binary | std::ios::trunc};
+        output.exceptions(std::ios::failbit | std::ios::badbit);
+        output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        output.write(reinterpret_cast<const char *>(timestamps.data()),
+                     timestamps.size_bytes());
+        output.write(reinterpret_cast<const char *>(layers.data()),
+                     layers.size());
+      }
+
+      std::filesystem::rename(tmp_path, path);
+    } catch (std::exception &ex) {
+      std::println(std::cerr, "Unable to cache clip to {}: {}", path.string(),
+                   ex.what());
+      std::error_code ec;
+      std::filesystem::remove(tmp_path, ec);
+    }
+  }
+};
+} // namespace vkvideo::medias
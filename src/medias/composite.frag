@@ -0,0 +1,26 @@
+#version 450
+
+#extension GL_EXT_nonuniform_qualifier : require
+
+// MAX_TEXTURES is the size of the texture array. If SINGLE_TEXTURE is
+// defined, the array has one element and the texture index of the instance
+// is ignored: arrays of textures sampled through a YCbCr conversion can only
+// be indexed by constants, so each of their images gets its own set.
+
+layout(location = 0) in vec2 tex_coords;
+layout(location = 1) in float layer;
+layout(location = 2) in float opacity;
+layout(location = 3) flat in uint texture_index;
+layout(location = 0) out vec4 color;
+
+layout(set = 0, binding = 0) uniform sampler2DArray textures[MAX_TEXTURES];
+
+void main() {
+    vec3 coords = vec3(tex_coords, layer);
+#ifdef SINGLE_TEXTURE
+    color = texture(textures[0], coords);
+#else
+    color = texture(textures[nonuniformEXT(texture_index)], coords);
+#endif
+    color.a *= opacity;
+}
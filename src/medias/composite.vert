@@ -0,0 +1,44 @@
+#version 450
+
+// one instance per layer, drawn as a quad (two triangles)
+struct Instance {
+    // maps the quad (in [0, 1]^2) to normalized device coordinates, as
+    // x * transform[0] + y * transform[1] + transform[2]
+    vec2 transform[3];
+    // part of the (possibly padded) texture that holds the frame
+    vec2 uv_max;
+    float layer;
+    float opacity;
+    uint texture_index;
+    uint padding;
+};
+
+layout(std430, set = 0, binding = 1) readonly buffer Instances {
+    Instance instances[];
+};
+
+const vec2 corners[6] = vec2[6](
+        vec2(0.0, 0.0),
+        vec2(1.0, 0.0),
+        vec2(0.0, 1.0),
+        vec2(0.0, 1.0),
+        vec2(1.0, 0.0),
+        vec2(1.0, 1.0)
+    );
+
+layout(location = 0) out vec2 tex_coords;
+layout(location = 1) out float layer;
+layout(location = 2) out float opacity;
+layout(location = 3) flat out uint texture_index;
+
+void main() {
+    Instance instance = instances[gl_InstanceIndex];
+    vec2 corner = corners[gl_VertexIndex];
+    vec2 position = corner.x * instance.transform[0] +
+            corner.y * instance.transform[1] + instance.transform[2];
+    gl_Position = vec4(position, 0.0, 1.0);
+    tex_coords = corner * instance.uv_max;
+    layer = instance.layer;
+    opacity = instance.opacity;
+    texture_index = instance.texture_index;
+}
@@ -0,0 +1,628 @@
+module;
+#include <cmrc/cmrc.hpp>
+#include <shaderc/shaderc.hpp>
+
+#include <cassert>
+CMRC_DECLARE(vkvideo_shaders);
+
+export module vkvideo.medias:compositor;
+
+import std;
+import vulkan_hpp;
+import vk_mem_alloc_hpp;
+import vkvideo.core;
+import vkvideo.graphics;
+import vkvideo.third_party;
+import :video;
+import :video_frame;
+import :pipeline;
+
+export namespace vkvideo::medias {
+
+struct LayerTransform {
+  // top left corner and size of the layer, as fractions of the output extent
+  std::array<float, 2> position{0.0f, 0.0f};
+  std::array<float, 2> size{1.0f, 1.0f};
+  // clockwise rotation around the center of the layer, in radians
+  float rotation = 0.0f;
+};
+
+struct CompositorLayer {
+  std::shared_ptr<Video> video;
+  LayerTransform transform;
+  float opacity = 1.0f;
+  // layers are drawn from the lowest z_order to the highest (and in the
+  // order they were added for equal values)
+  i32 z_order = 0;
+};
+
+// the frames drawn by Compositor::record. The submitted commands must wait
+// for and signal the semaphores of the planes (like the ones of a single
+// frame), the frames must be unlocked after submitting, and must stay alive
+// until the commands are done.
+struct CompositedFrames {
+  std::vector<VideoFrame> frames;
+  std::vector<ArenaPtr<LockedVideoFrameData>> locked_frames;
+  // the frame data of each locked frame
+  std::vector<const VideoFrameData *> locked_data;
+  // the planes of every locked frame, once each
+  std::vector<VideoFramePlane *> planes;
+
+  void unlock() {
+    locked_frames.clear();
+    locked_data.clear();
+    planes.clear();
+  }
+
+  // keeps the storage of the lists, so reusing the object every frame does
+  // not allocate
+  void clear() {
+    unlock();
+    frames.clear();
+  }
+};
+
+// draws many video layers into one color attachment. Layers are grouped into
+// runs of consecutive layers (in drawing order) that share a pipeline, i.e.
+// RGB layers, or YUV layers of the same format (the YCbCr conversion is part
+// of the pipeline). Every run is one instanced draw, which picks the frame of
+// each layer in a texture array. Arrays of textures sampled through a YCbCr
+// conversion can only be indexed by constants, so YUV pipelines bind a single
+// texture instead, with a descriptor set per distinct image, and YUV runs
+// take one draw per image (the layers of a resident clip share their array
+// image).
+// Mipmapped frames (see VideoArgs::resident_mipmaps) are sampled trilinearly,
+// so heavily downscaled layers do not alias.
+class Compositor {
+private:
+  struct Instance {
+    std::array<float, 6> transform;
+    std::array<float, 2> uv_max;
+    float layer;
+    float opacity;
+    u32 texture_index;
+    u32 padding = 0;
+  };
+  static_assert(sizeof(Instance) == 48);
+
+  static std::vector<u32> compile_shader(const char *path,
+                                         shaderc_shader_kind kind,
+                                         bool single_texture,
+                                         u32 max_textures) {
+    // compiled once per variant
+    static std::mutex mutex;
+    static std::map<std::tuple<std::string, bool, u32>, std::vector<u32>>
+        cache;
+    std::scoped_lock lock{mutex};
+    auto key =
+        std::make_tuple(std::string{path}, single_texture, max_textures);
+    if (auto it = cache.find(key); it != cache.end())
+      return it->second;
+
+    auto fs = cmrc::vkvideo_shaders::get_filesystem();
+    auto source = fs.open(path);
+
+    shaderc::Compiler glslc;
+    shaderc::CompileOptions opts;
+    opts.AddMacroDefinition("MAX_TEXTURES", std::to_string(max_textures));
+    if (single_texture)
+      opts.AddMacroDefinition("SINGLE_TEXTURE");
+    opts.SetOptimizationLevel(shaderc_optimization_level_performance);
+
+    auto result = glslc.CompileGlslToSpv(source.begin(), source.size(), kind,
+                                         path, opts);
+    if (!std::ranges::all_of(result.GetErrorMessage(),
+                             [](auto c) { return std::isspace(c); }))
+      std::println("Compositor shader message: {}", result.GetErrorMessage());
+    assert(result.GetCompilationStatus() == shaderc_compilation_status_success);
+
+    return cache.emplace(key, std::vector<u32>{result.begin(), result.end()})
+        .first->second;
+  }
+
+  // affine map from the quad of the layer to normalized device coordinates
+  static std::array<float, 6> quad_transform(const LayerTransform &transform,
+                                             vk::Extent2D extent) {
+    auto width = static_cast<float>(extent.width);
+    auto height = static_cast<float>(extent.height);
+    // the rotation is done in pixels, so that it does not skew the layer
+    auto layer_width = transform.size[0] * width;
+    auto layer_height = transform.size[1] * height;
+    auto cos = std::cos(transform.rotation);
+    auto sin = std::sin(transform.rotation);
+    std::array<float, 2> x_axis{2.0f * cos * layer_width / width,
+                                2.0f * sin * layer_width / height};
+    std::array<float, 2> y_axis{-2.0f * sin * layer_height / width,
+                                2.0f * cos * layer_height / height};
+    std::array<float, 2> center{
+        (transform.position[0] + transform.size[0] / 2.0f) * 2.0f - 1.0f,
+        (transform.position[1] + transform.size[1] / 2.0f) * 2.0f - 1.0f,
+    };
+    return {
+        x_axis[0],
+        x_axis[1],
+        y_axis[0],
+        y_axis[1],
+        center[0] - (x_axis[0] + y_axis[0]) / 2.0f,
+        center[1] - (x_axis[1] + y_axis[1]) / 2.0f,
+    };
+  }
+
+  struct Pipeline {
+    vk::raii::SamplerYcbcrConversion conversion = nullptr;
+    vk::raii::Sampler sampler = nullptr;
+    vk::raii::DescriptorSetLayout set_layout = nullptr;
+    vk::raii::PipelineLayout layout = nullptr;
+    vk::raii::DescriptorPool pool = nullptr;
+    vk::raii::DescriptorSets sets = nullptr;
+    vk::raii::Pipeline pipeline = nullptr;
+    // YUV pipelines have one texture per set, and sets_per_frame sets for
+    // each frame in flight (one per texture slot). RGB ones have a texture
+    // array and one set per frame in flight.
+    bool single_texture;
+    u32 sets_per_frame;
+
+    // ids of the views bound in the current frame, by texture index
+    std::vector<u64> frame_textures;
+    // id of the view in each texture slot of each frame in flight (0 if none)
+    std::vector<std::vector<u64>> bound_view_ids;
+    std::vector<vk::DescriptorImageInfo> pending_infos;
+    std::vector<u32> pending_slots;
+    std::vector<vk::WriteDescriptorSet> writes;
+
+    // returns the index of the view in the texture array
+    u32 add_texture(graphics::CachedImageView view, i32 set_idx) {
+      // there are few textures per frame
+      auto it = std::ranges::find(frame_textures, view.id);
+      auto slot = static_cast<u32>(it - frame_textures.begin());
+      if (it != frame_textures.end())
+        return slot;
+
+      frame_textures.push_back(view.id);
+      if (bound_view_ids[set_idx][slot] != view.id) {
+        bound_view_ids[set_idx][slot] = view.id;
+        pending_infos.push_back(vk::DescriptorImageInfo{
+            .imageView = view.view,
+            .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+        });
+        pending_slots.push_back(slot);
+      }
+      return slot;
+    }
+
+    // the set holding the texture slot, for the frame in flight set_idx
+    const vk::raii::DescriptorSet &get_set(i32 set_idx, u32 slot) const {
+      return sets[set_idx * sets_per_frame + (single_texture ? slot : 0)];
+    }
+
+    // writes the textures that changed since the set was last used
+    void update_textures(const vk::raii::Device &device, i32 set_idx) {
+      writes.clear();
+      for (std::size_t i = 0; i < pending_infos.size(); ++i)
+        writes.push_back(vk::WriteDescriptorSet{
+            .dstSet = *get_set(set_idx, pending_slots[i]),
+            .dstBinding = 0,
+            .dstArrayElement = single_texture ? 0 : pending_slots[i],
+            .descriptorCount = 1,
+            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+            .pImageInfo = &pending_infos[i],
+        });
+      if (!writes.empty())
+        device.updateDescriptorSets(writes, {});
+      pending_infos.clear();
+      pending_slots.clear();
+      frame_textures.clear();
+    }
+  };
+
+public:
+  // num_sets is the number of frames in flight, record() is called with a
+  // different set_idx for each of them. At most max_layers layers are drawn
+  // per frame.
+  Compositor(graphics::VkContext &vk, vk::Format color_attachment_format,
+             i32 num_sets, u32 max_layers = 64)
+      : vk{vk}, color_attachment_format{color_attachment_format},
+        num_sets{num_sets}, max_layers{max_layers} {
+    auto &allocator = vk.get_vma_allocator();
+    for (i32 i = 0; i < num_sets; ++i) {
+      auto [buffer, allocation] = allocator.createBufferUnique(
+          {
+              .size = sizeof(Instance) * max_layers,
+              .usage = vk::BufferUsageFlagBits::eStorageBuffer,
+          },
+          {
+              .flags =
+                  vma::AllocationCreateFlagBits::eMapped |
+                  vma::AllocationCreateFlagBits::eHostAccessSequentialWrite,
+              .requiredFlags = vk::MemoryPropertyFlagBits::eHostVisible |
+                               vk::MemoryPropertyFlagBits::eHostCoherent,
+          });
+      auto data = static_cast<Instance *>(
+          allocator.getAllocationInfo(allocation.get()).pMappedData);
+      instance_buffers.push_back(InstanceBuffer{
+          .buffer = std::move(buffer),
+          .allocation = std::move(allocation),
+          .data = data,
+      });
+    }
+  }
+
+  Compositor(const Compositor &) = delete;
+  Compositor &operator=(const Compositor &) = delete;
+
+  std::vector<CompositorLayer> layers;
+
+  // layers that were not drawn by the last record() call, as there were too
+  // many or as their frames are not supported (see the log)
+  u32 get_num_dropped() const { return num_dropped; }
+
+  // draws the frames of the layers at the given time. Must be recorded in a
+  // rendering pass on the graphics queue, with a color attachment of the
+  // format and extent given here. The drawn frames are put in result, which
+  // is cleared first, and the frame locks are created in arena if given.
+  void record(vk::raii::CommandBuffer &cmd, i32 set_idx, i64 time,
+              vk::Extent2D extent, CompositedFrames &result,
+              FrameArena *arena = nullptr) {
+    assert(set_idx >= 0 && set_idx < num_sets);
+    auto &device = vk.get_device();
+    views.next_frame();
+    result.clear();
+
+    order.clear();
+    for (const auto &layer : layers)
+      if (layer.video && layer.opacity > 0.0f)
+        order.push_back(&layer);
+    std::ranges::stable_sort(order, [](const auto *lhs, const auto *rhs) {
+      return lhs->z_order < rhs->z_order;
+    });
+
+    draw_pipelines.clear();
+    auto instances = instance_buffers[set_idx].data;
+    u32 num_instances = 0;
+    num_dropped = 0;
+    for (const auto *layer : order) {
+      if (num_instances == max_layers) {
+        num_dropped = static_cast<u32>(order.end() -
+                                       std::ranges::find(order, layer));
+        warn_once(warned_too_many, "more than {} layers, skipping the rest",
+                  max_layers);
+        break;
+      }
+      auto frame = layer->video->get_frame(time);
+      if (!frame.has_value())
+        continue;
+
+      // a video can be shown by several layers, its frames are locked once
+      auto it = std::ranges::find(result.locked_data, frame->data.get());
+      auto locked_idx = it - result.locked_data.begin();
+      if (it == result.locked_data.end()) {
+        result.locked_data.push_back(frame->data.get());
+        auto &locked =
+            result.locked_frames.emplace_back(frame->data->lock(arena));
+        locked->layout_transition(frame->frame_index,
+                                  vk.get_queues().get_qf_graphics(),
+                                  vk.get_temp_pools(),
+                                  vk::PipelineStageFlagBits2::eFragmentShader,
+                                  vk::AccessFlagBits2::eShaderSampledRead,
+                                  vk::ImageLayout::eShaderReadOnlyOptimal);
+        std::ranges::copy(locked->get_planes(),
+                          std::back_inserter(result.planes));
+      }
+      auto &data = *result.locked_frames[locked_idx];
+      auto planes = data.get_planes();
+      if (planes.size() != 1) {
+        // frames with one image per plane (e.g. from some hardware decoders)
+        // are not supported. The frame is kept until the commands are done,
+        // as its planes are still waited for.
+        ++num_dropped;
+        warn_once(warned_multi_image,
+                  "frames with {} images are not supported, skipping",
+                  planes.size());
+        result.frames.push_back(std::move(*frame));
+        continue;
+      }
+      auto &plane = *planes.front();
+
+      auto &pipeline = get_pipeline(frame->frame_format, plane.get_format());
+      auto view = views.get(device,
+                            graphics::ImageViewKey{
+                                .image = plane.get_image(),
+                                .view_type = vk::ImageViewType::e2DArray,
+                                .format = plane.get_format(),
+                                .subresource_range =
+                                    plane.get_subresource_range(),
+                                .conversion = *pipeline.conversion,
+                            },
+                            frame->data->get_image_owner());
+
+      auto [width, height] = data.get_extent();
+      auto [padded_width, padded_height] = data.get_padded_extent();
+      instances[num_instances++] = Instance{
+          .transform = quad_transform(layer->transform, extent),
+          .uv_max =
+              {
+                  static_cast<float>(width) / static_cast<float>(padded_width),
+                  static_cast<float>(height) /
+                      static_cast<float>(padded_height),
+              },
+          .layer = static_cast<float>(frame->frame_index.value_or(0)),
+          .opacity = std::min(layer->opacity, 1.0f),
+          .texture_index = pipeline.add_texture(view, set_idx),
+      };
+      draw_pipelines.push_back(&pipeline);
+      result.frames.push_back(std::move(*frame));
+    }
+
+    for (auto &[key, pipeline] : pipelines)
+      pipeline.update_textures(device, set_idx);
+
+    cmd.setViewport(0, vk::Viewport{
+                           .x = 0,
+                           .y = 0,
+                           .width = static_cast<float>(extent.width),
+                           .height = static_cast<float>(extent.height),
+                       });
+    cmd.setScissor(0, vk::Rect2D{
+                          .offset = {0, 0},
+                          .extent = extent,
+                      });
+    for (u32 first = 0; first < num_instances;) {
+      auto *pipeline = draw_pipelines[first];
+      auto last = first;
+      while (last < num_instances && draw_pipelines[last] == pipeline)
+        ++last;
+
+      cmd.bindPipeline(vk::PipelineBindPoint::eGraphics, *pipeline->pipeline);
+      if (!pipeline->single_texture) {
+        cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                               *pipeline->layout, 0,
+                               *pipeline->get_set(set_idx, 0), {});
+        cmd.draw(6, last - first, 0, first);
+      } else {
+        for (auto run = first; run < last;) {
+          auto texture = instances[run].texture_index;
+          auto run_last = run;
+          while (run_last < last &&
+                 instances[run_last].texture_index == texture)
+            ++run_last;
+          cmd.bindDescriptorSets(vk::PipelineBindPoint::eGraphics,
+                                 *pipeline->layout, 0,
+                                 *pipeline->get_set(set_idx, texture), {});
+          cmd.draw(6, run_last - run, 0, run);
+          run = run_last;
+        }
+      }
+      first = last;
+    }
+  }
+
+private:
+  struct InstanceBuffer {
+    vma::UniqueBuffer buffer;
+    vma::UniqueAllocation allocation;
+    Instance *data;
+  };
+
+  graphics::VkContext &vk;
+  vk::Format color_attachment_format;
+  i32 num_sets;
+  u32 max_layers;
+  std::vector<InstanceBuffer> instance_buffers;
+  graphics::ImageViewCache views;
+  // keyed by the format of the YCbCr conversion (eUndefined for RGB frames)
+  std::map<vk::Format, Pipeline> pipelines;
+  // scratch lists of record(), kept to reuse their storage
+  std::vector<const CompositorLayer *> order;
+  std::vector<Pipeline *> draw_pipelines;
+  u32 num_dropped = 0;
+  // each problem is only logged once, not every frame
+  bool warned_too_many = false;
+  bool warned_multi_image = false;
+
+  template <class... Args>
+  static void warn_once(bool &warned, std::format_string<Args...> fmt,
+                        Args &&...args) {
+    if (std::exchange(warned, true))
+      return;
+    std::println(std::cerr, "Compositor: {}",
+                 std::format(fmt, std::forward<Args>(args)...));
+  }
+
+  Pipeline &get_pipeline(tp::ffmpeg::PixelFormat pixel_format,
+                         vk::Format plane_format) {
+    auto is_yuv = VideoPipelineInfo{
+        .plane_formats = {plane_format},
+        .pixel_format = pixel_format,
+    }.is_yuv();
+    auto key = is_yuv ? plane_format : vk::Format::eUndefined;
+    if (auto it = pipelines.find(key); it != pipelines.end())
+      return it->second;
+    return pipelines.emplace(key, create_pipeline(key)).first->second;
+  }
+
+  Pipeline create_pipeline(vk::Format yuv_format) {
+    auto &device = vk.get_device();
+    Pipeline result;
+    result.single_texture = yuv_format != vk::Format::eUndefined;
+    result.sets_per_frame = result.single_texture ? max_layers : 1;
+    if (result.single_texture)
+      result.conversion = create_yuv_conversion(device, yuv_format);
+
+    vk::SamplerYcbcrConversionInfo conv_info{.conversion = *result.conversion};
+    result.sampler = vk::raii::Sampler{
+        device,
+        vk::SamplerCreateInfo{
+            .pNext = result.single_texture ? &conv_info : nullptr,
+            .magFilter = vk::Filter::eLinear,
+            .minFilter = vk::Filter::eLinear,
+            // YUV frames have no mipmaps
+            .mipmapMode = result.single_texture
+                              ? vk::SamplerMipmapMode::eNearest
+                              : vk::SamplerMipmapMode::eLinear,
+            .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+            .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+            .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+            .maxLod = result.single_texture ? 0.0f : vk::LodClampNone,
+        }};
+
+    auto num_textures = result.single_texture ? 1 : max_layers;
+    std::vector<vk::Sampler> immutable_samplers(num_textures, *result.sampler);
+    std::array bindings{
+        vk::DescriptorSetLayoutBinding{
+            .binding = 0,
+            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+            .descriptorCount = num_textures,
+            .stageFlags = vk::ShaderStageFlagBits::eFragment,
+            .pImmutableSamplers = immutable_samplers.data(),
+        },
+        vk::DescriptorSetLayoutBinding{
+            .binding = 1,
+            .descriptorType = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = 1,
+            .stageFlags = vk::ShaderStageFlagBits::eVertex,
+        },
+    };
+    // only the textures of the current frame are valid (and YUV sets of
+    // unused slots have none)
+    std::array<vk::DescriptorBindingFlags, 2> binding_flags{
+        vk::DescriptorBindingFlagBits::ePartiallyBound, {}};
+    vk::DescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info{};
+    binding_flags_info.setBindingFlags(binding_flags);
+    result.set_layout = vk::raii::DescriptorSetLayout{
+        device, vk::DescriptorSetLayoutCreateInfo{.pNext = &binding_flags_info}
+                    .setBindings(bindings)};
+
+    result.layout = vk::raii::PipelineLayout{
+        device,
+        vk::PipelineLayoutCreateInfo{}.setSetLayouts(*result.set_layout)};
+
+    // YCbCr conversions can take up to 3 descriptors per texture
+    auto num_pool_sets = result.sets_per_frame * static_cast<u32>(num_sets);
+    std::array pool_sizes{
+        vk::DescriptorPoolSize{
+            .type = vk::DescriptorType::eCombinedImageSampler,
+            .descriptorCount = 3 * num_textures * num_pool_sets,
+        },
+        vk::DescriptorPoolSize{
+            .type = vk::DescriptorType::eStorageBuffer,
+            .descriptorCount = num_pool_sets,
+        },
+    };
+    result.pool = vk::raii::DescriptorPool{
+        device,
+        vk::DescriptorPoolCreateInfo{
+            .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+            .maxSets = num_pool_sets,
+        }
+            .setPoolSizes(pool_sizes)};
+    std::vector<vk::DescriptorSetLayout> set_layouts(num_pool_sets,
+                                                     *result.set_layout);
+    result.sets = vk::raii::DescriptorSets{
+        device, vk::DescriptorSetAllocateInfo{.descriptorPool = *result.pool}
+                    .setSetLayouts(set_layouts)};
+    result.bound_view_ids.assign(num_sets, std::vector<u64>(max_layers, 0));
+
+    // the instance buffers never change
+    for (u32 i = 0; i < num_pool_sets; ++i) {
+      vk::DescriptorBufferInfo buffer_info{
+          .buffer = *instance_buffers[i / result.sets_per_frame].buffer,
+          .range = vk::WholeSize,
+      };
+      device.updateDescriptorSets(
+          vk::WriteDescriptorSet{
+              .dstSet = *result.sets[i],
+              .dstBinding = 1,
+              .descriptorCount = 1,
+              .descriptorType = vk::DescriptorType::eStorageBuffer,
+              .pBufferInfo = &buffer_info,
+          },
+          {});
+    }
+
+    result.pipeline = create_graphics_pipeline(result);
+    return result;
+  }
+
+  vk::raii::Pipeline create_graphics_pipeline(const Pipeline &pipeline) {
+    auto &device = vk.get_device();
+    auto load_shader = [&](const char *path, shaderc_shader_kind kind) {
+      auto code =
+          compile_shader(path, kind, pipeline.single_texture,
+                         pipeline.single_texture ? 1 : max_layers);
+      return vk::raii::ShaderModule{
+          device, vk::ShaderModuleCreateInfo{
+                      .codeSize = code.size() * sizeof(code[0]),
+                      .pCode = code.data(),
+                  }};
+    };
+    auto vertex_shader =
+        load_shader("medias/composite.vert", shaderc_vertex_shader);
+    auto fragment_shader =
+        load_shader("medias/composite.frag", shaderc_fragment_shader);
+    std::array shaders{
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eVertex,
+            .module = vertex_shader,
+            .pName = "main",
+        },
+        vk::PipelineShaderStageCreateInfo{
+            .stage = vk::ShaderStageFlagBits::eFragment,
+            .module = fragment_shader,
+            .pName = "main",
+        },
+    };
+
+    vk::PipelineVertexInputStateCreateInfo vertex_input{};
+    vk::PipelineInputAssemblyStateCreateInfo input_assembly{
+        .topology = vk::PrimitiveTopology::eTriangleList,
+    };
+    vk::PipelineViewportStateCreateInfo viewport{
+        .viewportCount = 1,
+        .scissorCount = 1,
+    };
+    vk::PipelineRasterizationStateCreateInfo raster{
+        .polygonMode = vk::PolygonMode::eFill,
+        .cullMode = vk::CullModeFlagBits::eNone,
+        .lineWidth = 1.0f,
+    };
+    vk::PipelineMultisampleStateCreateInfo multisample{
+        .rasterizationSamples = vk::SampleCountFlagBits::e1,
+    };
+    vk::PipelineColorBlendAttachmentState color_blend_attachment{
+        .blendEnable = true,
+        .srcColorBlendFactor = vk::BlendFactor::eSrcAlpha,
+        .dstColorBlendFactor = vk::BlendFactor::eOneMinusSrcAlpha,
+        .colorBlendOp = vk::BlendOp::eAdd,
+        .srcAlphaBlendFactor = vk::BlendFactor::eOne,
+        .dstAlphaBlendFactor = vk::BlendFactor::eOneMinusSrcAlpha,
+        .alphaBlendOp = vk::BlendOp::eAdd,
+        .colorWriteMask =
+            vk::ColorComponentFlagBits::eR | vk::ColorComponentFlagBits::eG |
+            vk::ColorComponentFlagBits::eB | vk::ColorComponentFlagBits::eA,
+    };
+    vk::PipelineColorBlendStateCreateInfo color_blend{};
+    color_blend.setAttachments(color_blend_attachment);
+    auto dynamic_states = {vk::DynamicState::eViewport,
+                           vk::DynamicState::eScissor};
+    vk::PipelineDynamicStateCreateInfo dynamic_state{};
+    dynamic_state.setDynamicStates(dynamic_states);
+    vk::PipelineRenderingCreateInfo rendering_info{};
+    rendering_info.setColorAttachmentFormats(color_attachment_format);
+
+    return vk::raii::Pipeline{device, nullptr,
+                              vk::GraphicsPipelineCreateInfo{
+                                  .pNext = &rendering_info,
+                                  .pVertexInputState = &vertex_input,
+                                  .pInputAssemblyState = &input_assembly,
+                                  .pViewportState = &viewport,
+                                  .pRasterizationState = &raster,
+                                  .pMultisampleState = &multisample,
+                                  .pColorBlendState = &color_blend,
+                                  .pDynamicState = &dynamic_state,
+                                  .layout = *pipeline.layout,
+                              }
+                                  .setStages(shaders)};
+  }
+};
+
+} // namespace vkvideo::medias
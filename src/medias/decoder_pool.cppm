@@ -0,0 +1,343 @@
+module;
+
+#include <cassert>
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+}
+
+export module vkvideo.medias:decoder_pool;
+
+import std;
+import vkvideo.core;
+import vkvideo.third_party;
+import :stream;
+
+export namespace vkvideo::medias {
+// streams with equal keys can share (not concurrently) the same decoder
+struct DecoderKey {
+  AVCodecID codec_id;
+  int profile;
+  i32 width, height;
+  int format;
+  bool hwaccel;
+  // hash of the extradata, for codecs that can not take new parameter sets
+  // in-band (0 otherwise)
+  u64 extradata_hash;
+  // H.264/HEVC packets are length-prefixed NAL units (avcC/hvcC extradata,
+  // e.g. from MP4/MKV) or Annex-B (e.g. TS, raw streams). Decoders do not
+  // switch between the two with new in-band extradata.
+  bool length_prefixed;
+
+  auto operator<=>(const DecoderKey &) const = default;
+
+  static DecoderKey of(const AVCodecParameters *params, bool hwaccel) {
+    DecoderKey key{
+        .codec_id = params->codec_id,
+        .profile = params->profile,
+        .width = params->width,
+        .height = params->height,
+        .format = params->format,
+        .hwaccel = hwaccel,
+        .extradata_hash = 0,
+        .length_prefixed = false,
+    };
+
+    // H.264 and HEVC decoders handle AV_PKT_DATA_NEW_EXTRADATA, as long as
+    // the bitstream format stays the same
+    std::span<const u8> extradata{
+        params->extradata, static_cast<std::size_t>(params->extradata_size)};
+    if (key.codec_id == AV_CODEC_ID_H264 || key.codec_id == AV_CODEC_ID_HEVC)
+      // avcC and hvcC start with their version, 1
+      key.length_prefixed = !extradata.empty() && extradata[0] == 1;
+    else
+      key.extradata_hash = fnv1a(extradata);
+
+    return key;
+  }
+};
+
+// pool of opened decoders, so that playing many short clips back to back
+// does not pay for the decoder (and hwaccel session) setup of every clip.
+// Decoders of destroyed streams return to the pool, and are handed to new
+// streams with the same DecoderKey after being flushed.
+class DecoderPool {
+public:
+  DecoderPool(std::size_t max_idle = 4)
+      : state{std::make_shared<State>(max_idle)} {}
+
+  // thread-safe
+  std::unique_ptr<FFmpegStream> open(RawFFmpegStream raw,
+                                     const tp::ffmpeg::BufferRef &hwaccel_ctx,
+                                     HWAccel hwaccel = HWAccel::eAuto) {
+    auto key = DecoderKey::of(raw.get_codecpar(), hwaccel != HWAccel::eOff);
+    auto decoder = state->take(key);
+    if (!decoder)
+      decoder = FFmpegStream::open_decoder(raw, hwaccel_ctx, hwaccel);
+
+    // the pool might be gone by the time the stream is destroyed
+    return std::make_unique<FFmpegStream>(
+        std::move(raw), std::move(decoder),
+        [weak_state = std::weak_ptr{state},
+         key](tp::ffmpeg::CodecContext decoder) {
+          if (auto state = weak_state.lock())
+            state->put(key, std::move(decoder));
+        });
+  }
+
+  void clear() { state->clear(); }
+
+private:
+  struct State {
+    std::mutex mutex;
+    std::size_t max_idle;
+    // most recently used first
+    std::list<std::pair<DecoderKey, tp::ffmpeg::CodecContext>> idle;
+
+    State(std::size_t max_idle) : max_idle{max_idle} {}
+
+    tp::ffmpeg::CodecContext take(const DecoderKey &key) {
+      std::lock_guard lock{mutex};
+      auto it =
+          std::ranges::find(idle, key, &decltype(idle)::value_type::first);
+      if (it == idle.end())
+        return nullptr;
+      auto decoder = std::move(it->second);
+      idle.erase(it);
+      return decoder;
+    }
+
+    void put(const DecoderKey &key, tp::ffmpeg::CodecContext decoder) {
+      std::list<std::pair<DecoderKey, tp::ffmpeg::CodecContext>> evicted;
+      std::lock_guard lock{mutex};
+      idle.emplace_front(key, std::move(decoder));
+      while (idle.size() > max_idle)
+        evicted.splice(evicted.end(), idle, std::prev(idle.end()));
+      // evicted decoders are freed after unlocking
+    }
+
+    void clear() {
+      std::list<std::pair<DecoderKey, tp::ffmpeg::CodecContext>> evicted;
+      std::lock_guard lock{mutex};
+      evicted.swap(idle);
+    }
+  };
+
+  std::shared_ptr<State> state;
+};
+
+// FFmpegStream with some frames decoded ahead of time
+class PrerolledStream : public Stream {
+public:
+  PrerolledStream(std::unique_ptr<FFmpegStream> stream,
+                  std::deque<tp::ffmpeg::Frame> frames)
+      : stream{std::move(stream)}, frames{std::move(frames)} {}
+  ~PrerolledStream() = default;
+
+  std::pair<tp::ffmpeg::Frame, bool>
+  next_frame(tp::ffmpeg::Frame &&frame = {}) override {
+    if (frames.empty())
+      return stream->next_frame(std::move(frame));
+
+    auto result = std::move(frames.front());
+    frames.pop_front();
+    return {std::move(result), true};
+  }
+
+  bool seek(i64 pos) override {
+    frames.clear();
+    return stream->seek(pos);
+  }
+
+  std::optional<i32> get_num_frames() override {
+    return stream->get_num_frames();
+  }
+  std::optional<i64> get_duration() override { return stream->get_duration(); }
+
+private:
+  std::unique_ptr<FFmpegStream> stream;
+  std::deque<tp::ffmpeg::Frame> frames;
+};
+
+// opens the next entries of a playlist in a background thread, and decodes
+// their first frames, so that switching to the next clip is instant.
+// Prerolled frames of all entries together are kept within a memory budget.
+class PlaylistPreloader {
+public:
+  PlaylistPreloader(DecoderPool &pool, const tp::ffmpeg::BufferRef &hwaccel_ctx,
+                    HWAccel hwaccel = HWAccel::eAuto, i32 lookahead = 2,
+                    i32 preroll_frames = 4,
+                    std::size_t budget_bytes = std::size_t{64} << 20)
+      : pool{pool},
+        // kept alive by the preloader, the caller's reference might not be
+        hwaccel_ctx{hwaccel_ctx ? av_buffer_ref(hwaccel_ctx.get()) : nullptr},
+        hwaccel{hwaccel},
+        lookahead{lookahead}, preroll_frames{preroll_frames},
+        budget_bytes{budget_bytes} {
+    worker = std::jthread{[this](std::stop_token stop) { run(stop); }};
+  }
+  ~PlaylistPreloader() = default;
+
+  void set_playlist(std::vector<std::string> paths) {
+    std::lock_guard lock{mutex};
+    playlist = std::move(paths);
+    position = 0;
+    ++generation;
+    entries.clear();
+    used_bytes = 0;
+    cond.notify_all();
+  }
+
+  // returns the stream of the index-th entry, and starts preloading the
+  // entries after it
+  std::unique_ptr<Stream> take(i32 index) {
+    std::unique_lock lock{mutex};
+    assert(index >= 0 && index < static_cast<i32>(playlist.size()));
+
+    std::optional<Entry> entry;
+    if (entries.contains(index)) {
+      // set_playlist() might replace the entries while waiting, so the entry
+      // is looked up again after every wakeup
+      auto waiting_generation = generation;
+      cond.wait(lock, [&] {
+        if (generation != waiting_generation)
+          return true;
+        auto it = entries.find(index);
+        return it == entries.end() || it->second.done;
+      });
+      if (auto it = entries.find(index);
+          generation == waiting_generation && it != entries.end()) {
+        entry = std::move(it->second);
+        entries.erase(it);
+        used_bytes -= entry->bytes;
+      }
+    }
+    // the index is in the new playlist if it was replaced meanwhile
+    if (index >= static_cast<i32>(playlist.size()))
+      throw std::out_of_range{"playlist index out of range"};
+
+    position = index + 1;
+    evict_outside_window();
+    auto path = playlist[index];
+    cond.notify_all();
+    lock.unlock();
+
+    if (!entry)
+      return pool.open(RawFFmpegStream{path, tp::ffmpeg::MediaType::Video},
+                       hwaccel_ctx, hwaccel);
+    if (entry->error)
+      std::rethrow_exception(entry->error);
+    return std::make_unique<PrerolledStream>(std::move(entry->stream),
+                                             std::move(entry->frames));
+  }
+
+private:
+  struct Entry {
+    bool done = false;
+    std::unique_ptr<FFmpegStream> stream;
+    std::deque<tp::ffmpeg::Frame> frames;
+    std::size_t bytes = 0;
+    std::exception_ptr error;
+  };
+
+  DecoderPool &pool;
+  tp::ffmpeg::BufferRef hwaccel_ctx;
+  HWAccel hwaccel;
+  i32 lookahead;
+  i32 preroll_frames;
+  std::size_t budget_bytes;
+
+  std::mutex mutex;
+  std::condition_variable_any cond;
+  std::vector<std::string> playlist;
+  i32 position = 0;
+  u64 generation = 0;
+  std::map<i32, Entry> entries;
+  std::size_t used_bytes = 0;
+  // declared last, so that it is joined before anything else is destroyed
+  std::jthread worker;
+
+  static std::size_t frame_bytes(const tp::ffmpeg::Frame &frame) {
+    auto format = static_cast<tp::ffmpeg::PixelFormat>(frame->format);
+    if (frame->hw_frames_ctx)
+      format = reinterpret_cast<AVHWFramesContext *>(frame->hw_frames_ctx->data)
+                   ->sw_format;
+    return std::max(
+        av_image_get_buffer_size(format, frame->width, frame->height, 1), 0);
+  }
+
+  // drop preloaded entries that will not be played soon (in-progress ones
+  // are dropped when they are done)
+  void evict_outside_window() {
+    std::erase_if(entries, [&](const auto &item) {
+      const auto &[index, entry] = item;
+      if (!entry.done ||
+          (index >= position && index < position + lookahead))
+        return false;
+      used_bytes -= entry.bytes;
+      return true;
+    });
+  }
+
+  void run(std::stop_token stop) {
+    std::unique_lock lock{mutex};
+    while (true) {
+      // the first entry in the window that is not preloaded yet
+      std::optional<i32> index;
+      cond.wait(lock, stop, [&] {
+        for (i32 i = position; i < position + lookahead &&
+                               i < static_cast<i32>(playlist.size());
+             ++i) {
+          if (!entries.contains(i)) {
+            index = i;
+            return true;
+          }
+        }
+        return false;
+      });
+      if (stop.stop_requested())
+        return;
+
+      // placeholder, so that take() waits for this entry
+      entries[*index];
+      auto path = playlist[*index];
+      auto current_generation = generation;
+      lock.unlock();
+
+      Entry result;
+      try {
+        result.stream = pool.open(
+            RawFFmpegStream{path, tp::ffmpeg::MediaType::Video}, hwaccel_ctx,
+            hwaccel);
+        for (i32 i = 0; i < preroll_frames && !stop.stop_requested(); ++i) {
+          auto [frame, got_frame] = result.stream->next_frame();
+          if (!got_frame)
+            break;
+
+          auto bytes = frame_bytes(frame);
+          {
+            std::lock_guard budget_lock{mutex};
+            if (used_bytes + result.bytes + bytes > budget_bytes)
+              break;
+          }
+          result.bytes += bytes;
+          result.frames.push_back(std::move(frame));
+        }
+      } catch (...) {
+        result.error = std::current_exception();
+      }
+      result.done = true;
+
+      lock.lock();
+      // the playlist might have been replaced in the meantime
+      if (generation == current_generation) {
+        used_bytes += result.bytes;
+        entries[*index] = std::move(result);
+        evict_outside_window();
+      }
+      cond.notify_all();
+    }
+  }
+};
+} // namespace vkvideo::medias
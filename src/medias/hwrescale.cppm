@@ -7,6 +7,7 @@ CMRC_DECLARE(vkvideo_shaders);
 
 extern "C" {
 #include <libavutil/hwcontext_vulkan.h>
+#include <libavutil/pixdesc.h>
 }
 export module vkvideo.medias:hwrescale;
 
@@ -18,6 +19,66 @@ import vkvideo.third_party;
 
 export namespace vkvideo::medias {
 
+// image and aspect of the i-th plane of a frame stored in the given images
+// (one image per plane, or one multi-planar image)
+std::pair<vk::Image, vk::ImageAspectFlagBits>
+plane_subresource(std::span<const vk::Image> images, std::size_t num_planes,
+                  i32 plane) {
+  assert(images.size() >= 1);
+  if (images.size() > 1)
+    return {images[plane], vk::ImageAspectFlagBits::eColor};
+  if (num_planes > 1) {
+    constexpr std::array aspects{vk::ImageAspectFlagBits::ePlane0,
+                                 vk::ImageAspectFlagBits::ePlane1,
+                                 vk::ImageAspectFlagBits::ePlane2};
+    return {images[0], aspects[plane]};
+  }
+  return {images[0], vk::ImageAspectFlagBits::eColor};
+}
+
+// extent of the i-th plane of a frame
+std::pair<i32, i32> plane_extent(tp::ffmpeg::PixelFormat format, i32 width,
+                                 i32 height, i32 plane) {
+  auto desc = tp::ffmpeg::get_pix_fmt_desc(format);
+  if (plane == 1 || plane == 2)
+    return {AV_CEIL_RSHIFT(width, desc->log2_chroma_w),
+            AV_CEIL_RSHIFT(height, desc->log2_chroma_h)};
+  return {width, height};
+}
+
+// record a copy of the planes of a frame into a frame of the same format
+void copy_frame_planes(vk::raii::CommandBuffer &cmd,
+                       std::span<const vk::Image> source,
+                       vk::ImageLayout source_layout,
+                       std::span<const vk::Image> target,
+                       vk::ImageLayout target_layout,
+                       tp::ffmpeg::PixelFormat format, i32 width, i32 height) {
+  auto num_planes = static_cast<std::size_t>(av_pix_fmt_count_planes(format));
+  // one copy per pair of images
+  std::map<std::pair<vk::Image, vk::Image>, std::vector<vk::ImageCopy2>>
+      copies;
+  for (i32 i = 0; i < num_planes; ++i) {
+    auto [src_image, src_aspect] = plane_subresource(source, num_planes, i);
+    auto [dst_image, dst_aspect] = plane_subresource(target, num_planes, i);
+    auto [plane_width, plane_height] = plane_extent(format, width, height, i);
+    copies[{src_image, dst_image}].push_back(vk::ImageCopy2{
+        .srcSubresource = {.aspectMask = src_aspect, .layerCount = 1},
+        .dstSubresource = {.aspectMask = dst_aspect, .layerCount = 1},
+        .extent = {static_cast<u32>(plane_width),
+                   static_cast<u32>(plane_height), 1},
+    });
+  }
+
+  for (auto &[images, regions] : copies)
+    cmd.copyImage2(vk::CopyImageInfo2{
+        .srcImage = images.first,
+        .srcImageLayout = source_layout,
+        .dstImage = images.second,
+        .dstImageLayout = target_layout,
+    }
+                       .setRegions(regions));
+}
+
 class HwVideoRescaler {
 public:
   virtual ~HwVideoRescaler() = default;
@@ -80,6 +141,14 @@ private:
 
   static std::vector<u32>
   compile_rescaling_shader(tp::ffmpeg::PixelFormat out_format) {
+    // compiled on first use, once per output format: the compiler is only
+    // needed when transcoding, and recompiling dominates rescaler creation
+    static std::mutex mutex;
+    static std::map<tp::ffmpeg::PixelFormat, std::vector<u32>> cache;
+    std::scoped_lock lock{mutex};
+    if (auto it = cache.find(out_format); it != cache.end())
+      return it->second;
+
     auto fs = cmrc::vkvideo_shaders::get_filesystem();
     auto hwrescale = fs.open("medias/hwrescale.comp");
 
@@ -98,21 +167,27 @@ private:
       std::println("HwRescaling shader message: {}", result.GetErrorMessage());
     assert(result.GetCompilationStatus() == shaderc_compilation_status_success);
 
-    return std::vector<u32>{result.begin(), result.end()};
+    return cache
+        .emplace(out_format, std::vector<u32>{result.begin(), result.end()})
+        .first->second;
   }
 
+  static constexpr std::size_t num_images = 5;
+
 public:
   YuvVideoRescaler(vk::raii::Device &device, tp::ffmpeg::PixelFormat out_format)
       : pixel_format{out_format}, vk_format_list{null_terminated_format_list(
                                       reinterpret_cast<const vk::Format *>(
                                           av_vkfmt_from_pixfmt(out_format)))} {
+    auto desc = tp::ffmpeg::get_pix_fmt_desc(out_format);
+    log2_chroma = {desc->log2_chroma_w, desc->log2_chroma_h};
     auto code = compile_rescaling_shader(out_format);
     vk::raii::ShaderModule module{device,
                                   vk::ShaderModuleCreateInfo{
                                       .codeSize = code.size() * sizeof(code[0]),
                                       .pCode = code.data(),
                                   }};
-    std::array<vk::DescriptorSetLayoutBinding, 5> bindings;
+    std::array<vk::DescriptorSetLayoutBinding, num_images> bindings;
     for (std::size_t i = 0; i < bindings.size(); ++i) {
       bindings[i].binding = i;
       bindings[i].descriptorType = vk::DescriptorType::eStorageImage;
@@ -158,53 +233,22 @@ public:
     desc_set = std::move(desc_sets[0]);
   }
 
-  std::vector<vk::raii::ImageView>
-  create_output_views(vk::raii::Device &device,
-                      const std::span<const vk::Image> &planes) {
-    assert(planes.size() >= 1);
-    std::vector<vk::raii::ImageView> views;
-    auto get_image = [&](i32 i) {
-      return planes.size() == 1 ? planes[0] : planes[i];
-    };
-    auto get_aspect_mask = [&](i32 i) {
-      assert(planes.size() >= 1);
-      // multi-plane image represented as multi-images
-      if (planes.size() > 1)
-        return vk::ImageAspectFlagBits::eColor;
-      // multi-plane image represented as one image
-      if (vk_format_list.size() > 1)
-        switch (i) {
-        case 0:
-          return vk::ImageAspectFlagBits::ePlane0;
-        case 1:
-          return vk::ImageAspectFlagBits::ePlane1;
-        case 2:
-          return vk::ImageAspectFlagBits::ePlane2;
-        }
-      // single-plane image represented as one image
-      return vk::ImageAspectFlagBits::eColor;
-    };
-    for (i32 i = 0; i < vk_format_list.size(); ++i) {
-      views.emplace_back(device, vk::ImageViewCreateInfo{
-                                     .image = get_image(i),
-                                     .viewType = vk::ImageViewType::e2D,
-                                     .format = vk_format_list[i],
-                                     .components =
-                                         {
-                                             vk::ComponentSwizzle::eIdentity,
-                                             vk::ComponentSwizzle::eIdentity,
-                                             vk::ComponentSwizzle::eIdentity,
-                                             vk::ComponentSwizzle::eIdentity,
-                                         },
-                                     .subresourceRange = {
-                                         .aspectMask = get_aspect_mask(i),
-                                         .baseMipLevel = 0,
-                                         .levelCount = 1,
-                                         .baseArrayLayer = 0,
-                                         .layerCount = 1,
-                                     }});
-    }
-    return views;
+  graphics::CachedImageView
+  get_output_view(vk::raii::Device &device,
+                  const std::span<const vk::Image> &planes, i32 plane) {
+    auto [image, aspect] =
+        plane_subresource(planes, vk_format_list.size(), plane);
+    return views.get(device, graphics::ImageViewKey{
+                                 .image = image,
+                                 .view_type = vk::ImageViewType::e2D,
+                                 .format = vk_format_list[plane],
+                                 .subresource_range = {
+                                     .aspectMask = aspect,
+                                     .baseMipLevel = 0,
+                                     .levelCount = 1,
+                                     .baseArrayLayer = 0,
+                                     .layerCount = 1,
+                                 }});
   }
 
   vk::ImageLayout input_image_layout() override {
@@ -225,55 +269,52 @@ public:
     return vk::AccessFlagBits2::eShaderStorageWrite;
   }
 
+  // the views are cached, so the source and target images must stay alive
+  // (e.g. as a render target and pool images) while this object is used
   UniqueAny bind_images(vk::raii::Device &device, vk::Image source,
                         const std::span<const vk::Image> &target) override {
-    static constexpr std::size_t num_images = 5;
-    std::array<vk::DescriptorImageInfo, num_images> image_infos;
-    std::array<vk::WriteDescriptorSet, num_images> write_ops;
-    std::array<vk::ImageView, num_images> image_views;
-    std::vector<vk::raii::ImageView> all_image_views =
-        create_output_views(device, target);
+    views.next_frame();
+    std::array<graphics::CachedImageView, num_images> image_views;
     // target views
     for (i32 i = 0; i < num_images - 1; ++i)
-      image_views[i] = all_image_views[i < all_image_views.size() ? i : 0];
+      image_views[i] = get_output_view(
+          device, target, i < vk_format_list.size() ? i : 0);
     // source view
-    image_views.back() = all_image_views.emplace_back(
-        device, vk::ImageViewCreateInfo{
+    image_views.back() = views.get(
+        device, graphics::ImageViewKey{
                     .image = source,
-                    .viewType = vk::ImageViewType::e2D,
+                    .view_type = vk::ImageViewType::e2D,
                     .format = vk::Format::eR32G32B32A32Sfloat,
-                    .components =
-                        {
-                            vk::ComponentSwizzle::eIdentity,
-                            vk::ComponentSwizzle::eIdentity,
-                            vk::ComponentSwizzle::eIdentity,
-                            vk::ComponentSwizzle::eIdentity,
-                        },
-                    .subresourceRange = {
+                    .subresource_range = {
                         .aspectMask = vk::ImageAspectFlagBits::eColor,
                         .levelCount = 1,
                         .layerCount = 1,
                     }});
 
-    u32 i = 0;
-    for (auto &&[image_view, image_info, write_op] :
-         std::views::zip(image_views, image_infos, write_ops)) {
-      image_info = vk::DescriptorImageInfo{
-          .imageView = image_view,
+    // only the bindings whose view changed are written
+    std::array<vk::DescriptorImageInfo, num_images> image_infos;
+    std::vector<vk::WriteDescriptorSet> write_ops;
+    for (u32 i = 0; i < num_images; ++i) {
+      if (bound_view_ids[i] == image_views[i].id)
+        continue;
+      bound_view_ids[i] = image_views[i].id;
+      image_infos[i] = vk::DescriptorImageInfo{
+          .imageView = image_views[i].view,
           .imageLayout = vk::ImageLayout::eGeneral,
       };
-      write_op = vk::WriteDescriptorSet{
+      write_ops.push_back(vk::WriteDescriptorSet{
           .dstSet = *desc_set,
-          .dstBinding = i++,
+          .dstBinding = i,
           .dstArrayElement = 0,
           .descriptorCount = 1,
           .descriptorType = vk::DescriptorType::eStorageImage,
-          .pImageInfo = &image_info,
-      };
+          .pImageInfo = &image_infos[i],
+      });
     }
 
-    device.updateDescriptorSets(write_ops, {});
-    return all_image_views;
+    if (!write_ops.empty())
+      device.updateDescriptorSets(write_ops, {});
+    return {};
   }
 
   void rescale(vk::raii::CommandBuffer &cmd, i32 width, i32 height) override {
@@ -282,8 +323,9 @@ public:
                            *desc_set, {});
     cmd.pushConstants<i32>(*pipeline_layout, vk::ShaderStageFlagBits::eCompute,
                            0, std::array<i32, 2>{width, height});
-    cmd.dispatch(AV_CEIL_RSHIFT(width, log2_chroma[0]),
-                 AV_CEIL_RSHIFT(height, log2_chroma[1]), 1);
+    // one invocation per chroma sample, 8x8 per workgroup
+    cmd.dispatch((AV_CEIL_RSHIFT(width, log2_chroma[0]) + 7) / 8,
+                 (AV_CEIL_RSHIFT(height, log2_chroma[1]) + 7) / 8, 1);
   }
 
 private:
@@ -292,11 +334,246 @@ private:
   vk::raii::PipelineLayout pipeline_layout = nullptr;
   vk::raii::Pipeline pipeline = nullptr;
   vk::raii::DescriptorSet desc_set = nullptr;
+  graphics::ImageViewCache views;
+  std::array<u64, num_images> bound_view_ids{};
   std::array<i32, 2> log2_chroma;
   tp::ffmpeg::PixelFormat pixel_format;
   std::span<const vk::Format> vk_format_list;
 };
 
+// compute-shader-based resizing between frames of the same YUV format
+// (e.g. decoded frames to encoder frames of another size). Every plane is
+// scaled on its own, so there is no round trip through RGB.
+class YuvVideoResizer {
+private:
+  static const std::vector<u32> &compile_resizing_shader() {
+    // compiled on first use, the shader does not depend on the format
+    static const std::vector<u32> code = [] {
+      auto fs = cmrc::vkvideo_shaders::get_filesystem();
+      auto yuvresize = fs.open("medias/yuvresize.comp");
+
+      shaderc::Compiler glslc;
+      shaderc::CompileOptions opts;
+      opts.SetOptimizationLevel(shaderc_optimization_level_performance);
+
+      auto result = glslc.CompileGlslToSpv(
+          yuvresize.begin(), yuvresize.size(), shaderc_compute_shader,
+          "medias/yuvresize.comp", opts);
+      if (!std::ranges::all_of(result.GetErrorMessage(),
+                               [](auto c) { return std::isspace(c); }))
+        std::println("YUV resizing shader message: {}",
+                     result.GetErrorMessage());
+      assert(result.GetCompilationStatus() ==
+             shaderc_compilation_status_success);
+
+      return std::vector<u32>{result.begin(), result.end()};
+    }();
+    return code;
+  }
+
+  static constexpr u32 max_planes = 3;
+
+  struct PushConstants {
+    std::array<i32, 2 * max_planes> plane_extents;
+    std::array<float, 2> source_uv_max;
+  };
+
+public:
+  YuvVideoResizer(vk::raii::Device &device, tp::ffmpeg::PixelFormat format)
+      : pixel_format{format},
+        vk_format_list{null_terminated_format_list(
+            reinterpret_cast<const vk::Format *>(
+                av_vkfmt_from_pixfmt(format)))} {
+    const auto &code = compile_resizing_shader();
+    vk::raii::ShaderModule module{device,
+                                  vk::ShaderModuleCreateInfo{
+                                      .codeSize = code.size() * sizeof(code[0]),
+                                      .pCode = code.data(),
+                                  }};
+    sampler = vk::raii::Sampler{
+        device, vk::SamplerCreateInfo{
+                    .magFilter = vk::Filter::eLinear,
+                    .minFilter = vk::Filter::eLinear,
+                    .mipmapMode = vk::SamplerMipmapMode::eNearest,
+                    .addressModeU = vk::SamplerAddressMode::eClampToEdge,
+                    .addressModeV = vk::SamplerAddressMode::eClampToEdge,
+                    .addressModeW = vk::SamplerAddressMode::eClampToEdge,
+                    .maxLod = 0.0f,
+                }};
+    // samplers of the source planes, then the target planes
+    std::array<vk::DescriptorSetLayoutBinding, 2 * max_planes> bindings;
+    for (std::size_t i = 0; i < bindings.size(); ++i) {
+      bindings[i].binding = i;
+      bindings[i].descriptorType =
+          i < max_planes ? vk::DescriptorType::eCombinedImageSampler
+                         : vk::DescriptorType::eStorageImage;
+      bindings[i].descriptorCount = 1;
+      bindings[i].stageFlags = vk::ShaderStageFlagBits::eCompute;
+    }
+    vk::PushConstantRange push_const_range{
+        .stageFlags = vk::ShaderStageFlagBits::eCompute,
+        .offset = 0,
+        .size = sizeof(PushConstants),
+    };
+    desc_set_layout = vk::raii::DescriptorSetLayout{
+        device, vk::DescriptorSetLayoutCreateInfo{}.setBindings(bindings)};
+    pipeline_layout = vk::raii::PipelineLayout{
+        device, vk::PipelineLayoutCreateInfo{}
+                    .setSetLayouts(*desc_set_layout)
+                    .setPushConstantRanges(push_const_range)};
+    pipeline = vk::raii::Pipeline{
+        device, nullptr,
+        vk::ComputePipelineCreateInfo{
+            .stage =
+                {
+                    .stage = vk::ShaderStageFlagBits::eCompute,
+                    .module = module,
+                    .pName = "main",
+                },
+            .layout = *pipeline_layout,
+        }};
+    std::array pool_sizes{
+        vk::DescriptorPoolSize{vk::DescriptorType::eCombinedImageSampler,
+                               max_planes},
+        vk::DescriptorPoolSize{vk::DescriptorType::eStorageImage, max_planes},
+    };
+    desc_pool = vk::raii::DescriptorPool{
+        device,
+        vk::DescriptorPoolCreateInfo{
+            .flags = vk::DescriptorPoolCreateFlagBits::eFreeDescriptorSet,
+            .maxSets = 1,
+        }
+            .setPoolSizes(pool_sizes)};
+    vk::raii::DescriptorSets desc_sets{device,
+                                       vk::DescriptorSetAllocateInfo{
+                                           .descriptorPool = *desc_pool,
+                                       }
+                                           .setSetLayouts(*desc_set_layout)};
+    desc_set = std::move(desc_sets[0]);
+  }
+
+  tp::ffmpeg::PixelFormat get_pixel_format() const { return pixel_format; }
+
+  // the source is sampled, the target is written as storage images
+  vk::ImageLayout source_image_layout() const {
+    return vk::ImageLayout::eShaderReadOnlyOptimal;
+  }
+  vk::ImageLayout target_image_layout() const {
+    return vk::ImageLayout::eGeneral;
+  }
+  vk::PipelineStageFlags2 pipeline_stage_flags() const {
+    return vk::PipelineStageFlagBits2::eComputeShader;
+  }
+  vk::AccessFlags2 source_access_flags() const {
+    return vk::AccessFlagBits2::eShaderSampledRead;
+  }
+  vk::AccessFlags2 target_access_flags() const {
+    return vk::AccessFlagBits2::eShaderStorageWrite;
+  }
+
+  // the views are cached, source_owner must keep the source images alive
+  // while their views are cached (e.g. it is the pool they come from), and
+  // the target images must stay alive while this object is used
+  UniqueAny bind_images(vk::raii::Device &device,
+                        std::span<const vk::Image> source,
+                        std::span<const vk::Image> target,
+                        std::shared_ptr<const void> source_owner = nullptr) {
+    views.next_frame();
+    auto get_view = [&](std::span<const vk::Image> images, i32 plane,
+                        std::shared_ptr<const void> owner) {
+      auto [image, aspect] =
+          plane_subresource(images, vk_format_list.size(), plane);
+      return views.get(device,
+                       graphics::ImageViewKey{
+                           .image = image,
+                           .view_type = vk::ImageViewType::e2D,
+                           .format = vk_format_list[plane],
+                           .subresource_range = {
+                               .aspectMask = aspect,
+                               .levelCount = 1,
+                               .layerCount = 1,
+                           }},
+                       std::move(owner));
+    };
+
+    std::array<graphics::CachedImageView, 2 * max_planes> image_views;
+    for (u32 i = 0; i < max_planes; ++i) {
+      // unused bindings repeat the first plane
+      auto plane = i < vk_format_list.size() ? i : 0;
+      image_views[i] = get_view(source, plane, source_owner);
+      image_views[max_planes + i] = get_view(target, plane, nullptr);
+    }
+
+    // only the bindings whose view changed are written
+    std::array<vk::DescriptorImageInfo, 2 * max_planes> image_infos;
+    std::vector<vk::WriteDescriptorSet> write_ops;
+    for (u32 i = 0; i < image_views.size(); ++i) {
+      if (bound_view_ids[i] == image_views[i].id)
+        continue;
+      bound_view_ids[i] = image_views[i].id;
+      bool sampled = i < max_planes;
+      image_infos[i] = vk::DescriptorImageInfo{
+          .sampler = sampled ? *sampler : nullptr,
+          .imageView = image_views[i].view,
+          .imageLayout =
+              sampled ? source_image_layout() : target_image_layout(),
+      };
+      write_ops.push_back(vk::WriteDescriptorSet{
+          .dstSet = *desc_set,
+          .dstBinding = i,
+          .dstArrayElement = 0,
+          .descriptorCount = 1,
+          .descriptorType = sampled ? vk::DescriptorType::eCombinedImageSampler
+                                    : vk::DescriptorType::eStorageImage,
+          .pImageInfo = &image_infos[i],
+      });
+    }
+    if (!write_ops.empty())
+      device.updateDescriptorSets(write_ops, {});
+    return {};
+  }
+
+  // source_uv_max is the part of the (possibly padded) source images that
+  // holds the frame
+  void resize(vk::raii::CommandBuffer &cmd, std::array<float, 2> source_uv_max,
+              i32 width, i32 height) {
+    PushConstants constants{.source_uv_max = source_uv_max};
+    for (i32 i = 0; i < vk_format_list.size(); ++i)
+      std::tie(constants.plane_extents[2 * i],
+               constants.plane_extents[2 * i + 1]) =
+          plane_extent(pixel_format, width, height, i);
+
+    cmd.bindPipeline(vk::PipelineBindPoint::eCompute, *pipeline);
+    cmd.bindDescriptorSets(vk::PipelineBindPoint::eCompute, *pipeline_layout, 0,
+                           *desc_set, {});
+    cmd.pushConstants<PushConstants>(
+        *pipeline_layout, vk::ShaderStageFlagBits::eCompute, 0, constants);
+    // one invocation per texel of the largest plane, z is the plane index
+    cmd.dispatch((width + 7) / 8, (height + 7) / 8,
+                 static_cast<u32>(vk_format_list.size()));
+  }
+
+private:
+  static std::span<const vk::Format>
+  null_terminated_format_list(const vk::Format *p) {
+    auto last = p;
+    while (*last != vk::Format::eUndefined)
+      ++last;
+    return {p, last};
+  }
+
+  vk::raii::Sampler sampler = nullptr;
+  vk::raii::DescriptorSetLayout desc_set_layout = nullptr;
+  vk::raii::DescriptorPool desc_pool = nullptr;
+  vk::raii::PipelineLayout pipeline_layout = nullptr;
+  vk::raii::Pipeline pipeline = nullptr;
+  vk::raii::DescriptorSet desc_set = nullptr;
+  graphics::ImageViewCache views;
+  std::array<u64, 2 * max_planes> bound_view_ids{};
+  tp::ffmpeg::PixelFormat pixel_format;
+  std::span<const vk::Format> vk_format_list;
+};
+
 class RgbVideoRescaler : public HwVideoRescaler {
 public:
   RgbVideoRescaler() = default;
@@ -2,9 +2,16 @@ export module vkvideo.medias;
 
 export import :stbi;
 export import :audio;
+export import :audio_mixer;
 export import :video;
 export import :video_frame;
 export import :stream;
 export import :output;
 export import :pipeline;
+export import :compositor;
 export import :hwrescale;
+export import :bcenc;
+export import :readback;
+export import :clip_cache;
+export import :decoder_pool;
+export import :preview;
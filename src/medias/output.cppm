@@ -1,15 +1,162 @@
+module;
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
 export module vkvideo.medias:output;
 
 import vkvideo.core;
 import vkvideo.third_party;
 import std;
 
+namespace vkvideo::medias {
+// FIFO with a maximum size, closing it wakes up every waiting thread
+template <class T> class BoundedQueue {
+public:
+  struct Stats {
+    std::size_t size;
+    // largest size reached so far
+    std::size_t max_size;
+    // pushes that had to wait for room in the queue
+    u64 blocked_pushes;
+  };
+
+  BoundedQueue(std::size_t capacity)
+      : capacity{std::max<std::size_t>(capacity, 1)} {}
+
+  // blocks while the queue is full, returns false if it is closed
+  bool push(T value) {
+    std::unique_lock lock{mutex};
+    if (!closed && items.size() >= capacity)
+      ++blocked_pushes;
+    not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+    if (closed)
+      return false;
+    items.push_back(std::move(value));
+    max_size = std::max(max_size, items.size());
+    not_empty.notify_one();
+    return true;
+  }
+
+  // blocks while the queue is empty, returns nullopt once it is closed and
+  // empty
+  std::optional<T> pop() {
+    std::unique_lock lock{mutex};
+    not_empty.wait(lock, [&] { return closed || !items.empty(); });
+    if (items.empty())
+      return std::nullopt;
+    auto value = std::move(items.front());
+    items.pop_front();
+    not_full.notify_one();
+    return value;
+  }
+
+  // no more pushes, the remaining items can still be popped (unless
+  // discard is set)
+  void close(bool discard = false) {
+    std::deque<T> discarded;
+    std::lock_guard lock{mutex};
+    closed = true;
+    if (discard)
+      discarded.swap(items);
+    not_full.notify_all();
+    not_empty.notify_all();
+  }
+
+  Stats stats() const {
+    std::lock_guard lock{mutex};
+    return Stats{
+        .size = items.size(),
+        .max_size = max_size,
+        .blocked_pushes = blocked_pushes,
+    };
+  }
+
+private:
+  mutable std::mutex mutex;
+  std::condition_variable not_full, not_empty;
+  std::deque<T> items;
+  std::size_t capacity;
+  std::size_t max_size = 0;
+  u64 blocked_pushes = 0;
+  bool closed = false;
+};
+} // namespace vkvideo::medias
+
 export namespace vkvideo::medias {
+// a finished segment of a streaming output
+struct SegmentInfo {
+  i32 index;
+  // file of the segment, empty if the output is not split into files
+  std::string path;
+  // in seconds
+  double start, duration;
+  std::size_t bytes;
+};
+
+struct StreamingOptions {
+  // "mp4" (fragmented, with an empty moov) or "mpegts"
+  std::string format = "mp4";
+  // segments are cut at the first keyframe (of the first video stream) at
+  // least this long after the start of the segment, so the actual length
+  // follows the GOP size of the encoder
+  double segment_duration = 2.0;
+  // if not empty, every segment goes to its own file, named by formatting
+  // its index with this (e.g. "segment_{:05}.m4s"), the output path then
+  // only gets the header (the init segment of fragmented MP4s)
+  std::string segment_pattern;
+  // called once a segment has been handed to the output (on the muxer
+  // thread in async mode)
+  std::function<void(const SegmentInfo &)> on_segment;
+};
+
+struct OutputOptions {
+  // encode and mux on worker threads (one per stream, plus one for the
+  // muxer), so that write_frame only blocks once the queues are full
+  bool async = false;
+  // frames of each stream waiting to be encoded
+  std::size_t max_queued_frames = 4;
+  // encoded packets (of every stream) waiting to be muxed
+  std::size_t max_queued_packets = 64;
+  // write buffer in front of the output file, 0 keeps FFmpeg's (32 KiB)
+  std::size_t io_buffer_size = std::size_t{4} << 20;
+  // write the output progressively (e.g. to a pipe, a socket or segment
+  // files) instead of as one file finalized in end()
+  std::optional<StreamingOptions> streaming;
+};
+
+// queue depths of a stream of an async OutputContext
+struct OutputQueueStats {
+  std::size_t queued_frames;
+  std::size_t max_queued_frames;
+  // write_frame calls that blocked on a full frame queue
+  u64 blocked_writes;
+  // packets of this stream waiting to be muxed
+  std::size_t queued_packets;
+  std::size_t max_queued_packets;
+};
+
 class OutputContext {
 public:
-  OutputContext(std::string_view path)
-      : muxer{tp::ffmpeg::OutputFormatContext::create(path)},
-        flush_packet{tp::ffmpeg::Packet::create()} {}
+  OutputContext(std::string_view path, OutputOptions options = {})
+      : options{options},
+        muxer{tp::ffmpeg::OutputFormatContext::create(
+            path, options.streaming ? options.streaming->format.c_str()
+                                    : nullptr)},
+        flush_packet{tp::ffmpeg::Packet::create()},
+        packets{options.max_queued_packets} {
+    // fragments are only flushed when a segment is cut, and no index is
+    // written at the end
+    if (options.streaming && options.streaming->format == "mp4")
+      muxer.set_option("movflags", "+frag_custom+empty_moov+"
+                                   "default_base_moof+skip_trailer");
+  }
+
+  ~OutputContext() {
+    // abandoned without end(), queued frames and packets are dropped
+    stop_workers(true);
+  }
 
   std::pair<tp::ffmpeg::Stream &, tp::ffmpeg::CodecContext &>
   add_stream(tp::ffmpeg::Codec codec) {
@@ -30,14 +177,45 @@ public:
     encoders[stream_idx].copy_params_to(muxer->streams[stream_idx]->codecpar);
   }
 
-  void begin() { muxer.begin(); }
+  void begin() {
+    muxer.begin(options.io_buffer_size);
+    if (options.streaming) {
+      for (i32 i = 0; i < static_cast<i32>(muxer->nb_streams); ++i) {
+        if (muxer->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
+          segment.stream_idx = i;
+          break;
+        }
+      }
+      if (!options.streaming->segment_pattern.empty())
+        muxer.reopen_file(segment_path(0), options.io_buffer_size);
+    }
+    if (!options.async)
+      return;
+
+    for (std::size_t i = 0; i < encoders.size(); ++i)
+      async_streams.push_back(
+          std::make_unique<AsyncStream>(options.max_queued_frames));
+    muxer_thread = std::jthread{[this] { run_worker([&] { run_muxer(); }); }};
+    for (i32 i = 0; i < static_cast<i32>(encoders.size()); ++i)
+      encoder_threads.emplace_back(
+          [this, i] { run_worker([&] { run_encoder(i); }); });
+  }
 
+  // flushes the encoders and writes the trailer, queued frames are encoded
+  // first in async mode
   void end() {
-    for (i32 i = 0; i < static_cast<i32>(encoders.size()); ++i) {
-      write_frame(nullptr, i);
-      flush_packets(i);
+    if (options.async) {
+      stop_workers(false);
+      rethrow_error();
+    } else {
+      for (i32 i = 0; i < static_cast<i32>(encoders.size()); ++i) {
+        write_frame(nullptr, i);
+        flush_packets(i);
+      }
     }
 
+    if (options.streaming && segment.started)
+      finish_segment(segment.end, true);
     muxer.end();
 
     // after this, the object is in an invalid state
@@ -53,22 +231,225 @@ public:
       flush_packet.rescale_ts(enc->time_base,
                               muxer->streams[stream_idx]->time_base);
       flush_packet->stream_index = stream_idx;
-      muxer.write_packet_interleaved(flush_packet);
+      mux_packet(flush_packet);
     }
 
     flush_packet.unref();
   }
 
+  // in async mode, the frame is referenced and queued, errors of the worker
+  // threads are rethrown here (and in end())
   void write_frame(const tp::ffmpeg::Frame &frame, i32 stream_idx) {
+    if (options.async) {
+      rethrow_error();
+      // a null frame flushes the encoder, as in avcodec_send_frame
+      tp::ffmpeg::Frame ref = nullptr;
+      if (frame) {
+        ref = tp::ffmpeg::Frame::create();
+        ref.ref_to(frame);
+      }
+      if (!async_streams[stream_idx]->frames.push(std::move(ref)))
+        rethrow_error();
+      return;
+    }
+
     do {
       flush_packets(stream_idx);
     } while (!encoders[stream_idx].send_frame(frame));
     flush_packets(stream_idx);
   }
 
+  // only meaningful in async mode
+  OutputQueueStats get_queue_stats(i32 stream_idx) const {
+    if (!options.async)
+      return {};
+    auto &stream = *async_streams[stream_idx];
+    auto frame_stats = stream.frames.stats();
+    return OutputQueueStats{
+        .queued_frames = frame_stats.size,
+        .max_queued_frames = frame_stats.max_size,
+        .blocked_writes = frame_stats.blocked_pushes,
+        .queued_packets = stream.queued_packets,
+        .max_queued_packets = stream.max_queued_packets,
+    };
+  }
+
 private:
+  // the segment being written, only touched by the thread that muxes
+  struct SegmentState {
+    // keyframes of this stream start segments
+    i32 stream_idx = 0;
+    i32 index = 0;
+    bool started = false;
+    // in seconds, end is the end of the last packet so far
+    double start = 0.0, end = 0.0;
+    std::size_t start_bytes = 0;
+  };
+
+  struct AsyncStream {
+    BoundedQueue<tp::ffmpeg::Frame> frames;
+    std::atomic<std::size_t> queued_packets = 0;
+    std::atomic<std::size_t> max_queued_packets = 0;
+
+    AsyncStream(std::size_t max_frames) : frames{max_frames} {}
+  };
+
+  OutputOptions options;
   tp::ffmpeg::OutputFormatContext muxer;
   tp::ffmpeg::Packet flush_packet;
   std::vector<tp::ffmpeg::CodecContext> encoders;
+  SegmentState segment;
+
+  std::vector<std::unique_ptr<AsyncStream>> async_streams;
+  BoundedQueue<tp::ffmpeg::Packet> packets;
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  // set on errors and when abandoned, workers stop without draining
+  std::atomic<bool> discarding = false;
+  // declared last, so that they are joined before anything else is destroyed
+  std::jthread muxer_thread;
+  std::vector<std::jthread> encoder_threads;
+
+  template <class F> void run_worker(F &&body) {
+    try {
+      body();
+    } catch (...) {
+      {
+        std::lock_guard lock{error_mutex};
+        if (!error)
+          error = std::current_exception();
+      }
+      // unblock everyone, nothing gets written after an error
+      discarding = true;
+      for (auto &stream : async_streams)
+        stream->frames.close(true);
+      packets.close(true);
+    }
+  }
+
+  void rethrow_error() {
+    std::lock_guard lock{error_mutex};
+    if (error)
+      std::rethrow_exception(error);
+  }
+
+  // encoders drain their queued frames (unless discard is set), then the
+  // muxer writes the remaining packets
+  void stop_workers(bool discard) {
+    if (discard)
+      discarding = true;
+    for (auto &stream : async_streams)
+      stream->frames.close(discard);
+    encoder_threads.clear();
+    packets.close(discard);
+    if (muxer_thread.joinable())
+      muxer_thread.join();
+  }
+
+  void run_encoder(i32 stream_idx) {
+    auto &stream = *async_streams[stream_idx];
+    // the encoder can only be flushed once
+    bool flushed = false;
+    while (auto frame = stream.frames.pop()) {
+      if (flushed)
+        continue;
+      encode_async(stream_idx, *frame);
+      flushed = !*frame;
+    }
+    // closed by end() (or by an error, in which case nothing is drained)
+    if (!discarding && !flushed)
+      encode_async(stream_idx, nullptr);
+  }
+
+  void encode_async(i32 stream_idx, const tp::ffmpeg::Frame &frame) {
+    do {
+      drain_async(stream_idx);
+    } while (!encoders[stream_idx].send_frame(frame));
+    drain_async(stream_idx);
+  }
+
+  void drain_async(i32 stream_idx) {
+    auto &enc = encoders[stream_idx];
+    auto &stream = *async_streams[stream_idx];
+    while (true) {
+      auto [packet, err] = enc.recv_packet();
+      if (err != tp::ffmpeg::RecvError::eSuccess)
+        break;
+      packet.rescale_ts(enc->time_base, muxer->streams[stream_idx]->time_base);
+      packet->stream_index = stream_idx;
+
+      auto queued = ++stream.queued_packets;
+      auto max_queued = stream.max_queued_packets.load();
+      while (queued > max_queued &&
+             !stream.max_queued_packets.compare_exchange_weak(max_queued,
+                                                               queued))
+        ;
+      if (!packets.push(std::move(packet)))
+        return;
+    }
+  }
+
+  void run_muxer() {
+    while (auto packet = packets.pop()) {
+      --async_streams[(*packet)->stream_index]->queued_packets;
+      mux_packet(*packet);
+    }
+  }
+
+  std::string segment_path(i32 index) const {
+    return std::vformat(options.streaming->segment_pattern,
+                        std::make_format_args(index));
+  }
+
+  // writes the packet, cutting a segment before it if needed
+  void mux_packet(tp::ffmpeg::Packet &packet) {
+    if (options.streaming && packet->stream_index == segment.stream_idx &&
+        packet->pts != AV_NOPTS_VALUE) {
+      auto time_base = muxer->streams[segment.stream_idx]->time_base;
+      auto start = packet->pts * av_q2d(time_base);
+      if (packet->flags & AV_PKT_FLAG_KEY) {
+        if (!segment.started) {
+          segment.started = true;
+          segment.start = start;
+        } else if (start - segment.start >=
+                   options.streaming->segment_duration) {
+          finish_segment(start, false);
+          segment.start = start;
+        }
+      }
+      segment.end = std::max(
+          segment.end, (packet->pts + packet->duration) * av_q2d(time_base));
+    }
+    muxer.write_packet_interleaved(packet);
+  }
+
+  // flushes everything written since the segment started, and moves on to
+  // the file of the next segment (unless last is set)
+  void finish_segment(double end, bool last) {
+    auto &streaming = *options.streaming;
+    muxer.flush();
+
+    auto bytes = muxer.get_bytes_written();
+    SegmentInfo info{
+        .index = segment.index,
+        .path = streaming.segment_pattern.empty() ? std::string{}
+                                                  : segment_path(segment.index),
+        .start = segment.start,
+        .duration = end - segment.start,
+        .bytes = bytes - segment.start_bytes,
+    };
+    ++segment.index;
+    segment.start_bytes = bytes;
+    if (!last && !streaming.segment_pattern.empty()) {
+      muxer.reopen_file(segment_path(segment.index), options.io_buffer_size);
+      segment.start_bytes = 0;
+      // every MPEG-TS segment must be decodable on its own
+      if (streaming.format == "mpegts")
+        muxer.set_option("mpegts_flags", "+resend_headers");
+    }
+
+    if (streaming.on_segment)
+      streaming.on_segment(info);
+  }
 };
 } // namespace vkvideo::medias
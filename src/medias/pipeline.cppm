@@ -1,17 +1,25 @@
 module;
+#include <cmrc/cmrc.hpp>
+#include <shaderc/shaderc.hpp>
+
 #include <cassert>
+CMRC_DECLARE(vkvideo_shaders);
+
 export module vkvideo.medias:pipeline;
 
 import std;
 import vulkan_hpp;
 import vkvideo.core;
+import vkvideo.graphics;
 import vkvideo.third_party;
 import :video_frame;
 
 export namespace vkvideo::medias {
 
+using VideoPlaneFormats = InplaceVector<vk::Format, max_video_frame_planes>;
+
 struct VideoPipelineInfo {
-  std::vector<vk::Format> plane_formats;
+  VideoPlaneFormats plane_formats;
   vk::Format color_attachment_format;
   tp::ffmpeg::PixelFormat pixel_format;
 
@@ -28,12 +36,78 @@ struct VideoPipelineInfo {
   }
 };
 
+// the conversion used to sample YUV frames of the given (multi-planar) format
+vk::raii::SamplerYcbcrConversion
+create_yuv_conversion(const vk::raii::Device &device, vk::Format format) {
+  return vk::raii::SamplerYcbcrConversion{
+      device,
+      // i dont know much about YUV so im just copying the information from
+      // https://themaister.net/blog/2019/12/01/yuv-sampling-in-vulkan-a-niche-and-complicated-feature-vk_khr_ycbcr_sampler_conversion/
+      vk::SamplerYcbcrConversionCreateInfo{
+          .format = format,
+          .ycbcrModel = vk::SamplerYcbcrModelConversion::eYcbcr601,
+          .ycbcrRange = vk::SamplerYcbcrRange::eItuFull,
+          .components =
+              vk::ComponentMapping{
+                  vk::ComponentSwizzle::eR,
+                  vk::ComponentSwizzle::eG,
+                  vk::ComponentSwizzle::eB,
+                  vk::ComponentSwizzle::eA,
+              },
+          .xChromaOffset = vk::ChromaLocation::eMidpoint,
+          .yChromaOffset = vk::ChromaLocation::eMidpoint,
+          .chromaFilter = vk::Filter::eLinear,
+          .forceExplicitReconstruction = false,
+      }};
+}
+
 struct FrameInfoPushConstants {
   float uv_max[2] = {1.0f, 1.0f};
   float frame_index = 0.0f;
 };
 
 struct VideoPipeline {
+private:
+  struct Shaders {
+    std::vector<u32> vertex, fragment;
+  };
+
+  static std::vector<u32> compile_shader(const char *path,
+                                         shaderc_shader_kind kind) {
+    auto fs = cmrc::vkvideo_shaders::get_filesystem();
+    auto source = fs.open(path);
+
+    shaderc::Compiler glslc;
+    shaderc::CompileOptions opts;
+    opts.SetOptimizationLevel(shaderc_optimization_level_performance);
+
+    auto result = glslc.CompileGlslToSpv(source.begin(), source.size(), kind,
+                                         path, opts);
+    if (!std::ranges::all_of(result.GetErrorMessage(),
+                             [](auto c) { return std::isspace(c); }))
+      std::println("Video pipeline shader message: {}",
+                   result.GetErrorMessage());
+    assert(result.GetCompilationStatus() == shaderc_compilation_status_success);
+
+    return std::vector<u32>{result.begin(), result.end()};
+  }
+
+  // compiled once, the first time a pipeline is created
+  static const Shaders &get_shaders() {
+    static const Shaders shaders{
+        .vertex = compile_shader("medias/fullscreen.vert",
+                                 shaderc_vertex_shader),
+        .fragment = compile_shader("medias/fullscreen.frag",
+                                   shaderc_fragment_shader),
+    };
+    return shaders;
+  }
+
+public:
+  // compiles the shaders ahead of the first pipeline (e.g. on a worker thread
+  // while the first frame is decoded), does nothing if they are compiled
+  static void prepare_shaders() { get_shaders(); }
+
   vk::raii::SamplerYcbcrConversion yuv_sampler = nullptr;
   vk::raii::Sampler sampler = nullptr;
   vk::raii::DescriptorSetLayout descriptor_set_layout = nullptr;
@@ -42,6 +116,11 @@ struct VideoPipeline {
   vk::raii::DescriptorPool descriptor_pool = nullptr;
   vk::raii::DescriptorSets descriptor_sets = nullptr;
   vk::raii::Pipeline pipeline = nullptr;
+  // id of the view bound to each descriptor set (0 if none)
+  std::vector<u64> bound_view_ids;
+  // the commands using the pipeline are done once each of these semaphores
+  // reaches its value
+  std::vector<std::pair<graphics::TimelineSemaphore *, u64>> last_uses;
 
   VideoPipeline(const vk::raii::Device &device, const VideoPipelineInfo &info,
                 i32 num_sets) {
@@ -49,26 +128,7 @@ struct VideoPipeline {
     assert(info.plane_formats.size() <= 1);
 
     if (info.is_yuv())
-      yuv_sampler = vk::raii::SamplerYcbcrConversion{
-          device,
-          // i dont know much about YUV so im just copying the information from
-          // https://themaister.net/blog/2019/12/01/yuv-sampling-in-vulkan-a-niche-and-complicated-feature-vk_khr_ycbcr_sampler_conversion/
-          vk::SamplerYcbcrConversionCreateInfo{
-              .format = info.plane_formats.front(),
-              .ycbcrModel = vk::SamplerYcbcrModelConversion::eYcbcr601,
-              .ycbcrRange = vk::SamplerYcbcrRange::eItuFull,
-              .components =
-                  vk::ComponentMapping{
-                      vk::ComponentSwizzle::eR,
-                      vk::ComponentSwizzle::eG,
-                      vk::ComponentSwizzle::eB,
-                      vk::ComponentSwizzle::eA,
-                  },
-              .xChromaOffset = vk::ChromaLocation::eMidpoint,
-              .yChromaOffset = vk::ChromaLocation::eMidpoint,
-              .chromaFilter = vk::Filter::eLinear,
-              .forceExplicitReconstruction = false,
-          }};
+      yuv_sampler = create_yuv_conversion(device, info.plane_formats.front());
 
     vk::SamplerYcbcrConversionInfo conv_info{.conversion = *yuv_sampler};
 
@@ -132,6 +192,7 @@ struct VideoPipeline {
             .descriptorSetCount = static_cast<vkvideo::u32>(num_sets),
         }
             .setSetLayouts(desc_set_layouts_non_owning)};
+    bound_view_ids.resize(num_sets);
     pipeline = create_pipeline(device, info.color_attachment_format);
   }
 
@@ -184,19 +245,17 @@ struct VideoPipeline {
                                 vk::DynamicState::eScissor};
     dynamic_state.setDynamicStates(viewport_dyn_states);
 
-    auto load_shader = [&](std::string_view path) {
-      std::ifstream file(path.data(), std::ios::binary);
-      std::vector<char> data((std::istreambuf_iterator<char>(file)),
-                             (std::istreambuf_iterator<char>()));
+    auto load_shader = [&](const std::vector<u32> &code) {
       return vk::raii::ShaderModule{
           device, vk::ShaderModuleCreateInfo{
-                      .codeSize = data.size(),
-                      .pCode = reinterpret_cast<vkvideo::u32 *>(data.data()),
+                      .codeSize = code.size() * sizeof(code[0]),
+                      .pCode = code.data(),
                   }};
     };
 
-    auto vertex_shader = load_shader("build/src/fullscreen.vert.spv");
-    auto fragment_shader = load_shader("build/src/fullscreen.frag.spv");
+    auto &shaders_code = get_shaders();
+    auto vertex_shader = load_shader(shaders_code.vertex);
+    auto fragment_shader = load_shader(shaders_code.fragment);
     vk::PipelineShaderStageCreateInfo shaders[2] = {
         {
             .stage = vk::ShaderStageFlagBits::eVertex,
@@ -231,25 +290,61 @@ struct VideoPipeline {
                               }};
   }
 
-  vk::raii::ImageView create_image_view(const vk::raii::Device &device,
-                                        const VideoFramePlane &plane) {
-    vk::SamplerYcbcrConversionInfo conv_info{.conversion = *yuv_sampler};
+  // owner keeps the image of the plane alive, see ImageViewCache
+  graphics::CachedImageView get_image_view(const vk::raii::Device &device,
+                                           graphics::ImageViewCache &views,
+                                           const VideoFramePlane &plane,
+                                           std::shared_ptr<const void> owner) {
+    return views.get(device,
+                     graphics::ImageViewKey{
+                         .image = plane.get_image(),
+                         .view_type = vk::ImageViewType::e2DArray,
+                         .format = plane.get_format(),
+                         .subresource_range = plane.get_subresource_range(),
+                         .conversion = *yuv_sampler,
+                     },
+                     std::move(owner));
+  }
 
-    return vk::raii::ImageView{
-        device, vk::ImageViewCreateInfo{
-                    .pNext = *yuv_sampler != nullptr ? &conv_info : nullptr,
-                    .image = plane.get_image(),
-                    .viewType = vk::ImageViewType::e2DArray,
-                    .format = plane.get_format(),
-                    .components =
-                        vk::ComponentMapping{
-                            vk::ComponentSwizzle::eIdentity,
-                            vk::ComponentSwizzle::eIdentity,
-                            vk::ComponentSwizzle::eIdentity,
-                            vk::ComponentSwizzle::eIdentity,
-                        },
-                    .subresourceRange = plane.get_subresource_range(),
-                }};
+  // writes the view to the set_idx-th descriptor set, unless it is already
+  // bound there
+  void bind_image(const vk::raii::Device &device, i32 set_idx,
+                  graphics::CachedImageView view) {
+    if (bound_view_ids[set_idx] == view.id)
+      return;
+    bound_view_ids[set_idx] = view.id;
+
+    vk::DescriptorImageInfo desc_sampler{
+        .sampler = *sampler,
+        .imageView = view.view,
+        .imageLayout = vk::ImageLayout::eShaderReadOnlyOptimal,
+    };
+    device.updateDescriptorSets(
+        vk::WriteDescriptorSet{
+            .dstSet = *descriptor_sets[set_idx],
+            .dstBinding = 0,
+            .descriptorCount = 1,
+            .descriptorType = vk::DescriptorType::eCombinedImageSampler,
+            .pImageInfo = &desc_sampler,
+        },
+        {});
+  }
+
+  // records that the commands using the pipeline are done once sem reaches
+  // value (the values of a semaphore must be increasing)
+  void mark_used(graphics::TimelineSemaphore &sem, u64 value) {
+    for (auto &[use_sem, use_value] : last_uses)
+      if (use_sem == &sem) {
+        use_value = value;
+        return;
+      }
+    last_uses.emplace_back(&sem, value);
+  }
+
+  bool in_use() const {
+    return std::ranges::any_of(last_uses, [](const auto &use) {
+      return use.first->get_value() < use.second;
+    });
   }
 };
 } // namespace vkvideo::medias
@@ -261,28 +356,100 @@ template <> struct hash<vkvideo::medias::VideoPipelineInfo> {
     for (auto fmt : info.plane_formats)
       hash = hash * 33 + std::hash<vk::Format>{}(fmt);
     hash = hash * 33 + std::hash<vk::Format>{}(info.color_attachment_format);
+    hash = hash * 33 + std::hash<vkvideo::tp::ffmpeg::PixelFormat>{}(
+                           info.pixel_format);
     return hash;
   }
 };
 } // namespace std
 
 export namespace vkvideo::medias {
+// pipelines of the most recently used VideoPipelineInfo's. Once there are
+// more than capacity of them, the least recently used one is evicted, and
+// destroyed by collect() once its last use (see VideoPipeline::mark_used) is
+// done. The device must be idle when the cache is destroyed.
 class VideoPipelineCache {
 public:
+  VideoPipelineCache(std::size_t capacity = 16) : capacity{capacity} {
+    assert(capacity > 0);
+  }
+
+  // returns the pipeline, creating it if needed
   std::shared_ptr<VideoPipeline> get(const VideoPipelineInfo &info,
                                      vk::raii::Device &device, i32 fif_cnt) {
+    auto &entry = find_or_compile(info, device, fif_cnt);
+    if (!entry.pipeline)
+      entry.pipeline = entry.compiling.get();
+    return entry.pipeline;
+  }
+
+  // like get(), but the pipeline is created on a background thread, and null
+  // is returned until it is ready (the caller must draw something else, e.g.
+  // nothing, meanwhile)
+  std::shared_ptr<VideoPipeline> try_get(const VideoPipelineInfo &info,
+                                         vk::raii::Device &device,
+                                         i32 fif_cnt) {
+    auto &entry = find_or_compile(info, device, fif_cnt);
+    if (!entry.pipeline && entry.compiling.wait_for(std::chrono::seconds{0}) ==
+                               std::future_status::ready)
+      entry.pipeline = entry.compiling.get();
+    return entry.pipeline;
+  }
+
+  // destroys the evicted pipelines that are not used anymore
+  void collect() {
+    std::erase_if(retired,
+                  [](const auto &pipeline) { return !pipeline->in_use(); });
+  }
+
+private:
+  struct Entry {
+    std::shared_ptr<VideoPipeline> pipeline;
+    // valid until the pipeline is created
+    std::future<std::shared_ptr<VideoPipeline>> compiling;
+    std::list<VideoPipelineInfo>::iterator lru_it;
+  };
+
+  Entry &find_or_compile(const VideoPipelineInfo &info,
+                         vk::raii::Device &device, i32 fif_cnt) {
     if (auto it = pipelines.find(info); it != pipelines.end()) {
+      lru.splice(lru.begin(), lru, it->second.lru_it);
       return it->second;
-    } else {
-      auto pipeline = std::make_shared<VideoPipeline>(device, info, fif_cnt);
-      pipelines.emplace(info, pipeline);
-      return pipeline;
     }
+
+    evict();
+    lru.push_front(info);
+    auto &entry = pipelines[info];
+    entry.lru_it = lru.begin();
+    entry.compiling =
+        std::async(std::launch::async, [&device, info, fif_cnt]() {
+          return std::make_shared<VideoPipeline>(device, info, fif_cnt);
+        });
+    return entry;
   }
 
-private:
-  std::unordered_map<VideoPipelineInfo, std::shared_ptr<VideoPipeline>>
-      pipelines;
+  // makes room for a new pipeline
+  void evict() {
+    // pipelines being created are not evicted, the cache can go over
+    // capacity until they are done
+    for (auto it = lru.rbegin();
+         pipelines.size() >= capacity && it != lru.rend();) {
+      auto entry = pipelines.find(*it);
+      if (!entry->second.pipeline) {
+        ++it;
+        continue;
+      }
+      retired.push_back(std::move(entry->second.pipeline));
+      pipelines.erase(entry);
+      it = std::make_reverse_iterator(lru.erase(std::next(it).base()));
+    }
+  }
+
+  std::size_t capacity;
+  std::unordered_map<VideoPipelineInfo, Entry> pipelines;
+  // most recently used first
+  std::list<VideoPipelineInfo> lru;
+  std::vector<std::shared_ptr<VideoPipeline>> retired;
 };
 
 } // namespace vkvideo::medias
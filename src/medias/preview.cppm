@@ -0,0 +1,285 @@
+module;
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+}
+
+#include <cassert>
+
+export module vkvideo.medias:preview;
+
+import std;
+import vkvideo.core;
+import vkvideo.third_party;
+import :stream;
+import :stbi;
+
+export namespace vkvideo::medias {
+
+struct PreviewOptions {
+  // one tile every interval (in nanoseconds). Tiles show the keyframe at or
+  // before their time, so with keyframes sparser than this, some tiles are
+  // dropped (see PreviewTile::time).
+  i64 interval = 10'000'000'000;
+  // frames are downscaled to fit in a tile, keeping their aspect ratio
+  i32 tile_width = 160;
+  i32 tile_height = 90;
+  // decode at 1/2^lowres of the resolution, clamped to what the codec
+  // supports (most codecs do not support it at all)
+  i32 lowres = 3;
+  // skip the deblocking filter, barely visible at tile size
+  bool skip_loop_filter = true;
+  // consecutive tiles of a file decoded by the same worker, fewer means more
+  // opened demuxers, more means less parallelism for short files
+  i32 tiles_per_segment = 16;
+};
+
+struct PreviewTile {
+  // of the decoded keyframe, in nanoseconds since the start of the stream
+  i64 time;
+  // RGB24, at most tile_width x tile_height
+  tp::ffmpeg::Frame image;
+};
+
+// decodes downscaled keyframes of a video for thumbnails, as cheaply as
+// possible: only keyframe packets are sent to a software decoder that skips
+// non-keyframes (and the loop filter, and decodes at a lower resolution if
+// the codec can), then the frames are scaled down to the tile size
+class PreviewExtractor {
+public:
+  PreviewExtractor(std::string_view path, const PreviewOptions &options = {})
+      : PreviewExtractor{RawFFmpegStream{path, tp::ffmpeg::MediaType::Video},
+                         options} {}
+
+  PreviewExtractor(RawFFmpegStream raw, const PreviewOptions &options = {})
+      : raw{std::move(raw)}, options{options} {
+    decoder = tp::ffmpeg::CodecContext::create(this->raw.get_codec());
+    decoder.copy_params_from(this->raw.get_codecpar());
+    decoder->skip_frame = AVDISCARD_NONKEY;
+    if (options.skip_loop_filter)
+      decoder->skip_loop_filter = AVDISCARD_ALL;
+    decoder->lowres = std::clamp<i32>(options.lowres, 0,
+                                      this->raw.get_codec()->max_lowres);
+    decoder->flags2 |= AV_CODEC_FLAG2_FAST;
+    // files and segments are decoded in parallel instead
+    decoder->thread_count = 1;
+    decoder.open();
+    packet = tp::ffmpeg::Packet::create();
+  }
+
+  // the keyframe at or before time (in nanoseconds since the start of the
+  // stream), downscaled, nullopt if there is none
+  std::optional<PreviewTile> extract(i64 time) {
+    auto &stream = *raw.get_demuxer()->streams[raw.get_stream_index()];
+    // e.g. MPEG-TS streams rarely start at 0
+    i64 start_time = 0;
+    if (stream.start_time != AV_NOPTS_VALUE)
+      start_time = tp::ffmpeg::rescale_to_ns(stream.start_time,
+                                             stream.time_base);
+
+    decoder.flush_buffers();
+    raw.seek(start_time + time);
+
+    while (true) {
+      tp::ffmpeg::RecvError err;
+      std::tie(packet, err) = raw.read_packet(std::move(packet));
+      // the (empty) packet at the end of the file
+      if (err != tp::ffmpeg::RecvError::eSuccess || !packet->data)
+        return std::nullopt;
+      if (packet->flags & AV_PKT_FLAG_KEY)
+        break;
+    }
+
+    auto pts = packet->pts;
+    decoder.send_packet(packet);
+    tp::ffmpeg::RecvError err;
+    std::tie(frame, err) = decoder.recv_frame(std::move(frame));
+    if (err == tp::ffmpeg::RecvError::eAgain) {
+      // held back for reordering, the decoder is flushed anyway
+      decoder.send_packet(tp::ffmpeg::Packet{nullptr});
+      std::tie(frame, err) = decoder.recv_frame(std::move(frame));
+    }
+    if (err != tp::ffmpeg::RecvError::eSuccess)
+      return std::nullopt;
+
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE)
+      pts = frame->best_effort_timestamp;
+    PreviewTile tile{
+        .time = tp::ffmpeg::rescale_to_ns(pts, stream.time_base) - start_time,
+        .image = downscale(frame),
+    };
+    frame.unref();
+    return tile;
+  }
+
+private:
+  RawFFmpegStream raw;
+  PreviewOptions options;
+  tp::ffmpeg::CodecContext decoder;
+  tp::ffmpeg::Packet packet;
+  tp::ffmpeg::Frame frame;
+  tp::ffmpeg::VideoRescaler rescaler;
+
+  tp::ffmpeg::Frame downscale(const tp::ffmpeg::Frame &source) {
+    // the displayed aspect ratio, also with non-square pixels
+    auto display_width = static_cast<double>(source->width);
+    if (source->sample_aspect_ratio.num > 0 &&
+        source->sample_aspect_ratio.den > 0)
+      display_width *= av_q2d(source->sample_aspect_ratio);
+    auto scale =
+        std::min(options.tile_width / display_width,
+                 options.tile_height / static_cast<double>(source->height));
+
+    auto image = tp::ffmpeg::Frame::create();
+    image->format = tp::ffmpeg::PixelFormat::AV_PIX_FMT_RGB24;
+    image->width = std::clamp(static_cast<i32>(display_width * scale), 1,
+                              options.tile_width);
+    image->height =
+        std::clamp(static_cast<i32>(source->height * scale), 1,
+                   options.tile_height);
+    image.get_buffer();
+    rescaler.auto_rescale(image, source);
+    return image;
+  }
+};
+
+// preview tiles of every file, in the order of their times. The tiles of
+// each file are split into segments, which are decoded concurrently (each
+// with its own demuxer and decoder) using up to num_threads threads (0: one
+// per core). Errors are reported and only drop the tiles they affect, so one
+// unreadable file does not fail the whole batch.
+std::vector<std::vector<PreviewTile>>
+extract_previews(std::span<const std::string> paths,
+                 const PreviewOptions &options = {}, i32 num_threads = 0) {
+  assert(options.interval > 0 && options.tiles_per_segment > 0);
+
+  std::vector<i64> num_tiles(paths.size(), 0);
+  parallel_for(
+      paths.size(),
+      [&](std::size_t i) {
+        try {
+          RawFFmpegStream raw{paths[i], tp::ffmpeg::MediaType::Video};
+          // at least the first keyframe if the duration is unknown
+          num_tiles[i] = raw.duration().value_or(0) / options.interval + 1;
+        } catch (std::exception &ex) {
+          std::println(std::cerr, "Unable to open {} for previews: {}",
+                       paths[i], ex.what());
+        }
+      },
+      num_threads);
+
+  struct Segment {
+    std::size_t file;
+    i64 first_tile, num_tiles;
+  };
+  std::vector<Segment> segments;
+  std::vector<std::vector<std::optional<PreviewTile>>> tiles(paths.size());
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    tiles[i].resize(num_tiles[i]);
+    for (i64 first = 0; first < num_tiles[i];
+         first += options.tiles_per_segment)
+      segments.push_back(Segment{
+          .file = i,
+          .first_tile = first,
+          .num_tiles = std::min<i64>(options.tiles_per_segment,
+                                     num_tiles[i] - first),
+      });
+  }
+
+  parallel_for(
+      segments.size(),
+      [&](std::size_t i) {
+        auto &segment = segments[i];
+        auto &path = paths[segment.file];
+        std::optional<PreviewExtractor> extractor;
+        try {
+          extractor.emplace(path, options);
+        } catch (std::exception &ex) {
+          std::println(std::cerr, "Unable to open {} for previews: {}", path,
+                       ex.what());
+          return;
+        }
+        for (i64 j = segment.first_tile;
+             j < segment.first_tile + segment.num_tiles; ++j) {
+          try {
+            tiles[segment.file][j] = extractor->extract(j * options.interval);
+          } catch (std::exception &ex) {
+            std::println(std::cerr, "Unable to extract preview {} of {}: {}",
+                         j, path, ex.what());
+          }
+        }
+      },
+      num_threads);
+
+  std::vector<std::vector<PreviewTile>> result(paths.size());
+  for (std::size_t i = 0; i < paths.size(); ++i) {
+    for (auto &tile : tiles[i]) {
+      // tiles sharing their keyframe with the previous one are dropped
+      if (tile && (result[i].empty() || result[i].back().time < tile->time))
+        result[i].push_back(std::move(*tile));
+    }
+  }
+  return result;
+}
+
+// the tiles laid out in a grid (row-major), for a scrub bar sprite sheet
+struct PreviewAtlas {
+  // RGB24, black where there is no image
+  tp::ffmpeg::Frame image;
+  i32 columns, rows;
+  i32 tile_width, tile_height;
+  // time of each tile, in the grid order
+  std::vector<i64> times;
+
+  // top-left corner of the tile, images smaller than the tile are centered
+  // in it
+  std::pair<i32, i32> tile_offset(std::size_t index) const {
+    return {static_cast<i32>(index % columns) * tile_width,
+            static_cast<i32>(index / columns) * tile_height};
+  }
+
+  // encodes the whole sheet at once, instead of an image per tile
+  void write(std::string_view filename) const {
+    stbi::write_img(filename, image);
+  }
+};
+
+PreviewAtlas make_preview_atlas(std::span<const PreviewTile> tiles,
+                                const PreviewOptions &options = {},
+                                i32 columns = 10) {
+  assert(columns > 0);
+  PreviewAtlas atlas{
+      .columns = columns,
+      .rows = std::max<i32>(
+          1, (static_cast<i32>(tiles.size()) + columns - 1) / columns),
+      .tile_width = options.tile_width,
+      .tile_height = options.tile_height,
+  };
+
+  atlas.image = tp::ffmpeg::Frame::create();
+  atlas.image->format = tp::ffmpeg::PixelFormat::AV_PIX_FMT_RGB24;
+  atlas.image->width = atlas.columns * atlas.tile_width;
+  atlas.image->height = atlas.rows * atlas.tile_height;
+  atlas.image.get_buffer();
+  for (i32 y = 0; y < atlas.image->height; ++y)
+    std::memset(atlas.image->data[0] + y * atlas.image->linesize[0], 0,
+                static_cast<std::size_t>(atlas.image->width) * 3);
+
+  atlas.times.reserve(tiles.size());
+  for (std::size_t i = 0; i < tiles.size(); ++i) {
+    auto &image = tiles[i].image;
+    auto [x, y] = atlas.tile_offset(i);
+    x += (atlas.tile_width - image->width) / 2;
+    y += (atlas.tile_height - image->height) / 2;
+    for (i32 row = 0; row < image->height; ++row)
+      std::memcpy(atlas.image->data[0] + (y + row) * atlas.image->linesize[0] +
+                      x * 3,
+                  image->data[0] + row * image->linesize[0],
+                  static_cast<std::size_t>(image->width) * 3);
+    atlas.times.push_back(tiles[i].time);
+  }
+  return atlas;
+}
+
+} // namespace vkvideo::medias
@@ -0,0 +1,264 @@
+module;
+
+#include <cassert>
+extern "C" {
+#include <libavutil/hwcontext_vulkan.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+export module vkvideo.medias:readback;
+
+import std;
+import vulkan_hpp;
+import vk_mem_alloc_hpp;
+import vkvideo.core;
+import vkvideo.graphics;
+import vkvideo.third_party;
+import :hwrescale;
+
+export namespace vkvideo::medias {
+// reads Vulkan frames back into system memory (e.g. for software encoders)
+// through a ring of host-visible buffers. Copies run on the transfer queue
+// and are fenced by a timeline semaphore, so the copy of frame N overlaps
+// with the rendering of frame N+1, and the CPU only waits for a copy once
+// the ring is full.
+class FrameReadback {
+public:
+  FrameReadback(graphics::VkContext &vk, tp::ffmpeg::PixelFormat format,
+                i32 width, i32 height, i32 num_slots = 3)
+      : vk{vk}, format{format}, width{width}, height{height},
+        qf{static_cast<u32>(vk.get_queues().get_qf_transfer())},
+        sem{vk.get_device(), 0, "readback_sem"} {
+    assert(num_slots > 0);
+    num_planes = av_pix_fmt_count_planes(format);
+    std::size_t size = 0;
+    for (i32 i = 0; i < num_planes; ++i) {
+      // transfer-only queues need 4-byte aligned buffer offsets, 16 also
+      // covers the texel sizes of every YUV plane format
+      size = (size + 15) & ~std::size_t{15};
+      plane_offsets.push_back(size);
+      plane_linesizes.push_back(av_image_get_linesize(format, width, i));
+      plane_heights.push_back(plane_extent(format, width, height, i).second);
+      size += static_cast<std::size_t>(plane_linesizes.back()) *
+              plane_heights.back();
+    }
+
+    pool = vk::raii::CommandPool{
+        vk.get_device(),
+        vk::CommandPoolCreateInfo{
+            .flags = vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+            .queueFamilyIndex = qf,
+        }};
+    vk::raii::CommandBuffers cmds{
+        vk.get_device(), vk::CommandBufferAllocateInfo{
+                             .commandPool = *pool,
+                             .level = vk::CommandBufferLevel::ePrimary,
+                             .commandBufferCount = static_cast<u32>(num_slots),
+                         }};
+
+    auto &allocator = vk.get_vma_allocator();
+    for (auto &cmd : cmds) {
+      auto [buffer, allocation] = allocator.createBufferUnique(
+          {
+              .size = size,
+              .usage = vk::BufferUsageFlagBits::eTransferDst,
+          },
+          {
+              .flags = vma::AllocationCreateFlagBits::eMapped,
+              .requiredFlags = vk::MemoryPropertyFlagBits::eHostVisible,
+              // the CPU reads every byte of it
+              .preferredFlags = vk::MemoryPropertyFlagBits::eHostCached,
+          });
+      auto data = static_cast<const u8 *>(
+          allocator.getAllocationInfo(allocation.get()).pMappedData);
+      slots.push_back(Slot{
+          .buffer = std::move(buffer),
+          .allocation = std::move(allocation),
+          .data = data,
+          .cmd = std::move(cmd),
+      });
+    }
+  }
+
+  FrameReadback(const FrameReadback &) = delete;
+  FrameReadback &operator=(const FrameReadback &) = delete;
+
+  ~FrameReadback() {
+    // the buffers and frames must outlive the copies
+    if (in_flight > 0)
+      sem.wait(sem_value, std::numeric_limits<i64>::max());
+  }
+
+  // whether take() must be called before the next submit()
+  bool full() const { return in_flight == slots.size(); }
+  bool empty() const { return pending.empty(); }
+
+  // copy a Vulkan frame (with the format and extent of this object) once
+  // wait is signalled. Its images must be usable from the transfer queue
+  // without an ownership transfer (FFmpeg creates them with concurrent
+  // sharing), and are transitioned from layout. A reference to the frame
+  // is kept until the copy is done.
+  void submit(const tp::ffmpeg::Frame &hw_frame, vk::ImageLayout layout,
+              vk::SemaphoreSubmitInfo wait) {
+    assert(!full());
+    auto index = next_slot;
+    next_slot = (next_slot + 1) % static_cast<i32>(slots.size());
+    auto &slot = slots[index];
+
+    slot.frame = tp::ffmpeg::Frame::create();
+    slot.frame.ref_to(hw_frame);
+    auto &vk_frame = *reinterpret_cast<AVVkFrame *>(hw_frame->data[0]);
+    std::vector<vk::Image> images;
+    for (auto img : vk_frame.img)
+      if (img)
+        images.push_back(static_cast<vk::Image>(img));
+
+    slot.cmd.reset();
+    slot.cmd.begin(vk::CommandBufferBeginInfo{
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+
+    // the semaphore is waited for at the copy stage, which chains this
+    // barrier (and its layout transition) after the wait, so the writes
+    // are available and only the layout needs to change here
+    std::vector<vk::ImageMemoryBarrier2> barriers;
+    for (auto image : images)
+      barriers.push_back(vk::ImageMemoryBarrier2{
+          .srcStageMask = vk::PipelineStageFlagBits2::eCopy,
+          .srcAccessMask = vk::AccessFlagBits2::eNone,
+          .dstStageMask = vk::PipelineStageFlagBits2::eCopy,
+          .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+          .oldLayout = layout,
+          .newLayout = vk::ImageLayout::eTransferSrcOptimal,
+          .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
+          .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
+          .image = image,
+          .subresourceRange = {
+              .aspectMask = vk::ImageAspectFlagBits::eColor,
+              .levelCount = 1,
+              .layerCount = 1,
+          }});
+    slot.cmd.pipelineBarrier2(
+        vk::DependencyInfo{}.setImageMemoryBarriers(barriers));
+
+    // one copy per image
+    std::map<vk::Image, std::vector<vk::BufferImageCopy>> copies;
+    for (i32 i = 0; i < num_planes; ++i) {
+      auto [image, aspect] = plane_subresource(images, num_planes, i);
+      auto [plane_width, plane_height] = plane_extent(format, width, height, i);
+      copies[image].push_back(vk::BufferImageCopy{
+          .bufferOffset = plane_offsets[i],
+          .imageSubresource = {.aspectMask = aspect, .layerCount = 1},
+          .imageExtent = {static_cast<u32>(plane_width),
+                          static_cast<u32>(plane_height), 1},
+      });
+    }
+    for (auto &[image, regions] : copies)
+      slot.cmd.copyImageToBuffer(image, vk::ImageLayout::eTransferSrcOptimal,
+                                 *slot.buffer, regions);
+    slot.cmd.end();
+
+    slot.value = ++sem_value;
+    vk::CommandBufferSubmitInfo cmd_info{.commandBuffer = *slot.cmd};
+    // must match the first scope of the barriers above
+    wait.stageMask = vk::PipelineStageFlagBits2::eCopy;
+    vk::SemaphoreSubmitInfo signal{
+        .semaphore = sem,
+        .value = slot.value,
+        .stageMask = vk::PipelineStageFlagBits2::eCopy,
+    };
+    {
+      auto [q_lock, queue] = vk.get_queues().get_queue(qf);
+      queue.submit2(vk::SubmitInfo2{}
+                        .setCommandBufferInfos(cmd_info)
+                        .setWaitSemaphoreInfos(wait)
+                        .setSignalSemaphoreInfos(signal));
+    }
+    pending.push_back(Pending{.slot = index});
+    ++in_flight;
+  }
+
+  // queue a repeat of the previously submitted frame (with the given pts),
+  // that is taken without copying anything
+  void submit_duplicate(i64 pts) {
+    assert(!pending.empty() || last_frame);
+    pending.push_back(Pending{.pts = pts});
+  }
+
+  // wait for the oldest submitted frame, and return it as a software frame
+  // (with the properties, e.g. pts, of the submitted frame)
+  tp::ffmpeg::Frame take() {
+    assert(!empty());
+    auto item = pending.front();
+    pending.pop_front();
+
+    auto frame = tp::ffmpeg::Frame::create();
+    if (!item.slot) {
+      // the data is shared, encoders do not write to their input
+      frame.ref_to(last_frame);
+      frame->pts = item.pts;
+      return frame;
+    }
+
+    auto &slot = slots[*item.slot];
+    --in_flight;
+
+    sem.wait(slot.value, std::numeric_limits<i64>::max());
+    vk.get_vma_allocator().invalidateAllocation(slot.allocation.get(), 0,
+                                                vk::WholeSize);
+
+    frame->format = format;
+    frame->width = width;
+    frame->height = height;
+    frame.get_buffer();
+    tp::ffmpeg::av_call(av_frame_copy_props(frame.get(), slot.frame.get()));
+    for (i32 i = 0; i < num_planes; ++i)
+      av_image_copy_plane(frame->data[i], frame->linesize[i],
+                          slot.data + plane_offsets[i], plane_linesizes[i],
+                          plane_linesizes[i], plane_heights[i]);
+    slot.frame.reset();
+    last_frame = tp::ffmpeg::Frame::create();
+    last_frame.ref_to(frame);
+    return frame;
+  }
+
+private:
+  struct Slot {
+    vma::UniqueBuffer buffer;
+    vma::UniqueAllocation allocation;
+    const u8 *data;
+    vk::raii::CommandBuffer cmd;
+    // semaphore value signalled once the copy is done
+    u64 value = 0;
+    // the frame being copied
+    tp::ffmpeg::Frame frame;
+  };
+
+  graphics::VkContext &vk;
+  tp::ffmpeg::PixelFormat format;
+  i32 width, height;
+  i32 num_planes;
+  std::vector<std::size_t> plane_offsets;
+  std::vector<int> plane_linesizes;
+  std::vector<i32> plane_heights;
+
+  u32 qf;
+  vk::raii::CommandPool pool = nullptr;
+  graphics::TimelineSemaphore sem;
+  u64 sem_value = 0;
+  std::vector<Slot> slots;
+  struct Pending {
+    // nullopt for duplicates of the previous frame
+    std::optional<i32> slot;
+    i64 pts = 0;
+  };
+
+  // frames that are submitted but not taken yet
+  std::deque<Pending> pending;
+  // slots with a copy in flight (or done but not taken yet)
+  std::size_t in_flight = 0;
+  i32 next_slot = 0;
+  // the last frame that was read back, for duplicates
+  tp::ffmpeg::Frame last_frame = nullptr;
+};
+} // namespace vkvideo::medias
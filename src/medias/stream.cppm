@@ -43,9 +43,15 @@ enum class HWAccel {
 
 class FFmpegStream;
 
+struct Keyframe {
+  i64 timestamp; // in stream time base, exact value for seeking
+  i64 time;      // in nanoseconds, might be a DTS value
+};
+
 class RawFFmpegStream {
 public:
-  RawFFmpegStream(std::string_view path, tp::ffmpeg::MediaType stream_type) {
+  RawFFmpegStream(std::string_view path, tp::ffmpeg::MediaType stream_type)
+      : path{path} {
     demuxer = tp::ffmpeg::InputFormatContext::open(path);
     demuxer.find_stream_info();
     tp::ffmpeg::av_call(stream_index = av_find_best_stream(
@@ -58,36 +64,85 @@ public:
   i32 height() const {
     return demuxer->streams[stream_index]->codecpar->height;
   }
+  // in nanoseconds, from the stream or the container (might not be accurate)
+  std::optional<i64> duration() const {
+    auto stream = demuxer->streams[stream_index];
+    if (stream->duration > 0)
+      return tp::ffmpeg::rescale_to_ns(stream->duration, stream->time_base);
+    if (demuxer->duration > 0)
+      return tp::ffmpeg::rescale_to_ns(demuxer->duration,
+                                       AVRational{1, AV_TIME_BASE});
+    return std::nullopt;
+  }
+
   // might not be accurate
   std::optional<i64> est_num_frames() const {
-    auto est_num_frames = demuxer->streams[stream_index]->nb_frames;
-    if (est_num_frames <= 0)
+    auto stream = demuxer->streams[stream_index];
+    if (stream->nb_frames > 0)
+      return stream->nb_frames;
+
+    // many containers do not store the frame count, so estimate it from the
+    // duration and the frame rate instead
+    auto frame_rate = stream->avg_frame_rate.num > 0 ? stream->avg_frame_rate
+                                                     : stream->r_frame_rate;
+    if (frame_rate.num <= 0 || frame_rate.den <= 0)
+      return std::nullopt;
+
+    auto duration_ns = duration();
+    if (!duration_ns.has_value())
       return std::nullopt;
-    return est_num_frames;
+
+    return av_rescale(*duration_ns, frame_rate.num,
+                      static_cast<i64>(frame_rate.den) * 1000000000) +
+           1;
   }
 
-  std::optional<std::size_t> est_vram_bytes() const {
+  // VRAM needed to keep every frame resident, by default as RGB(A) layers
+  // with at most 4 bytes per pixel (see resident_bytes_per_pixel)
+  std::optional<std::size_t>
+  est_vram_bytes(float bytes_per_pixel = 4.0f) const {
     auto num_frames = est_num_frames();
     if (!num_frames.has_value())
       return std::nullopt;
-    auto format = static_cast<tp::ffmpeg::PixelFormat>(
-        demuxer->streams[stream_index]->codecpar->format);
-    auto pixdesc = tp::ffmpeg::get_pix_fmt_desc(format);
-    auto bpp = av_get_padded_bits_per_pixel(pixdesc);
-    if (bpp <= 0)
-      return std::nullopt;
-    return static_cast<std::size_t>(bpp) * width() * height() *
-           num_frames.value();
+    return static_cast<std::size_t>(static_cast<double>(bytes_per_pixel) *
+                                    width() * height() * num_frames.value());
+  }
+
+  // keyframes known by the demuxer index, in decoding order
+  // for some containers (e.g. mkv without cues), the index is built lazily
+  // while demuxing, so this might be empty right after opening the file
+  std::vector<Keyframe> keyframes() const {
+    auto stream = demuxer->streams[stream_index];
+    std::vector<Keyframe> result;
+    auto num_entries = avformat_index_get_entries_count(stream);
+    for (int i = 0; i < num_entries; ++i) {
+      auto entry = avformat_index_get_entry(stream, i);
+      if (entry && (entry->flags & AVINDEX_KEYFRAME))
+        result.push_back(Keyframe{
+            .timestamp = entry->timestamp,
+            .time = tp::ffmpeg::rescale_to_ns(entry->timestamp,
+                                              stream->time_base),
+        });
+    }
+    return result;
   }
 
   tp::ffmpeg::InputFormatContext &get_demuxer() { return demuxer; }
+  const AVCodecParameters *get_codecpar() const {
+    return demuxer->streams[stream_index]->codecpar;
+  }
   i32 get_stream_index() const { return stream_index; }
   tp::ffmpeg::Codec get_codec() const { return codec; }
+  std::string_view get_path() const { return path; }
 
   void seek(i64 pos) {
     auto [p, q] = demuxer->streams[stream_index]->time_base;
-    tp::ffmpeg::av_call(av_seek_frame(demuxer.get(), stream_index,
-                                      pos * q / p / 1000000000,
+    seek_timestamp(pos * q / p / 1000000000);
+  }
+
+  // seek to the last keyframe at or before timestamp (in stream time base)
+  void seek_timestamp(i64 timestamp) {
+    tp::ffmpeg::av_call(av_seek_frame(demuxer.get(), stream_index, timestamp,
                                       AVSEEK_FLAG_BACKWARD));
     reach_eof_packet = false;
   }
@@ -117,6 +172,7 @@ public:
   }
 
 private:
+  std::string path;
   tp::ffmpeg::InputFormatContext demuxer;
   i32 stream_index;
   tp::ffmpeg::Codec codec;
@@ -125,16 +181,45 @@ private:
 
 class FFmpegStream : public Stream {
 public:
+  // called with the decoder of a destroyed stream, e.g. to reuse it
+  using DecoderRecycler = std::function<void(tp::ffmpeg::CodecContext)>;
+
   FFmpegStream(RawFFmpegStream raw, const tp::ffmpeg::BufferRef &hwaccel_ctx,
                HWAccel hwaccel = HWAccel::eAuto)
       : raw{std::move(raw)} {
-    decoder = tp::ffmpeg::CodecContext::create(raw.get_codec());
-    decoder.copy_params_from(this->raw.get_demuxer()
-                                 ->streams[this->raw.get_stream_index()]
-                                 ->codecpar);
+    decoder = open_decoder(this->raw, hwaccel_ctx, hwaccel);
+    current_packet = tp::ffmpeg::Packet::create();
+  }
+
+  // use a decoder opened by open_decoder, possibly for another stream with
+  // the same codec, profile, extent and pixel format (see DecoderPool). If
+  // the extradata differs, it is sent in-band with the first packet.
+  FFmpegStream(RawFFmpegStream raw, tp::ffmpeg::CodecContext decoder,
+               DecoderRecycler recycle = {})
+      : raw{std::move(raw)}, decoder{std::move(decoder)},
+        recycle{std::move(recycle)} {
+    this->decoder.flush_buffers();
+    auto params = this->raw.get_codecpar();
+    send_extradata = !std::ranges::equal(
+        std::span{this->decoder->extradata,
+                  static_cast<std::size_t>(this->decoder->extradata_size)},
+        std::span{params->extradata,
+                  static_cast<std::size_t>(params->extradata_size)});
+    current_packet = tp::ffmpeg::Packet::create();
+  }
+
+  ~FFmpegStream() {
+    if (recycle && decoder)
+      recycle(std::move(decoder));
+  }
+
+  static tp::ffmpeg::CodecContext
+  open_decoder(RawFFmpegStream &raw, const tp::ffmpeg::BufferRef &hwaccel_ctx,
+               HWAccel hwaccel = HWAccel::eAuto) {
+    auto decoder = tp::ffmpeg::CodecContext::create(raw.get_codec());
+    decoder.copy_params_from(raw.get_codecpar());
     if (hwaccel == HWAccel::eOn || hwaccel == HWAccel::eAuto) {
       decoder->hw_device_ctx = av_buffer_ref(hwaccel_ctx.get());
-      decoder->opaque = this;
       decoder->get_format = [](AVCodecContext *c,
                                const tp::ffmpeg::PixelFormat *formats) {
         for (auto p = formats; *p != tp::ffmpeg::PixelFormat::AV_PIX_FMT_NONE;
@@ -154,12 +239,9 @@ public:
     }
 
     decoder.open();
-
-    current_packet = tp::ffmpeg::Packet::create();
+    return decoder;
   }
 
-  ~FFmpegStream() = default;
-
   std::pair<tp::ffmpeg::Frame, bool>
   next_frame(tp::ffmpeg::Frame &&frame = {}) override {
     auto rescale_pts = [&](i64 &pts) {
@@ -183,6 +265,17 @@ public:
         return {std::move(frame), false};
       }
 
+      if (send_extradata && current_packet->data) {
+        auto params = raw.get_codecpar();
+        std::span<const u8> extradata{
+            params->extradata,
+            static_cast<std::size_t>(params->extradata_size)};
+        current_packet.add_side_data(AV_PKT_DATA_NEW_EXTRADATA, extradata);
+        // keep track of the parameters currently used by the decoder
+        decoder.set_extradata(extradata);
+        send_extradata = false;
+      }
+
       decoder.send_packet(current_packet);
     }
   }
@@ -193,6 +286,13 @@ public:
     return true;
   }
 
+  // exact seek to a keyframe, avoiding the precision loss of nanoseconds
+  bool seek_keyframe(const Keyframe &keyframe) {
+    decoder.flush_buffers();
+    raw.seek_timestamp(keyframe.timestamp);
+    return true;
+  }
+
   std::optional<i32> get_num_frames() override {
     i32 nb_frames = get_stream().nb_frames;
     if (nb_frames == 0)
@@ -213,62 +313,362 @@ private:
   RawFFmpegStream raw;
   tp::ffmpeg::CodecContext decoder;
   tp::ffmpeg::Packet current_packet;
+  DecoderRecycler recycle;
+  bool send_extradata = false;
 
   AVStream &get_stream() {
     return *raw.get_demuxer()->streams[raw.get_stream_index()];
   }
 };
 
+// decodes a whole video stream by splitting it into GOP-aligned segments
+// (taken from the demuxer index) and decoding those segments concurrently,
+// each worker using its own demuxer and software decoder.
+//
+// A segment starts at the first keyframe *output by the decoder* at or after
+// its index keyframe and ends right before the next segment starts. Since
+// decoders output frames in presentation order, this also collects the
+// leading frames of open GOPs and works when index timestamps are DTS values.
+// If the segment boundaries seen by different workers do not line up (e.g.
+// because of an incomplete index), nullopt is returned and the caller should
+// fall back to sequential decoding.
+std::optional<std::vector<std::vector<tp::ffmpeg::Frame>>>
+decode_segments_parallel(std::string_view path,
+                         std::span<const Keyframe> keyframes,
+                         i32 num_workers) {
+  if (keyframes.size() < 2 || num_workers < 2)
+    return std::nullopt;
+
+  // more segments than workers, so that uneven GOP sizes balance out
+  auto num_segments = std::min<std::size_t>(
+      keyframes.size(), static_cast<std::size_t>(num_workers) * 4);
+  num_workers = std::min<i32>(num_workers, static_cast<i32>(num_segments));
+
+  struct Segment {
+    const Keyframe *start;
+    const Keyframe *end; // nullptr for the last segment
+    std::vector<tp::ffmpeg::Frame> frames;
+    std::optional<i64> start_pts; // nullopt if no keyframe was decoded
+    std::optional<i64> end_pts;   // pts of the keyframe where decoding stopped
+  };
+
+  std::vector<Segment> segments(num_segments);
+  for (std::size_t i = 0; i < num_segments; ++i) {
+    segments[i].start = &keyframes[i * keyframes.size() / num_segments];
+    if (i + 1 < num_segments)
+      segments[i].end = &keyframes[(i + 1) * keyframes.size() / num_segments];
+    else
+      segments[i].end = nullptr;
+  }
+
+  auto decode_segment = [&](FFmpegStream &stream, std::size_t idx) {
+    auto &segment = segments[idx];
+    // the first segment mirrors what sequential decoding would do
+    if (idx == 0) {
+      stream.seek(0);
+      segment.start_pts = std::numeric_limits<i64>::min();
+    } else {
+      stream.seek_keyframe(*segment.start);
+    }
+
+    while (true) {
+      auto [frame, got_frame] = stream.next_frame();
+      if (!got_frame)
+        break;
+
+      bool key = frame->flags & AV_FRAME_FLAG_KEY;
+      if (!segment.start_pts.has_value()) {
+        // skip until the decoder outputs our starting keyframe (pts >= dts)
+        if (!key || frame->pts < segment.start->time)
+          continue;
+        segment.start_pts = frame->pts;
+      }
+
+      if (segment.end && key && frame->pts >= segment.end->time &&
+          frame->pts > *segment.start_pts) {
+        segment.end_pts = frame->pts;
+        break;
+      }
+
+      if (frame->pts >= *segment.start_pts)
+        segment.frames.push_back(std::move(frame));
+    }
+  };
+
+  std::atomic<std::size_t> next_segment{0};
+  parallel_for(
+      num_workers,
+      [&](std::size_t) {
+        FFmpegStream stream{
+            RawFFmpegStream{path, tp::ffmpeg::MediaType::Video},
+            tp::ffmpeg::BufferRef{nullptr}, HWAccel::eOff};
+        for (std::size_t idx; (idx = next_segment++) < num_segments;)
+          decode_segment(stream, idx);
+      },
+      num_workers);
+
+  std::vector<std::vector<tp::ffmpeg::Frame>> result;
+  result.reserve(num_segments);
+  for (std::size_t i = 0; i < num_segments; ++i) {
+    auto &segment = segments[i];
+    if (i + 1 < num_segments &&
+        (!segment.end_pts.has_value() ||
+         segment.end_pts != segments[i + 1].start_pts))
+      return std::nullopt;
+    result.push_back(std::move(segment.frames));
+  }
+
+  return result;
+}
+
 #ifdef VKVIDEO_HAVE_WEBP
+// animated WebP stream decoded with the libwebp demuxer
+// Frames are grouped into runs, each starting at a key frame (a frame that
+// does not depend on any previous frame), and long runs are split so that a
+// run never holds more than an eighth of budget_bytes of canvases. A split
+// run continues from the last canvas of the previous one. Runs are decoded
+// lazily on worker threads, a few runs ahead of playback, straight into
+// pooled refcounted canvas buffers. Seeking only needs to decode the runs
+// from the key frame before the target.
+// At most num_threads runs (0: one per core) are decoded ahead, and only as
+// many as their canvases fit in budget_bytes (but always the next one).
 class AnimWebPStream : public Stream {
 public:
-  AnimWebPStream(std::vector<char> data)
+  AnimWebPStream(std::vector<char> data, i32 num_threads = 0,
+                 std::size_t budget_bytes = std::size_t{64} << 20)
       : data{std::move(data)},
-        decoder{
+        demuxer{
             std::span<const u8>{reinterpret_cast<const u8 *>(this->data.data()),
-                                this->data.size()}} {}
+                                this->data.size()}},
+        canvas_pool{tp::ffmpeg::BufferPool::create(
+            static_cast<std::size_t>(demuxer.width()) * demuxer.height() * 4)},
+        lookahead{num_threads > 0
+                      ? num_threads
+                      : std::max<i32>(1, std::thread::hardware_concurrency())},
+        budget_bytes{budget_bytes} {
+    auto canvas_bytes =
+        static_cast<std::size_t>(demuxer.width()) * demuxer.height() * 4;
+    auto max_run_frames = static_cast<i32>(
+        std::max<std::size_t>(1, budget_bytes / 8 / canvas_bytes));
+    auto frames = demuxer.frames();
+    for (i32 i = 0; i < static_cast<i32>(frames.size()); ++i)
+      if (frames[i].key_frame || run_starts.empty() ||
+          i - run_starts.back() >= max_run_frames)
+        run_starts.push_back(i);
+  }
   ~AnimWebPStream() = default;
 
   std::pair<tp::ffmpeg::Frame, bool>
   next_frame(tp::ffmpeg::Frame &&frame = {}) override {
-    if (!decoder.has_more_frames()) {
-      // if we decoded all frame, we know for sure that the total duration
-      // is the last PTS value
-      if (duration.has_value())
-        assert(duration.value() == last_pts);
-      duration = last_pts;
+    if (next_index >= static_cast<i32>(demuxer.frames().size()))
       return {std::move(frame), false};
+
+    auto run = run_of(next_index);
+    if (run != current_run) {
+      current_frames = take_run(run);
+      current_run = run;
     }
+    // keep decoding ahead while this run is being consumed
+    schedule_runs(run + 1);
 
-    auto [data, pts] = decoder.get_next_frame();
     if (!frame)
       frame = tp::ffmpeg::Frame::create();
-
-    frame->width = decoder.width();
-    frame->height = decoder.height();
-    frame->duration = pts - last_pts;
-    frame->pts = std::exchange(last_pts, pts);
-    frame->format = tp::ffmpeg::PixelFormat::AV_PIX_FMT_RGBA;
-
-    frame.get_buffer();
-    std::copy(data.begin(), data.end(), frame->data[0]);
+    else
+      frame.unref();
+    frame.ref_to(current_frames[next_index - run_starts[run]]);
+    ++next_index;
     return {std::move(frame), true};
   }
 
   bool seek(i64 pos) override {
-    decoder.reset();
-    last_pts = 0;
+    auto frames = demuxer.frames();
+    auto it =
+        std::ranges::upper_bound(frames, pos, {}, &tp::webp::FrameInfo::pts);
+    next_index = std::max<i32>(0, static_cast<i32>(it - frames.begin()) - 1);
     return true;
   }
 
-  std::optional<i32> get_num_frames() override { return decoder.num_frames(); }
-  std::optional<i64> get_duration() override { return duration; }
+  std::optional<i32> get_num_frames() override {
+    return demuxer.frames().size();
+  }
+  std::optional<i64> get_duration() override {
+    return demuxer.total_duration();
+  }
 
 private:
   std::vector<char> data;
-  tp::webp::AnimDecoder decoder;
-  i64 last_pts = 0;
-  std::optional<i64> duration;
+  tp::webp::Demuxer demuxer;
+  tp::ffmpeg::BufferPool canvas_pool;
+  i32 lookahead;
+  std::size_t budget_bytes;
+  std::vector<i32> run_starts;
+
+  i32 next_index = 0;
+  i32 current_run = -1;
+  std::vector<tp::ffmpeg::Frame> current_frames;
+  // shared with the decoding of the next run, if it continues this one.
+  // Declared last, so that they are waited for before anything else is freed
+  std::map<i32, std::shared_future<std::vector<tp::ffmpeg::Frame>>>
+      pending_runs;
+
+  i32 run_of(i32 frame_idx) const {
+    return static_cast<i32>(std::ranges::upper_bound(run_starts, frame_idx) -
+                            run_starts.begin()) -
+           1;
+  }
+
+  i32 run_length(i32 run) const {
+    auto end = run + 1 < static_cast<i32>(run_starts.size())
+                   ? run_starts[run + 1]
+                   : static_cast<i32>(demuxer.frames().size());
+    return end - run_starts[run];
+  }
+
+  void schedule_runs(i32 first) {
+    auto last = std::min<i32>(first + lookahead, run_starts.size());
+    auto canvas_bytes = static_cast<std::size_t>(demuxer.width()) *
+                        demuxer.height() * 4;
+    std::size_t ahead_bytes = 0;
+    for (i32 run = first; run < last; ++run) {
+      // every frame of a run is a full canvas
+      ahead_bytes += canvas_bytes * run_length(run);
+      if (run > first && ahead_bytes > budget_bytes)
+        break;
+      if (run != current_run)
+        schedule_run(run);
+    }
+  }
+
+  static tp::ffmpeg::Frame new_ref(const tp::ffmpeg::Frame &frame) {
+    auto result = tp::ffmpeg::Frame::create();
+    result.ref_to(frame);
+    return result;
+  }
+
+  // also schedules the runs it continues from, if they are not decoded yet
+  std::shared_future<std::vector<tp::ffmpeg::Frame>> schedule_run(i32 run) {
+    if (auto it = pending_runs.find(run); it != pending_runs.end())
+      return it->second;
+
+    std::future<std::vector<tp::ffmpeg::Frame>> task;
+    if (demuxer.frames()[run_starts[run]].key_frame) {
+      task = std::async(std::launch::async,
+                        [this, run]() { return decode_run(run, nullptr); });
+    } else if (run - 1 == current_run) {
+      task = std::async(std::launch::async,
+                        [this, run, prev = new_ref(current_frames.back())]() {
+                          return decode_run(run, &prev);
+                        });
+    } else {
+      task = std::async(std::launch::async,
+                        [this, run, prev = schedule_run(run - 1)]() {
+                          return decode_run(run, &prev.get().back());
+                        });
+    }
+    return pending_runs.emplace(run, task.share()).first->second;
+  }
+
+  std::vector<tp::ffmpeg::Frame> take_run(i32 run) {
+    schedule_runs(run);
+    std::vector<tp::ffmpeg::Frame> frames;
+    // the next run might still read the last canvas, so the frames are
+    // referenced instead of moved out
+    for (const auto &frame : schedule_run(run).get())
+      frames.push_back(new_ref(frame));
+    pending_runs.erase(run);
+    // runs behind the current one are only needed again after seeking back
+    // (this might block on runs that are still being decoded)
+    std::erase_if(pending_runs,
+                  [&](const auto &entry) { return entry.first < run; });
+    return frames;
+  }
+
+  // same as libwebp's non-premultiplied blending: src is drawn over dst
+  static void blend_pixel(u8 *src, const u8 *dst) {
+    u32 src_a = src[3];
+    if (src_a == 0xff)
+      return;
+    if (src_a == 0) {
+      std::memcpy(src, dst, 4);
+      return;
+    }
+
+    u32 dst_factor_a = (dst[3] * (256 - src_a)) >> 8;
+    u32 blend_a = src_a + dst_factor_a;
+    u32 scale = (1u << 24) / blend_a;
+    for (i32 c = 0; c < 3; ++c)
+      src[c] = static_cast<u8>(
+          static_cast<u32>((src[c] * src_a + dst[c] * dst_factor_a) * scale) >>
+          24);
+    src[3] = static_cast<u8>(blend_a);
+  }
+
+  // prev is the last frame of the previous run, if this run does not start
+  // with a key frame
+  std::vector<tp::ffmpeg::Frame>
+  decode_run(i32 run, const tp::ffmpeg::Frame *prev_frame) {
+    auto infos = demuxer.frames();
+    i32 first = run_starts[run];
+    i32 last = first + run_length(run);
+    i32 width = demuxer.width(), height = demuxer.height();
+    std::size_t stride = static_cast<std::size_t>(width) * 4;
+    std::size_t canvas_size = stride * height;
+
+    std::vector<tp::ffmpeg::Frame> frames;
+    for (i32 i = first; i < last; ++i) {
+      const auto &info = infos[i];
+      auto frame = tp::ffmpeg::Frame::create();
+      frame->width = width;
+      frame->height = height;
+      frame->format = AV_PIX_FMT_RGBA;
+      frame->pts = info.pts;
+      frame->duration = info.duration;
+      frame->buf[0] = canvas_pool.get_buffer().release();
+      frame->data[0] = frame->buf[0]->data;
+      frame->linesize[0] = static_cast<int>(stride);
+
+      u8 *canvas = frame->data[0];
+      const auto *prev_canvas = i > first ? &frames.back() : prev_frame;
+      assert(info.key_frame || prev_canvas);
+      const u8 *prev = prev_canvas ? (*prev_canvas)->data[0] : nullptr;
+      const auto *prev_info = prev_canvas ? &infos[i - 1] : nullptr;
+      auto in_prev_rect = [&](i32 x, i32 y) {
+        return prev_info->dispose == tp::webp::DisposeMethod::eBackground &&
+               x >= prev_info->x_offset &&
+               x < prev_info->x_offset + prev_info->width &&
+               y >= prev_info->y_offset &&
+               y < prev_info->y_offset + prev_info->height;
+      };
+
+      if (info.key_frame) {
+        std::memset(canvas, 0, canvas_size);
+      } else {
+        // the previous frame is disposed after being displayed
+        std::memcpy(canvas, prev, canvas_size);
+        if (prev_info->dispose == tp::webp::DisposeMethod::eBackground)
+          for (i32 y = prev_info->y_offset;
+               y < prev_info->y_offset + prev_info->height; ++y)
+            std::memset(canvas + y * stride + prev_info->x_offset * 4, 0,
+                        static_cast<std::size_t>(prev_info->width) * 4);
+      }
+
+      tp::webp::decode_rgba(
+          info.bitstream,
+          canvas + info.y_offset * stride + info.x_offset * 4,
+          static_cast<i32>(stride), info.height);
+
+      if (!info.key_frame && info.blend == tp::webp::BlendMethod::eBlend)
+        for (i32 y = info.y_offset; y < info.y_offset + info.height; ++y)
+          for (i32 x = info.x_offset; x < info.x_offset + info.width; ++x)
+            if (!in_prev_rect(x, y))
+              blend_pixel(canvas + y * stride + x * 4,
+                          prev + y * stride + x * 4);
+
+      frames.push_back(std::move(frame));
+    }
+
+    return frames;
+  }
 };
 #endif
 
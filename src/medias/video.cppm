@@ -16,9 +16,11 @@ import vkvideo.third_party;
 import vkvideo.graphics;
 import :video_frame;
 import :stream;
+import :clip_cache;
+import :decoder_pool;
 
 namespace vkvideo::medias {
-inline bool is_webp_path(std::string_view path) {
+export inline bool is_webp_path(std::string_view path) {
   std::ifstream file(path.data(), std::ios::binary);
   if (!file) {
     return false;
@@ -91,8 +93,15 @@ public:
           auto backed_frame = tp::ffmpeg::Frame::create();
           backed_frame.ref_to(frame);
 
-          auto data =
-              std::make_shared<FFmpegVideoFrameData>(std::move(backed_frame));
+          // the frames of a context share their image owner
+          if (image_owner_ctx != hw_frames_ctx) {
+            image_owner_ctx = hw_frames_ctx;
+            image_owner =
+                FFmpegVideoFrameData::make_image_owner(frame->hw_frames_ctx);
+          }
+          // the frame data is recycled instead of allocated for every frame
+          auto data = std::allocate_shared<FFmpegVideoFrameData>(
+              frame_data_allocator, std::move(backed_frame), image_owner);
           return current_video_frame.emplace(data, hw_frames_ctx->sw_format);
         } else {
           return current_video_frame.emplace(upload_frames_to_gpu(
@@ -127,26 +136,48 @@ private:
   std::unique_ptr<Stream> stream;
   tp::ffmpeg::Frame frame;
   std::optional<VideoFrame> current_video_frame;
+  SharedPoolAllocator<FFmpegVideoFrameData> frame_data_allocator;
+  const AVHWFramesContext *image_owner_ctx = nullptr;
+  std::shared_ptr<const void> image_owner;
 };
 
 class VideoVRAM : public Video {
 public:
-  VideoVRAM(Stream &stream, graphics::VkContext &vk) {
-    stream.seek(0);
-    std::vector<tp::ffmpeg::Frame> frames;
-    while (true) {
-      auto [frame, got_frame] = stream.next_frame();
-      if (!got_frame)
-        break;
-      timestamps.push_back(frame->pts + frame->duration);
-      frames.push_back(std::move(frame));
-    }
-
-    auto gpu_frames = upload_frames_to_gpu(vk, frames);
-    frame_data = std::move(gpu_frames.data);
-    format = gpu_frames.frame_format;
+  // on_uploaded receives the timestamps and the converted layers, e.g. to
+  // store them in a ClipCache
+  using UploadCallback = std::function<void(
+      std::span<const i64>, const LayerLayout &, std::span<const u8>)>;
+
+  VideoVRAM(Stream &stream, graphics::VkContext &vk,
+            ResidentStorage storage = ResidentStorage::eRgb,
+            bool mipmaps = false, const UploadCallback &on_uploaded = {})
+      : VideoVRAM{decode_all(stream), vk, storage, mipmaps, on_uploaded} {}
+
+  // segments are consecutive runs of frames in presentation order, e.g.
+  // the output of decode_segments_parallel
+  VideoVRAM(std::vector<std::vector<tp::ffmpeg::Frame>> segments,
+            graphics::VkContext &vk,
+            ResidentStorage storage = ResidentStorage::eRgb,
+            bool mipmaps = false, const UploadCallback &on_uploaded = {}) {
+    for (const auto &segment : segments)
+      for (const auto &frame : segment)
+        timestamps.push_back(frame->pts + frame->duration);
+
+    std::vector<std::span<tp::ffmpeg::Frame>> segment_spans{segments.begin(),
+                                                            segments.end()};
+    LayerDataCallback on_layer_data;
+    if (on_uploaded)
+      on_layer_data = [&](const LayerLayout &layout, std::span<const u8> data) {
+        on_uploaded(timestamps, layout, data);
+      };
+    layers = upload_frame_segments_to_gpu(vk, segment_spans, storage, mipmaps,
+                                          on_layer_data);
   }
 
+  VideoVRAM(CachedClip clip)
+      : layers{std::move(clip.layers)},
+        timestamps{std::move(clip.timestamps)} {}
+
   ~VideoVRAM() = default;
 
   std::optional<VideoFrame> get_frame_monotonic(i64 time) override {
@@ -164,11 +195,7 @@ public:
       return std::nullopt;
 
     // output last_frame_idx-th frame
-    return VideoFrame{
-        .data = frame_data,
-        .frame_format = format,
-        .frame_index = last_frame_idx,
-    };
+    return layers.layer(last_frame_idx);
   }
 
   void seek(i64 time) override {
@@ -187,14 +214,95 @@ public:
   }
 
 private:
-  static constexpr u64 sem_value = 1;
-  std::shared_ptr<VideoFrameData> frame_data;
+  LayerImages layers;
+
+  static std::vector<std::vector<tp::ffmpeg::Frame>>
+  decode_all(Stream &stream) {
+    stream.seek(0);
+    std::vector<tp::ffmpeg::Frame> frames;
+    while (true) {
+      auto [frame, got_frame] = stream.next_frame();
+      if (!got_frame)
+        break;
+      frames.push_back(std::move(frame));
+    }
+
+    std::vector<std::vector<tp::ffmpeg::Frame>> segments;
+    segments.push_back(std::move(frames));
+    return segments;
+  }
 
   // i-th frame is shown from [timestamps[i-1], timestamps[i])
   // (wlog assuming timestamps[-1] = 0)
   std::vector<i64> timestamps;
   i32 last_frame_idx = 0;
-  tp::ffmpeg::PixelFormat format;
+};
+
+// a fully loaded clip that switches to streaming when the memory budget
+// needs its VRAM back. The budget only requests the switch, which is done by
+// the thread using the clip, on its next get_frame_monotonic or seek.
+class ResidentVideo : public Video {
+public:
+  ResidentVideo(std::unique_ptr<Video> resident, std::size_t bytes,
+                graphics::MemoryBudget &budget,
+                std::function<std::unique_ptr<Video>()> open_stream)
+      : video{std::move(resident)}, open_stream{std::move(open_stream)} {
+    residency = budget.track(bytes, [this]() {
+      demote_requested.store(true, std::memory_order_release);
+    });
+  }
+  ~ResidentVideo() = default;
+
+  std::optional<VideoFrame> get_frame_monotonic(i64 time) override {
+    Video::get_frame_monotonic(time);
+    last_time = time;
+    demote_if_requested();
+    residency.touch();
+    return video->get_frame_monotonic(time);
+  }
+
+  void seek(i64 time) override {
+    Video::seek(time);
+    last_time = time;
+    if (!demote_if_requested())
+      video->seek(time);
+  }
+
+  std::optional<i32> get_num_frames() override {
+    return video->get_num_frames();
+  }
+
+  std::optional<i64> get_duration() override { return video->get_duration(); }
+
+  bool is_resident() const { return resident; }
+
+private:
+  std::unique_ptr<Video> video;
+  std::function<std::unique_ptr<Video>()> open_stream;
+  i64 last_time = 0;
+  bool resident = true;
+  std::atomic<bool> demote_requested{false};
+  // declared last, so that demote is never called on a destroyed object
+  graphics::MemoryBudget::Residency residency;
+
+  // returns whether the clip switched to streaming (at last_time)
+  bool demote_if_requested() {
+    if (!demote_requested.exchange(false, std::memory_order_acquire))
+      return false;
+    try {
+      auto stream = open_stream();
+      stream->seek(last_time);
+      // frames still in use keep the old VRAM alive until they are dropped
+      video = std::move(stream);
+      resident = false;
+      return true;
+    } catch (std::exception &ex) {
+      // the budget does not track the clip anymore, it stays resident
+      std::println(std::cerr, "Unable to switch clip to streaming: {}",
+                   ex.what());
+      return false;
+    }
+  }
 };
 
 enum class DecoderType {
@@ -213,31 +321,126 @@ struct VideoArgs {
   DecoderType type = DecoderType::eAuto;
   medias::HWAccel hwaccel = medias::HWAccel::eAuto;
   DecodeMode mode = DecodeMode::eAuto;
+  // number of decoders used to preload clips in read-all mode, also the
+  // maximum number of animated WebP runs decoded ahead, which are further
+  // limited by the memory of their canvases (0: one per core)
+  i32 preload_threads = 0;
+  // directory of the ClipCache used for read-all clips (nullopt: no caching)
+  std::optional<std::filesystem::path> clip_cache_dir = std::nullopt;
+  // decoders of streamed FFmpeg videos are taken from (and returned to) this
+  // pool if set
+  DecoderPool *decoder_pool = nullptr;
+  // how read-all clips are stored in VRAM
+  ResidentStorage resident_storage = ResidentStorage::eAuto;
+  // generate mipmaps of read-all clips (if their storage allows it), for
+  // clips drawn heavily downscaled, e.g. by a Compositor
+  bool resident_mipmaps = false;
 };
 
 std::unique_ptr<Video> open_video(graphics::VkContext &vk,
                                   std::string_view path,
-                                  const VideoArgs &args = {}) {
+                                  const VideoArgs &args = {});
+
+namespace detail {
+// probed is the already opened stream of path, if any (FFmpeg decoder only)
+std::unique_ptr<Video>
+open_video_unchecked(graphics::VkContext &vk, std::string_view path,
+                     const VideoArgs &args,
+                     std::optional<medias::RawFFmpegStream> probed = {}) {
   DecoderType type = args.type;
   if (type == DecoderType::eAuto) {
     type = is_webp_path(path) ? DecoderType::eLibWebP : DecoderType::eFFmpeg;
   }
 
   DecodeMode mode = args.mode;
-  // 16 MiB
+  // clips are never read entirely above this size, as that would delay the
+  // first frame too much (16 MiB)
   constexpr static std::size_t READ_ALL_THRESHOLD = std::size_t{16} << 20;
 
+  // automatically chosen read-all clips are resident only as long as the
+  // memory budget allows it
+  auto &budget = vk.get_memory_budget();
+  // give memory back if it got scarce since the last clip was opened
+  budget.make_room(0);
+  std::optional<std::size_t> resident_bytes;
+  // a full mip chain takes a third of the first level
+  auto mip_factor = args.resident_mipmaps ? 4.0f / 3.0f : 1.0f;
+  auto choose_mode = [&](std::optional<std::size_t> est_bytes) {
+    if (!est_bytes.has_value() || *est_bytes > READ_ALL_THRESHOLD ||
+        !budget.make_room(*est_bytes))
+      return DecodeMode::eStream;
+    resident_bytes = est_bytes;
+    return DecodeMode::eReadAll;
+  };
+  auto make_resident =
+      [&](std::unique_ptr<Video> video) -> std::unique_ptr<Video> {
+    if (!resident_bytes.has_value())
+      return video;
+    return std::make_unique<ResidentVideo>(
+        std::move(video), *resident_bytes, budget,
+        [&vk, path = std::string{path}, args]() {
+          auto stream_args = args;
+          stream_args.mode = DecodeMode::eStream;
+          return open_video(vk, path, stream_args);
+        });
+  };
+
+  // read-all clips are looked up in the cache before the file is even
+  // probed (so no decoder is opened at all), and stored there after being
+  // uploaded
+  std::optional<ClipCache> clip_cache;
+  std::string cache_key;
+  auto load_cached = [&]() -> std::unique_ptr<Video> {
+    if (!args.clip_cache_dir || mode == DecodeMode::eStream)
+      return nullptr;
+    // files this large are streamed anyway, and not worth hashing
+    std::error_code ec;
+    auto file_size = std::filesystem::file_size(path, ec);
+    if (mode == DecodeMode::eAuto && (ec || file_size > READ_ALL_THRESHOLD))
+      return nullptr;
+
+    clip_cache.emplace(*args.clip_cache_dir);
+    cache_key = clip_cache->key_of(std::filesystem::path{path});
+    auto layout = clip_cache->find(vk, cache_key, args.resident_storage);
+    if (!layout.has_value())
+      return nullptr;
+    if (mode == DecodeMode::eAuto) {
+      // sized from the cached entry instead of the stream
+      mode = choose_mode(static_cast<std::size_t>(
+          resident_bytes_per_pixel(args.resident_storage, layout->src_format) *
+          mip_factor * layout->width * layout->height * layout->num_layers));
+      if (mode == DecodeMode::eStream)
+        return nullptr;
+    }
+    if (auto clip = clip_cache->load(vk, cache_key, args.resident_storage,
+                                     args.resident_mipmaps))
+      return make_resident(
+          std::make_unique<medias::VideoVRAM>(std::move(*clip)));
+    return nullptr;
+  };
+  VideoVRAM::UploadCallback store_cached = [&](std::span<const i64> timestamps,
+                                               const LayerLayout &layout,
+                                               std::span<const u8> layers) {
+    if (clip_cache)
+      clip_cache->store(cache_key, args.resident_storage, timestamps, layout,
+                        layers);
+  };
+  if (auto video = load_cached())
+    return video;
+
   std::unique_ptr<medias::Stream> stream;
   // TODO: respect the VKVIDEO_HAVE_WEBP flag
   switch (type) {
   case DecoderType::eFFmpeg: {
-    medias::RawFFmpegStream raw_ffmpeg_stream{path,
-                                              tp::ffmpeg::MediaType::Video};
+    auto raw_ffmpeg_stream =
+        probed ? std::move(*probed)
+               : medias::RawFFmpegStream{path, tp::ffmpeg::MediaType::Video};
     if (mode == DecodeMode::eAuto) {
-      mode = raw_ffmpeg_stream.est_vram_bytes().value_or(
-                 std::numeric_limits<std::size_t>::max()) <= READ_ALL_THRESHOLD
-                 ? DecodeMode::eReadAll
-                 : DecodeMode::eStream;
+      auto src_format = static_cast<tp::ffmpeg::PixelFormat>(
+          raw_ffmpeg_stream.get_codecpar()->format);
+      mode = choose_mode(raw_ffmpeg_stream.est_vram_bytes(
+          resident_bytes_per_pixel(args.resident_storage, src_format) *
+          mip_factor));
     }
 
     auto hwaccel = args.hwaccel;
@@ -247,13 +450,27 @@ std::unique_ptr<Video> open_video(graphics::VkContext &vk,
             std::cerr,
             "Hardware-acceleration is not supported for read-all decode mode");
       hwaccel = medias::HWAccel::eOff;
+
+      auto num_threads =
+          args.preload_threads > 0
+              ? args.preload_threads
+              : static_cast<i32>(std::thread::hardware_concurrency());
+      if (auto segments = medias::decode_segments_parallel(
+              path, raw_ffmpeg_stream.keyframes(), num_threads))
+        return make_resident(std::make_unique<medias::VideoVRAM>(
+            std::move(*segments), vk, args.resident_storage,
+            args.resident_mipmaps, store_cached));
     } else {
       if (hwaccel == medias::HWAccel::eAuto)
         hwaccel = medias::HWAccel::eOn;
     }
 
-    stream = std::make_unique<medias::FFmpegStream>(
-        std::move(raw_ffmpeg_stream), vk.get_hwaccel_ctx(), hwaccel);
+    if (args.decoder_pool && mode == DecodeMode::eStream)
+      stream = args.decoder_pool->open(std::move(raw_ffmpeg_stream),
+                                       vk.get_hwaccel_ctx(), hwaccel);
+    else
+      stream = std::make_unique<medias::FFmpegStream>(
+          std::move(raw_ffmpeg_stream), vk.get_hwaccel_ctx(), hwaccel);
     break;
   }
   case DecoderType::eLibWebP: {
@@ -266,10 +483,10 @@ std::unique_ptr<Video> open_video(graphics::VkContext &vk,
           reinterpret_cast<const u8 *>(webp_data.data()),
           reinterpret_cast<const u8 *>(webp_data.data() + webp_data.size())}};
       // currently we are not handling anything special with non-RGBA formats
-      auto est_bytes = static_cast<std::size_t>(demuxer.num_frames()) *
-                       demuxer.width() * demuxer.height() * 4;
-      mode = est_bytes <= READ_ALL_THRESHOLD ? DecodeMode::eReadAll
-                                             : DecodeMode::eStream;
+      mode = choose_mode(static_cast<std::size_t>(
+          resident_bytes_per_pixel(args.resident_storage, AV_PIX_FMT_RGBA) *
+          mip_factor * demuxer.num_frames() * demuxer.width() *
+          demuxer.height()));
     }
 
     if (args.hwaccel == medias::HWAccel::eOn) {
@@ -278,7 +495,8 @@ std::unique_ptr<Video> open_video(graphics::VkContext &vk,
           "Hardware acceleration is not supported for libwebp decoder");
     }
 
-    stream = std::make_unique<medias::AnimWebPStream>(std::move(webp_data));
+    stream = std::make_unique<medias::AnimWebPStream>(std::move(webp_data),
+                                                      args.preload_threads);
     break;
   }
   default:
@@ -289,11 +507,59 @@ std::unique_ptr<Video> open_video(graphics::VkContext &vk,
   case DecodeMode::eStream:
     return std::make_unique<medias::VideoStream>(std::move(stream), vk);
   case DecodeMode::eReadAll:
-    return std::make_unique<medias::VideoVRAM>(*stream, vk);
+    return make_resident(std::make_unique<medias::VideoVRAM>(
+        *stream, vk, args.resident_storage, args.resident_mipmaps,
+        store_cached));
   default:;
   }
 
   throw std::runtime_error{"Invalid decode mode"};
 }
+} // namespace detail
+
+namespace detail {
+// open() (which opens the video with args) with a fallback to streaming if
+// the automatically chosen mode ran out of VRAM
+template <class F>
+std::unique_ptr<Video> open_video_or_stream(graphics::VkContext &vk,
+                                            std::string_view path,
+                                            const VideoArgs &args, F &&open) {
+  try {
+    return open();
+  } catch (vk::OutOfDeviceMemoryError &) {
+    if (args.mode != DecodeMode::eAuto)
+      throw;
+    // the estimates were off (or the budget is not exact), stream instead of
+    // failing
+    std::println(std::cerr, "Out of VRAM while loading {}, streaming instead",
+                 path);
+    vk.get_memory_budget().make_room(0);
+    auto stream_args = args;
+    stream_args.mode = DecodeMode::eStream;
+    return detail::open_video_unchecked(vk, path, stream_args);
+  }
+}
+} // namespace detail
+
+std::unique_ptr<Video> open_video(graphics::VkContext &vk,
+                                  std::string_view path,
+                                  const VideoArgs &args) {
+  return detail::open_video_or_stream(
+      vk, path, args,
+      [&]() { return detail::open_video_unchecked(vk, path, args); });
+}
+
+// same as above, for a video already probed by the caller (e.g. on another
+// thread while the VkContext was created)
+std::unique_ptr<Video> open_video(graphics::VkContext &vk,
+                                  medias::RawFFmpegStream probed,
+                                  const VideoArgs &args = {}) {
+  // the probed stream is moved into the video, the fallback probes again
+  std::string path{probed.get_path()};
+  return detail::open_video_or_stream(
+      vk, path, args, [&]() {
+        return detail::open_video_unchecked(vk, path, args, std::move(probed));
+      });
+}
 
 } // namespace vkvideo::medias
@@ -3,6 +3,8 @@ module;
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavutil/hwcontext_vulkan.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
 }
 #include <execinfo.h>
 
@@ -16,6 +18,7 @@ import vk_mem_alloc_hpp;
 import vkvideo.core;
 import vkvideo.third_party;
 import vkvideo.graphics;
+import :bcenc;
 
 export namespace vkvideo::medias {
 
@@ -66,6 +69,7 @@ public:
   virtual u64 get_semaphore_value() const = 0;
   virtual u32 get_queue_family_idx() const = 0;
   virtual i32 get_num_layers() const = 0;
+  virtual i32 get_num_levels() const { return 1; }
 
   virtual void set_image_layout(vk::ImageLayout layout) = 0;
   virtual void set_stage_flag(vk::PipelineStageFlags2 stage_flag) = 0;
@@ -93,7 +97,7 @@ public:
   vk::ImageSubresourceRange get_subresource_range() const {
     return {
         .aspectMask = vk::ImageAspectFlagBits::eColor,
-        .levelCount = 1,
+        .levelCount = static_cast<u32>(get_num_levels()),
         .layerCount = static_cast<u32>(get_num_layers()),
     };
   }
@@ -159,11 +163,16 @@ public:
   }
 };
 
+// planes of one frame, one per image at most
+inline constexpr std::size_t max_video_frame_planes = AV_NUM_DATA_POINTERS;
+using VideoFramePlanes =
+    InplaceVector<VideoFramePlane *, max_video_frame_planes>;
+
 class LockedVideoFrameData {
 public:
   virtual ~LockedVideoFrameData() = default;
 
-  virtual std::vector<VideoFramePlane *> get_planes() = 0;
+  virtual VideoFramePlanes get_planes() = 0;
 
   virtual std::pair<i32, i32> get_extent() const = 0;
 
@@ -253,11 +262,20 @@ public:
   }
 };
 
-class VideoFrameData {
+class VideoFrameData : public std::enable_shared_from_this<VideoFrameData> {
 public:
   virtual ~VideoFrameData() = default;
 
-  virtual std::unique_ptr<LockedVideoFrameData> lock() = 0;
+  // the lock is created in the arena if given (and must be destroyed before
+  // it is reset), instead of on the heap
+  virtual ArenaPtr<LockedVideoFrameData> lock(FrameArena *arena = nullptr) = 0;
+
+  // keeps the images of the frame alive (so their handles can not be reused
+  // by other images), e.g. while views of them are cached. By default, the
+  // frame data owns its images (and must be owned by a shared_ptr).
+  virtual std::shared_ptr<const void> get_image_owner() {
+    return shared_from_this();
+  }
 };
 
 struct VideoFrame {
@@ -277,6 +295,7 @@ struct StructVideoFramePlaneData {
   u64 semaphore_value;
   u32 queue_family_idx;
   i32 num_layers;
+  i32 num_levels = 1;
 };
 
 class StructVideoFramePlane : public VideoFramePlane {
@@ -295,6 +314,7 @@ public:
   u64 get_semaphore_value() const override { return data.semaphore_value; }
   u32 get_queue_family_idx() const override { return data.queue_family_idx; }
   i32 get_num_layers() const override { return data.num_layers; }
+  i32 get_num_levels() const override { return data.num_levels; }
 
   void set_image_layout(vk::ImageLayout value) override { data.layout = value; }
   void set_stage_flag(vk::PipelineStageFlags2 value) override {
@@ -314,11 +334,11 @@ public:
                              std::pair<i32, i32> extent, std::mutex &mutex)
       : planes{data}, extent{extent}, lock{mutex} {}
 
-  std::vector<VideoFramePlane *> get_planes() override {
-    return planes |
-           std::ranges::views::transform(
-               [](auto &plane) -> VideoFramePlane * { return &plane; }) |
-           std::ranges::to<std::vector>();
+  VideoFramePlanes get_planes() override {
+    VideoFramePlanes result;
+    for (auto &plane : planes)
+      result.push_back(&plane);
+    return result;
   }
 
   std::pair<i32, i32> get_extent() const override { return extent; }
@@ -339,8 +359,9 @@ public:
                std::ranges::to<std::vector>()},
         extent{extent}, backing_data{std::move(backing_data)} {}
 
-  std::unique_ptr<LockedVideoFrameData> lock() override {
-    return std::make_unique<StructLockedVideoFrameData>(planes, extent, mutex);
+  ArenaPtr<LockedVideoFrameData> lock(FrameArena *arena = nullptr) override {
+    return make_arena_ptr<StructLockedVideoFrameData>(arena, planes, extent,
+                                                      mutex);
   }
 
 private:
@@ -423,14 +444,15 @@ public:
       : frame{frame}, lock{lock} {
     auto &vk_frame = *reinterpret_cast<AVVkFrame *>(frame->data[0]);
     for (i32 i = 0; i < std::size(vk_frame.img) && vk_frame.img[i]; ++i) {
-      planes.push_back(std::make_unique<FFmpegVideoFramePlane>(frame, i));
+      planes.emplace_back(frame, i);
     }
   }
 
-  std::vector<VideoFramePlane *> get_planes() override {
-    return planes |
-           std::ranges::views::transform([](auto &ptr) { return ptr.get(); }) |
-           std::ranges::to<std::vector>();
+  VideoFramePlanes get_planes() override {
+    VideoFramePlanes result;
+    for (auto &plane : planes)
+      result.push_back(&plane);
+    return result;
   }
 
   std::pair<i32, i32> get_extent() const override {
@@ -446,19 +468,36 @@ public:
 private:
   tp::ffmpeg::Frame &frame;
   std::scoped_lock<AVVkFrameLock> lock;
-  std::vector<std::unique_ptr<VideoFramePlane>> planes;
+  InplaceVector<FFmpegVideoFramePlane, max_video_frame_planes> planes;
 };
 
 class FFmpegVideoFrameData : public VideoFrameData {
 public:
-  FFmpegVideoFrameData(tp::ffmpeg::Frame frame)
+  // image_owner keeps the frames context of the frame alive (see
+  // get_image_owner), it can be shared by every frame of the context
+  FFmpegVideoFrameData(tp::ffmpeg::Frame frame,
+                       std::shared_ptr<const void> image_owner = nullptr)
       : frame{std::move(frame)},
         frame_lock{
             tp::ffmpeg::BufferRef{av_buffer_ref(this->frame->hw_frames_ctx)},
-            *reinterpret_cast<AVVkFrame *>(this->frame->data[0])} {}
+            *reinterpret_cast<AVVkFrame *>(this->frame->data[0])},
+        image_owner{std::move(image_owner)} {}
+
+  ArenaPtr<LockedVideoFrameData> lock(FrameArena *arena = nullptr) override {
+    return make_arena_ptr<FFmpegLockedVideoFrameData>(arena, frame,
+                                                      frame_lock);
+  }
+
+  // the images are recycled by the pool of the frames context, which only
+  // frees them once it is destroyed
+  std::shared_ptr<const void> get_image_owner() override {
+    if (!image_owner)
+      image_owner = make_image_owner(frame->hw_frames_ctx);
+    return image_owner;
+  }
 
-  std::unique_ptr<LockedVideoFrameData> lock() override {
-    return std::make_unique<FFmpegLockedVideoFrameData>(frame, frame_lock);
+  static std::shared_ptr<const void> make_image_owner(AVBufferRef *ctx) {
+    return std::make_shared<tp::ffmpeg::BufferRef>(av_buffer_ref(ctx));
   }
 
   tp::ffmpeg::Frame &get() { return frame; }
@@ -466,22 +505,161 @@ public:
 private:
   tp::ffmpeg::Frame frame;
   AVVkFrameLock frame_lock;
+  std::shared_ptr<const void> image_owner;
 };
 
-VideoFrame upload_frames_to_gpu(graphics::VkContext &vk,
-                                std::span<tp::ffmpeg::Frame> frames) {
-  assert(!frames.empty());
+// how the frames of resident (read-all) clips are stored in VRAM
+enum class ResidentStorage {
+  eAuto = 0,   // eYuv420 for 4:2:0 sources (no further loss), eRgb otherwise
+  eRgb,        // RGB(A) layers, 3-4 bytes per pixel
+  eYuv420,     // NV12 layers, 1.5 bytes per pixel, sampled through the YCbCr
+               // conversion of VideoPipeline (opaque frames only)
+  eCompressed, // BC1 (0.5 bytes per pixel), or BC3 (1 byte per pixel) for
+               // frames with alpha, encoded by a compute pass when uploading
+};
+
+struct LayerFormat {
+  // format of the layers in host memory
+  tp::ffmpeg::PixelFormat pix_fmt;
+  // format of the images, block-compressed formats are encoded from RGBA
+  // layers when uploading
+  vk::Format vk_format;
+  // maximum number of layers of one array image
+  u32 max_layers;
+
+  bool is_compressed() const {
+    return vk_format == vk::Format::eBc1RgbUnormBlock ||
+           vk_format == vk::Format::eBc3UnormBlock;
+  }
+};
+
+// memory layout of the layers uploaded by upload_frame_segments_to_gpu: the
+// planes of a layer are tightly packed one after another, and layers are
+// layer_size bytes apart
+struct LayerLayout {
+  i32 width, height;
+  // format of the decoded frames, before conversion
+  tp::ffmpeg::PixelFormat src_format;
+  LayerFormat format;
+  i32 num_layers;
+  std::size_t layer_size;
+};
+
+// called with the converted layer data right before it is uploaded
+using LayerDataCallback =
+    std::function<void(const LayerLayout &, std::span<const u8>)>;
+
+// array images holding consecutive runs of layers, as one image can only
+// hold LayerFormat::max_layers of them
+struct LayerImages {
+  std::vector<VideoFrame> images;
+  i32 layers_per_image = 1;
+
+  VideoFrame layer(i32 index) const {
+    auto frame = images[index / layers_per_image];
+    frame.frame_index = index % layers_per_image;
+    return frame;
+  }
+};
+
+bool has_alpha_channel(tp::ffmpeg::PixelFormat format) {
+  auto desc = tp::ffmpeg::get_pix_fmt_desc(format);
+  return desc &&
+         desc->flags &
+             static_cast<int>(tp::ffmpeg::PixelFormatFlagBits::eHasAlpha);
+}
 
-  i32 width = frames.front()->width;
-  i32 height = frames.front()->height;
-  bool has_alpha =
-      tp::ffmpeg::get_pix_fmt_desc(
-          static_cast<tp::ffmpeg::PixelFormat>(frames.front()->format))
-          ->flags &
-      static_cast<int>(tp::ffmpeg::PixelFormatFlagBits::eHasAlpha);
+ResidentStorage resolve_storage(ResidentStorage storage,
+                                tp::ffmpeg::PixelFormat src_format) {
+  if (storage != ResidentStorage::eAuto)
+    return storage;
+
+  // (the format of the stream might not be known yet)
+  auto desc = tp::ffmpeg::get_pix_fmt_desc(src_format);
+  if (!desc)
+    return ResidentStorage::eRgb;
+  auto rgb_flag = static_cast<int>(tp::ffmpeg::PixelFormatFlagBits::eRgb);
+  bool is_yuv420 = !(desc->flags & rgb_flag) && desc->nb_components >= 3 &&
+                   desc->log2_chroma_w == 1 && desc->log2_chroma_h == 1;
+  return is_yuv420 && !has_alpha_channel(src_format) ? ResidentStorage::eYuv420
+                                                     : ResidentStorage::eRgb;
+}
+
+// VRAM used per pixel by the given storage, assuming the device supports it
+// (an upper bound for RGB layers)
+float resident_bytes_per_pixel(ResidentStorage storage,
+                               tp::ffmpeg::PixelFormat src_format) {
+  bool has_alpha = has_alpha_channel(src_format);
+  switch (resolve_storage(storage, src_format)) {
+  case ResidentStorage::eYuv420:
+    return has_alpha ? 4.0f : 1.5f;
+  case ResidentStorage::eCompressed:
+    return has_alpha ? 1.0f : 0.5f;
+  default:
+    return 4.0f;
+  }
+}
+
+// pick the format used to store frames of the given size as array layers
+LayerFormat
+select_layer_format(graphics::VkContext &vk, i32 width, i32 height,
+                    tp::ffmpeg::PixelFormat src_format,
+                    ResidentStorage storage = ResidentStorage::eRgb) {
+  bool has_alpha = has_alpha_channel(src_format);
+  auto &physical_device = vk.get_physical_device();
+
+  // maximum number of layers of an image of this format, nullopt if the
+  // format is not usable
+  auto max_layers =
+      [&](vk::Format format,
+          vk::FormatFeatureFlags extra_features = {}) -> std::optional<u32> {
+    try {
+      auto fmt = physical_device.getFormatProperties(format);
+      auto flag = vk::FormatFeatureFlagBits::eTransferDst |
+                  vk::FormatFeatureFlagBits::eTransferSrc |
+                  vk::FormatFeatureFlagBits::eSampledImage | extra_features;
+      if ((fmt.optimalTilingFeatures & flag) != flag) {
+        return std::nullopt;
+      }
+      auto props = physical_device.getImageFormatProperties(
+          format, vk::ImageType::e2D, vk::ImageTiling::eOptimal,
+          vk::ImageUsageFlagBits::eTransferDst |
+              vk::ImageUsageFlagBits::eTransferSrc |
+              vk::ImageUsageFlagBits::eSampled);
+      if (props.maxExtent.width < width || props.maxExtent.height < height ||
+          props.maxArrayLayers == 0)
+        return std::nullopt;
+      return props.maxArrayLayers;
+    } catch (vk::FormatNotSupportedError &ex) {
+      return std::nullopt;
+    }
+  };
+
+  switch (resolve_storage(storage, src_format)) {
+  case ResidentStorage::eYuv420:
+    // 4:2:0 images must have even extents, and the sampler of VideoPipeline
+    // uses midpoint chroma samples with linear filtering
+    if (!has_alpha && width % 2 == 0 && height % 2 == 0) {
+      auto format = vk::Format::eG8B8R82Plane420Unorm;
+      auto features =
+          vk::FormatFeatureFlagBits::eMidpointChromaSamples |
+          vk::FormatFeatureFlagBits::eSampledImageYcbcrConversionLinearFilter;
+      if (auto layers = max_layers(format, features))
+        return LayerFormat{AV_PIX_FMT_NV12, format, *layers};
+    }
+    break;
+  case ResidentStorage::eCompressed: {
+    auto format = has_alpha ? vk::Format::eBc3UnormBlock
+                            : vk::Format::eBc1RgbUnormBlock;
+    if (auto layers = max_layers(format))
+      return LayerFormat{AV_PIX_FMT_RGBA, format, *layers};
+    break;
+  }
+  default:;
+  }
 
-  // for convenience, we will only use RGB formats,
-  // as YUV blitting is explicitly disallowed in Vulkan spec
+  // RGB formats, also used for streamed frames (as YUV blitting is explicitly
+  // disallowed in Vulkan spec) and as the fallback of the other storages
 
   std::map<tp::ffmpeg::PixelFormat, std::vector<vk::Format>> supported_formats{
       {AV_PIX_FMT_GRAY8, {vk::Format::eR8Unorm}},
@@ -489,28 +667,13 @@ VideoFrame upload_frames_to_gpu(graphics::VkContext &vk,
       {AV_PIX_FMT_RGB24, {vk::Format::eR8G8B8Unorm}},
       {AV_PIX_FMT_RGBA, {vk::Format::eR8G8B8A8Unorm}},
   };
+  std::map<vk::Format, u32> format_max_layers;
   for (auto &[pix_fmt, vk_formats] : supported_formats) {
     std::erase_if(vk_formats, [&](vk::Format format) {
-      try {
-        auto &physical_device = vk.get_physical_device();
-        auto fmt = physical_device.getFormatProperties(format);
-        auto flag = vk::FormatFeatureFlagBits::eTransferDst |
-                    vk::FormatFeatureFlagBits::eTransferSrc |
-                    vk::FormatFeatureFlagBits::eSampledImage;
-        if ((fmt.optimalTilingFeatures & flag) != flag) {
-          return true;
-        }
-        auto props = physical_device.getImageFormatProperties(
-            format, vk::ImageType::e2D, vk::ImageTiling::eOptimal,
-            vk::ImageUsageFlagBits::eTransferDst |
-                vk::ImageUsageFlagBits::eTransferSrc |
-                vk::ImageUsageFlagBits::eSampled);
-        return props.maxExtent.width < width ||
-               props.maxExtent.height < height ||
-               props.maxArrayLayers < frames.size();
-      } catch (vk::FormatNotSupportedError &ex) {
-        return true;
-      }
+      auto layers = max_layers(format);
+      if (layers.has_value())
+        format_max_layers[format] = *layers;
+      return !layers.has_value();
     });
   };
 
@@ -522,136 +685,438 @@ VideoFrame upload_frames_to_gpu(graphics::VkContext &vk,
   }
   formats.push_back(AV_PIX_FMT_NONE);
 
-  auto format = avcodec_find_best_pix_fmt_of_list(
-      formats.data(), static_cast<AVPixelFormat>(frames.front()->format),
-      has_alpha, nullptr);
+  auto format = avcodec_find_best_pix_fmt_of_list(formats.data(), src_format,
+                                                  has_alpha, nullptr);
   if (format == AV_PIX_FMT_NONE) {
     throw std::runtime_error{"No supported format"};
   }
 
-  std::vector<tp::ffmpeg::Frame> rescaled_frames;
-  tp::ffmpeg::VideoRescaler rescaler{};
-  for (const auto &frame : frames) {
-    auto rescaled_frame = tp::ffmpeg::Frame::create();
-    rescaled_frame->width = width;
-    rescaled_frame->height = height;
-    rescaled_frame->format = format;
-
-    rescaler.auto_rescale(rescaled_frame, frame);
-    rescaled_frames.push_back(std::move(rescaled_frame));
-  }
-
-  auto linesize =
-      static_cast<std::size_t>(rescaled_frames.front()->linesize[0]);
-  auto num_comps = tp::ffmpeg::get_pix_fmt_desc(format)->nb_components;
-
-  // creating vulkan image...
-  auto &device = vk.get_device();
-
-  auto [uniq_image, uniq_image_allocation] =
-      vk.get_vma_allocator().createImageUnique(
-          {
-              .imageType = vk::ImageType::e2D,
-              .format = supported_formats[format].front(),
-              .extent = vk::Extent3D{static_cast<u32>(width),
-                                     static_cast<u32>(height), 1},
-              .mipLevels = 1,
-              .arrayLayers = static_cast<u32>(rescaled_frames.size()),
-              .samples = vk::SampleCountFlagBits::e1,
-              .tiling = vk::ImageTiling::eOptimal,
-              .usage = vk::ImageUsageFlagBits::eSampled |
-                       vk::ImageUsageFlagBits::eTransferSrc |
-                       vk::ImageUsageFlagBits::eTransferDst,
-              .sharingMode = vk::SharingMode::eExclusive,
-              .initialLayout = vk::ImageLayout::eUndefined,
-          },
-          {
-              .requiredFlags = vk::MemoryPropertyFlagBits::eDeviceLocal,
-          });
-  auto image = vk::raii::Image{vk.get_device(), uniq_image.release()};
-  auto image_allocation = std::move(uniq_image_allocation);
-  i32 frame_size = linesize * height;
-  auto [buffer, buffer_alloc] = vk.get_vma_allocator().createBufferUnique(
+  auto vk_format = supported_formats[format].front();
+  return LayerFormat{format, vk_format, format_max_layers[vk_format]};
+}
+
+// bytes per row and number of rows of a plane of a tightly packed layer
+std::pair<std::size_t, i32> layer_plane_size(tp::ffmpeg::PixelFormat format,
+                                             i32 width, i32 height,
+                                             i32 plane) {
+  auto desc = tp::ffmpeg::get_pix_fmt_desc(format);
+  auto row_bytes = av_image_get_linesize(format, width, plane);
+  auto rows = plane == 1 || plane == 2
+                  ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h)
+                  : height;
+  return {static_cast<std::size_t>(row_bytes), rows};
+}
+
+LayerLayout make_layer_layout(i32 width, i32 height,
+                              tp::ffmpeg::PixelFormat src_format,
+                              LayerFormat format, i32 num_layers) {
+  std::size_t size = 0;
+  for (i32 i = 0; i < av_pix_fmt_count_planes(format.pix_fmt); ++i) {
+    auto [row_bytes, rows] = layer_plane_size(format.pix_fmt, width, height, i);
+    size += row_bytes * rows;
+  }
+
+  // layers start at multiples of the texel size and of 4 (for buffer-image
+  // copies on transfer queues), and of 256 (the largest storage buffer
+  // offset alignment, for compressed layers)
+  auto texel_size = layer_plane_size(format.pix_fmt, 1, 1, 0).first;
+  auto alignment = std::lcm(std::size_t{256}, texel_size);
+  return LayerLayout{
+      .width = width,
+      .height = height,
+      .src_format = src_format,
+      .format = format,
+      .num_layers = num_layers,
+      .layer_size = (size + alignment - 1) / alignment * alignment,
+  };
+}
+
+// copy the planes of a frame in format pix_fmt into a tightly packed layer
+void copy_to_layer(u8 *dst, const tp::ffmpeg::Frame &frame,
+                   tp::ffmpeg::PixelFormat pix_fmt) {
+  for (i32 i = 0; i < av_pix_fmt_count_planes(pix_fmt); ++i) {
+    auto [row_bytes, rows] =
+        layer_plane_size(pix_fmt, frame->width, frame->height, i);
+    av_image_copy_plane(dst, static_cast<int>(row_bytes), frame->data[i],
+                        frame->linesize[i], static_cast<int>(row_bytes), rows);
+    dst += row_bytes * rows;
+  }
+}
+
+// fill every level but the first of an image in eTransferDstOptimal with
+// successive linear blits, the whole image is left in eTransferDstOptimal
+void generate_mipmaps(vk::raii::CommandBuffer &cmd_buf, vk::Image image,
+                      i32 width, i32 height, u32 num_layers, u32 num_levels) {
+  auto barrier = [&](u32 first_level, u32 level_count,
+                     vk::ImageLayout old_layout, vk::ImageLayout new_layout) {
+    vk::ImageMemoryBarrier2 barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eTransfer,
+        .srcAccessMask = vk::AccessFlagBits2::eTransferWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2::eTransfer,
+        .dstAccessMask = vk::AccessFlagBits2::eTransferRead |
+                         vk::AccessFlagBits2::eTransferWrite,
+        .oldLayout = old_layout,
+        .newLayout = new_layout,
+        .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
+        .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
+        .image = image,
+        .subresourceRange = {
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .baseMipLevel = first_level,
+            .levelCount = level_count,
+            .layerCount = num_layers,
+        }};
+    cmd_buf.pipelineBarrier2(
+        vk::DependencyInfo{}.setImageMemoryBarriers(barrier));
+  };
+
+  for (u32 level = 1; level < num_levels; ++level) {
+    barrier(level - 1, 1, vk::ImageLayout::eTransferDstOptimal,
+            vk::ImageLayout::eTransferSrcOptimal);
+    vk::ImageBlit2 region{
+        .srcSubresource =
+            {
+                .aspectMask = vk::ImageAspectFlagBits::eColor,
+                .mipLevel = level - 1,
+                .layerCount = num_layers,
+            },
+        .srcOffsets = std::array<vk::Offset3D, 2>{{
+            {0, 0, 0},
+            {std::max(1, width >> (level - 1)),
+             std::max(1, height >> (level - 1)), 1},
+        }},
+        .dstSubresource =
+            {
+                .aspectMask = vk::ImageAspectFlagBits::eColor,
+                .mipLevel = level,
+                .layerCount = num_layers,
+            },
+        .dstOffsets = std::array<vk::Offset3D, 2>{{
+            {0, 0, 0},
+            {std::max(1, width >> level), std::max(1, height >> level), 1},
+        }},
+    };
+    cmd_buf.blitImage2(vk::BlitImageInfo2{
+        .srcImage = image,
+        .srcImageLayout = vk::ImageLayout::eTransferSrcOptimal,
+        .dstImage = image,
+        .dstImageLayout = vk::ImageLayout::eTransferDstOptimal,
+        .filter = vk::Filter::eLinear,
+    }
+                           .setRegions(region));
+  }
+  barrier(0, num_levels - 1, vk::ImageLayout::eTransferSrcOptimal,
+          vk::ImageLayout::eTransferDstOptimal);
+}
+
+// upload the layers described by layout into array images. fill is called
+// once with the mapped staging memory. If mipmaps is set, a full mip chain
+// is generated when the format allows it (single-plane uncompressed formats
+// with linear blits), for layers that are drawn heavily downscaled. If
+// read_back is set, fill also reads the staging memory (e.g. to cache the
+// layers), so it is allocated in host-cached memory if possible, as reading
+// write-combined memory is very slow.
+LayerImages upload_layers_to_gpu(graphics::VkContext &vk,
+                                 const LayerLayout &layout,
+                                 const std::function<void(u8 *)> &fill,
+                                 bool mipmaps = false, bool read_back = false) {
+  auto &allocator = vk.get_vma_allocator();
+  auto format = layout.format;
+  auto width = layout.width, height = layout.height;
+  auto num_layers = layout.num_layers;
+  bool compressed = format.is_compressed();
+  auto layers_per_image =
+      static_cast<i32>(std::min<u32>(format.max_layers, num_layers));
+
+  u32 num_levels = 1;
+  if (mipmaps && !compressed && av_pix_fmt_count_planes(format.pix_fmt) == 1) {
+    auto features = vk.get_physical_device()
+                        .getFormatProperties(format.vk_format)
+                        .optimalTilingFeatures;
+    auto blit_features = vk::FormatFeatureFlagBits::eBlitSrc |
+                         vk::FormatFeatureFlagBits::eBlitDst |
+                         vk::FormatFeatureFlagBits::eSampledImageFilterLinear;
+    if ((features & blit_features) == blit_features)
+      num_levels = std::bit_width(static_cast<u32>(std::max(width, height)));
+  }
+
+  auto [buffer, buffer_alloc] = allocator.createBufferUnique(
       {
-          .size = frame_size * rescaled_frames.size(),
-          .usage = vk::BufferUsageFlagBits::eTransferSrc,
+          .size = layout.layer_size * num_layers,
+          .usage = compressed ? vk::BufferUsageFlagBits::eStorageBuffer
+                              : vk::BufferUsageFlagBits::eTransferSrc,
       },
       {
-          .flags = vma::AllocationCreateFlagBits::eMapped,
+          .flags = vma::AllocationCreateFlagBits::eMapped |
+                   (read_back
+                        ? vma::AllocationCreateFlagBits::eHostAccessRandom
+                        : vma::AllocationCreateFlagBits::
+                              eHostAccessSequentialWrite),
           .requiredFlags = vk::MemoryPropertyFlagBits::eHostVisible,
+          .preferredFlags = read_back ? vk::MemoryPropertyFlagBits::eHostCached
+                                      : vk::MemoryPropertyFlags{},
       });
 
-  u8 *data = static_cast<u8 *>(
-      vk.get_vma_allocator().getAllocationInfo(buffer_alloc.get()).pMappedData);
-  for (const auto &frame : rescaled_frames) {
-    std::memcpy(data, frame->data[0], frame_size);
-    data += frame_size;
-  }
+  fill(static_cast<u8 *>(
+      allocator.getAllocationInfo(buffer_alloc.get()).pMappedData));
+  // no-op for coherent memory, host-cached memory might not be
+  allocator.flushAllocation(buffer_alloc.get(), 0, vk::WholeSize);
 
+  // compressed layers are encoded and copied on the compute queue, and
+  // blits need the graphics queue
+  auto qf = num_levels > 1 ? vk.get_queues().get_qf_graphics()
+            : compressed   ? vk.get_queues().get_qf_compute()
+                           : vk.get_queues().get_qf_transfer();
   auto &tx_pool = vk.get_temp_pools();
-  auto cmd_buf = tx_pool.begin(vk.get_queues().get_qf_transfer());
+  auto cmd_buf = tx_pool.begin(qf);
   cmd_buf.begin(vk::CommandBufferBeginInfo{
       .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
-  vk::ImageMemoryBarrier2 img_barrier{
-      .srcStageMask = vk::PipelineStageFlagBits2::eNone,
-      .srcAccessMask = vk::AccessFlagBits2::eNone,
-      .dstStageMask = vk::PipelineStageFlagBits2::eTransfer,
-      .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
-      .oldLayout = vk::ImageLayout::eUndefined,
-      .newLayout = vk::ImageLayout::eTransferDstOptimal,
-      .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
-      .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
-      .image = *image,
-      .subresourceRange = {
-          .aspectMask = vk::ImageAspectFlagBits::eColor,
-          .levelCount = 1,
-          .layerCount = static_cast<u32>(rescaled_frames.size()),
-      }};
-  cmd_buf.pipelineBarrier2(
-      vk::DependencyInfo{}.setImageMemoryBarriers(img_barrier));
-  cmd_buf.copyBufferToImage(
-      *buffer, *image, vk::ImageLayout::eTransferDstOptimal,
-      vk::BufferImageCopy{
-          .bufferRowLength = static_cast<u32>(linesize / num_comps),
-          .imageSubresource =
-              vk::ImageSubresourceLayers{
-                  .aspectMask = vk::ImageAspectFlagBits::eColor,
-                  .layerCount = static_cast<u32>(rescaled_frames.size()),
-              },
-          .imageExtent = vk::Extent3D{static_cast<u32>(width),
-                                      static_cast<u32>(height), 1},
-      });
+
+  // the images are copied from copy_src, where layers are copy_layer_size
+  // bytes apart
+  vk::Buffer copy_src = *buffer;
+  std::size_t copy_layer_size = layout.layer_size;
+  UniqueAny free_on_finish;
+  if (compressed) {
+    bool has_alpha = format.vk_format == vk::Format::eBc3UnormBlock;
+    copy_layer_size = BlockCompressor::layer_bytes(has_alpha, width, height);
+    auto [blocks, blocks_alloc] = allocator.createBufferUnique(
+        {
+            .size = copy_layer_size * num_layers,
+            .usage = vk::BufferUsageFlagBits::eStorageBuffer |
+                     vk::BufferUsageFlagBits::eTransferSrc,
+        },
+        {
+            .requiredFlags = vk::MemoryPropertyFlagBits::eDeviceLocal,
+        });
+    copy_src = *blocks;
+
+    // the source layers are bound in batches that fit in one binding
+    auto max_range = vk.get_physical_device()
+                         .getProperties()
+                         .limits.maxStorageBufferRange;
+    auto batch_layers = static_cast<i32>(std::clamp<std::size_t>(
+        max_range / layout.layer_size, 1, num_layers));
+    auto num_batches = (num_layers + batch_layers - 1) / batch_layers;
+    BlockCompressor compressor{vk.get_device(), has_alpha,
+                               static_cast<u32>(num_batches)};
+    for (i32 first = 0; first < num_layers; first += batch_layers) {
+      auto count = std::min(batch_layers, num_layers - first);
+      compressor.compress(
+          vk.get_device(), cmd_buf,
+          vk::DescriptorBufferInfo{
+              .buffer = *buffer,
+              .offset = first * layout.layer_size,
+              .range = count * layout.layer_size,
+          },
+          *blocks, width, height, static_cast<u32>(width),
+          static_cast<u32>(layout.layer_size / 4), first, count);
+    }
+
+    vk::MemoryBarrier2 barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eComputeShader,
+        .srcAccessMask = vk::AccessFlagBits2::eShaderStorageWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2::eTransfer,
+        .dstAccessMask = vk::AccessFlagBits2::eTransferRead,
+    };
+    cmd_buf.pipelineBarrier2(vk::DependencyInfo{}.setMemoryBarriers(barrier));
+    free_on_finish = std::make_tuple(
+        std::move(buffer), std::move(buffer_alloc), std::move(compressor),
+        std::move(blocks), std::move(blocks_alloc));
+  } else {
+    free_on_finish =
+        std::make_tuple(std::move(buffer), std::move(buffer_alloc));
+  }
+
+  // one copy region per plane and layer, as planes of consecutive layers
+  // are not contiguous
+  auto num_planes =
+      compressed ? 1 : av_pix_fmt_count_planes(format.pix_fmt);
+  auto desc = tp::ffmpeg::get_pix_fmt_desc(format.pix_fmt);
+  std::array plane_aspects{vk::ImageAspectFlagBits::ePlane0,
+                           vk::ImageAspectFlagBits::ePlane1,
+                           vk::ImageAspectFlagBits::ePlane2};
+
+  LayerImages result{.layers_per_image = layers_per_image};
+  std::vector<vk::SemaphoreSubmitInfo> signal_sems;
+  for (i32 first = 0; first < num_layers; first += layers_per_image) {
+    auto count = std::min(layers_per_image, num_layers - first);
+    auto [uniq_image, image_allocation] = allocator.createImageUnique(
+        {
+            .imageType = vk::ImageType::e2D,
+            .format = format.vk_format,
+            .extent = vk::Extent3D{static_cast<u32>(width),
+                                   static_cast<u32>(height), 1},
+            .mipLevels = num_levels,
+            .arrayLayers = static_cast<u32>(count),
+            .samples = vk::SampleCountFlagBits::e1,
+            .tiling = vk::ImageTiling::eOptimal,
+            .usage = vk::ImageUsageFlagBits::eSampled |
+                     vk::ImageUsageFlagBits::eTransferSrc |
+                     vk::ImageUsageFlagBits::eTransferDst,
+            .sharingMode = vk::SharingMode::eExclusive,
+            .initialLayout = vk::ImageLayout::eUndefined,
+        },
+        {
+            .requiredFlags = vk::MemoryPropertyFlagBits::eDeviceLocal,
+        });
+    auto image = vk::raii::Image{vk.get_device(), uniq_image.release()};
+
+    vk::ImageMemoryBarrier2 img_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eNone,
+        .srcAccessMask = vk::AccessFlagBits2::eNone,
+        .dstStageMask = vk::PipelineStageFlagBits2::eTransfer,
+        .dstAccessMask = vk::AccessFlagBits2::eTransferWrite,
+        .oldLayout = vk::ImageLayout::eUndefined,
+        .newLayout = vk::ImageLayout::eTransferDstOptimal,
+        .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
+        .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
+        .image = *image,
+        .subresourceRange = {
+            .aspectMask = vk::ImageAspectFlagBits::eColor,
+            .levelCount = num_levels,
+            .layerCount = static_cast<u32>(count),
+        }};
+    cmd_buf.pipelineBarrier2(
+        vk::DependencyInfo{}.setImageMemoryBarriers(img_barrier));
+
+    std::vector<vk::BufferImageCopy> regions;
+    for (i32 layer = 0; layer < count; ++layer) {
+      std::size_t offset = (first + layer) * copy_layer_size;
+      for (i32 plane = 0; plane < num_planes; ++plane) {
+        bool is_chroma = plane == 1 || plane == 2;
+        regions.push_back(vk::BufferImageCopy{
+            .bufferOffset = offset,
+            .imageSubresource =
+                vk::ImageSubresourceLayers{
+                    .aspectMask = num_planes > 1
+                                      ? plane_aspects[plane]
+                                      : vk::ImageAspectFlagBits::eColor,
+                    .baseArrayLayer = static_cast<u32>(layer),
+                    .layerCount = 1,
+                },
+            .imageExtent = vk::Extent3D{
+                static_cast<u32>(
+                    is_chroma ? AV_CEIL_RSHIFT(width, desc->log2_chroma_w)
+                              : width),
+                static_cast<u32>(
+                    is_chroma ? AV_CEIL_RSHIFT(height, desc->log2_chroma_h)
+                              : height),
+                1},
+        });
+        if (!compressed) {
+          auto [row_bytes, rows] =
+              layer_plane_size(format.pix_fmt, width, height, plane);
+          offset += row_bytes * rows;
+        }
+      }
+    }
+    cmd_buf.copyBufferToImage(copy_src, *image,
+                              vk::ImageLayout::eTransferDstOptimal, regions);
+    if (num_levels > 1)
+      generate_mipmaps(cmd_buf, *image, width, height, static_cast<u32>(count),
+                       num_levels);
+
+    graphics::TimelineSemaphore sem{vk.get_device(), 0, "video_frame_tlsem"};
+    u64 sem_value = 1;
+    signal_sems.push_back(vk::SemaphoreSubmitInfo{
+        .semaphore = *sem,
+        .value = sem_value,
+        .stageMask = vk::PipelineStageFlagBits2::eTransfer,
+    });
+
+    std::vector<StructVideoFramePlaneData> planes;
+    planes.emplace_back(StructVideoFramePlaneData{
+        .image = *image,
+        .format = format.vk_format,
+        .layout = vk::ImageLayout::eTransferDstOptimal,
+        .stage = vk::PipelineStageFlagBits2::eTransfer,
+        .access = vk::AccessFlagBits2::eTransferWrite,
+        .semaphore = *sem,
+        .semaphore_value = sem_value,
+        .queue_family_idx = qf,
+        .num_layers = count,
+        .num_levels = static_cast<i32>(num_levels),
+    });
+
+    // compressed layers are decoded by the sampler, so they are sampled like
+    // the RGBA layers they were encoded from
+    result.images.push_back(VideoFrame{
+        std::make_shared<StructVideoFrameData>(
+            std::move(planes), std::pair<i32, i32>{width, height},
+            std::make_tuple(std::move(image), std::move(image_allocation),
+                            std::move(sem))),
+        format.pix_fmt});
+  }
+
   cmd_buf.end();
-  graphics::TimelineSemaphore sem{vk.get_device(), 0, "video_frame_tlsem"};
-  u64 sem_value = 1;
-  tx_pool.end2(std::move(cmd_buf), vk.get_queues().get_qf_transfer(),
-               std::move(buffer), {},
-               vk::SemaphoreSubmitInfo{
-                   .semaphore = *sem,
-                   .value = sem_value,
-                   .stageMask = vk::PipelineStageFlagBits2::eTransfer,
-               },
-               vk::PipelineStageFlagBits2::eTransfer);
-
-  std::vector<StructVideoFramePlaneData> planes;
-  planes.emplace_back(StructVideoFramePlaneData{
-      .image = *image,
-      .format = supported_formats[format].front(),
-      .layout = vk::ImageLayout::eTransferDstOptimal,
-      .stage = vk::PipelineStageFlagBits2::eTransfer,
-      .access = vk::AccessFlagBits2::eTransferWrite,
-      .semaphore = *sem,
-      .semaphore_value = sem_value,
-      .queue_family_idx = vk.get_queues().get_qf_transfer(),
-      .num_layers = static_cast<i32>(rescaled_frames.size()),
-  });
-
-  return VideoFrame{
-      std::make_shared<StructVideoFrameData>(
-          std::move(planes), std::pair<i32, i32>{width, height},
-          std::make_tuple(std::move(image), std::move(image_allocation),
-                          std::move(sem))),
-      format};
+  tx_pool.end2(std::move(cmd_buf), qf, std::move(free_on_finish), {},
+               signal_sems, vk::PipelineStageFlagBits2::eTransfer);
+  return result;
+}
+
+// upload consecutive runs of frames into consecutive layers. The format
+// conversion and staging copies of different segments run concurrently, so
+// segments produced by parallel decoders need no merging.
+LayerImages upload_frame_segments_to_gpu(
+    graphics::VkContext &vk,
+    std::span<const std::span<tp::ffmpeg::Frame>> segments,
+    ResidentStorage storage = ResidentStorage::eRgb, bool mipmaps = false,
+    const LayerDataCallback &on_layer_data = {}) {
+  std::vector<std::size_t> first_layers;
+  std::size_t num_frames = 0;
+  for (const auto &segment : segments) {
+    first_layers.push_back(num_frames);
+    num_frames += segment.size();
+  }
+
+  auto first_segment = std::ranges::find_if(
+      segments, [](const auto &segment) { return !segment.empty(); });
+  assert(first_segment != segments.end());
+  const auto &first_frame = first_segment->front();
+
+  i32 width = first_frame->width;
+  i32 height = first_frame->height;
+  auto src_format = static_cast<tp::ffmpeg::PixelFormat>(first_frame->format);
+  auto format = select_layer_format(vk, width, height, src_format, storage);
+  auto layout = make_layer_layout(width, height, src_format, format,
+                                  static_cast<i32>(num_frames));
+
+  // frames are converted straight into the staging memory
+  auto fill = [&](u8 *data) {
+    parallel_for(segments.size(), [&](std::size_t i) {
+      tp::ffmpeg::VideoRescaler rescaler{};
+      auto rescaled_frame = tp::ffmpeg::Frame::create();
+      auto dst = data + first_layers[i] * layout.layer_size;
+      for (const auto &frame : segments[i]) {
+        rescaled_frame.unref();
+        rescaled_frame->width = width;
+        rescaled_frame->height = height;
+        rescaled_frame->format = format.pix_fmt;
+        // layers are sampled as full range (also by the YCbCr conversion
+        // of VideoPipeline)
+        rescaled_frame->color_range = AVCOL_RANGE_JPEG;
+
+        rescaler.auto_rescale(rescaled_frame, frame);
+        copy_to_layer(dst, rescaled_frame, format.pix_fmt);
+        dst += layout.layer_size;
+      }
+    });
+
+    if (on_layer_data)
+      on_layer_data(layout, {data, layout.layer_size * num_frames});
+  };
+  // the callback reads the layers back
+  return upload_layers_to_gpu(vk, layout, fill, mipmaps,
+                              static_cast<bool>(on_layer_data));
+}
+
+VideoFrame upload_frames_to_gpu(graphics::VkContext &vk,
+                                std::span<tp::ffmpeg::Frame> frames) {
+  assert(!frames.empty());
+  return upload_frame_segments_to_gpu(
+             vk, std::span<const std::span<tp::ffmpeg::Frame>>{&frames, 1})
+      .images.front();
 }
 
 } // namespace vkvideo::medias
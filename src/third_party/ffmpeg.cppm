@@ -4,6 +4,7 @@ extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libavutil/avutil.h>
+#include <libavutil/opt.h>
 #include <libavutil/pixdesc.h>
 #include <libswresample/swresample.h>
 #include <libswscale/swscale.h>
@@ -66,6 +67,10 @@ struct BufferDeleter {
   void operator()(AVBufferRef *ref) { av_buffer_unref(&ref); }
 };
 
+struct BufferPoolDeleter {
+  void operator()(AVBufferPool *pool) { av_buffer_pool_uninit(&pool); }
+};
+
 struct PacketDeleter {
   void operator()(AVPacket *packet) { av_packet_free(&packet); }
 };
@@ -90,6 +95,17 @@ struct AVIOContextDeleter {
   void operator()(AVIOContext *context) { avio_closep(&context); }
 };
 
+// for contexts created by open_buffered_avio
+struct BufferedAVIOContextDeleter {
+  void operator()(AVIOContext *context) {
+    avio_flush(context);
+    auto inner = static_cast<AVIOContext *>(context->opaque);
+    av_freep(&context->buffer);
+    avio_context_free(&context);
+    avio_closep(&inner);
+  }
+};
+
 struct SwsContextDeleter {
   void operator()(SwsContext *context) { sws_freeContext(context); }
 };
@@ -120,6 +136,26 @@ public:
   }
 };
 
+// pool of equally-sized buffers, which are recycled once every reference to
+// them is dropped. Buffers can be taken from multiple threads at once, and the
+// pool is only freed after all of its buffers are returned.
+class BufferPool
+    : public std::unique_ptr<AVBufferPool, detail::BufferPoolDeleter> {
+public:
+  using std::unique_ptr<AVBufferPool, detail::BufferPoolDeleter>::unique_ptr;
+
+  static BufferPool create(std::size_t size) {
+    return BufferPool{av_buffer_pool_init(size, nullptr)};
+  }
+
+  BufferRef get_buffer() {
+    BufferRef buffer{av_buffer_pool_get(get())};
+    if (!buffer)
+      throw std::bad_alloc{};
+    return buffer;
+  }
+};
+
 class Packet : public std::unique_ptr<AVPacket, detail::PacketDeleter> {
 public:
   using std::unique_ptr<AVPacket, detail::PacketDeleter>::unique_ptr;
@@ -139,6 +175,14 @@ public:
   void rescale_ts(AVRational tb_src, AVRational tb_dst) noexcept {
     av_packet_rescale_ts(get(), tb_src, tb_dst);
   }
+
+  // attach a copy of data as side data
+  void add_side_data(AVPacketSideDataType type, std::span<const u8> data) {
+    auto dst = av_packet_new_side_data(get(), type, data.size());
+    if (!dst)
+      throw std::bad_alloc{};
+    std::memcpy(dst, data.data(), data.size());
+  }
 };
 
 class Frame : public std::unique_ptr<AVFrame, detail::FrameDeleter> {
@@ -242,32 +286,51 @@ public:
     return *this;
   }
 
-  static OutputFormatContext create(std::string_view path) {
+  // the format is guessed from the path if format_name is null
+  static OutputFormatContext create(std::string_view path,
+                                    const char *format_name = nullptr) {
     AVFormatContext *fctx = nullptr;
-    av_call(
-        avformat_alloc_output_context2(&fctx, nullptr, nullptr, path.data()));
+    av_call(avformat_alloc_output_context2(&fctx, nullptr, format_name,
+                                           path.data()));
     return OutputFormatContext{fctx};
   }
 
+  // set a private option of the muxer, e.g. movflags
+  void set_option(const char *key, const char *value) {
+    av_call(av_opt_set(get()->priv_data, key, value, 0));
+  }
+
   AVStream *add_stream(const AVCodec *codec) {
     return avformat_new_stream(get(), codec);
   }
 
-  void open_file_if_needed() {
-    if (!(get()->oformat->flags & AVFMT_NOFILE)) {
-      AVIOContext *avio_ptr = nullptr;
-      av_call(avio_open(&avio_ptr, get()->url, AVIO_FLAG_WRITE));
-      get()->pb = avio_ptr;
-      avio.reset(avio_ptr);
-    }
+  // io_buffer_size replaces the (small) default write buffer, so that the
+  // output is written in large chunks
+  void open_file_if_needed(std::size_t io_buffer_size = 0) {
+    if (!(get()->oformat->flags & AVFMT_NOFILE))
+      open_file(get()->url, io_buffer_size);
+  }
+
+  // closes the current output file, and continues writing to url (used to
+  // split the output into segment files)
+  void reopen_file(const std::string &url, std::size_t io_buffer_size = 0) {
+    get()->pb = nullptr;
+    avio.reset();
+    buffered_avio.reset();
+    open_file(url.c_str(), io_buffer_size);
+  }
+
+  // bytes written to the current output file so far
+  std::size_t get_bytes_written() {
+    return get()->pb ? static_cast<std::size_t>(avio_tell(get()->pb)) : 0;
   }
 
   bool has_global_header_flag() {
     return get()->oformat->flags & AVFMT_GLOBALHEADER;
   }
 
-  void begin() {
-    open_file_if_needed();
+  void begin(std::size_t io_buffer_size = 0) {
+    open_file_if_needed(io_buffer_size);
     av_call(avformat_write_header(get(), nullptr));
   }
 
@@ -275,10 +338,68 @@ public:
     av_call(av_interleaved_write_frame(get(), packet.get()));
   }
 
+  // write the packets buffered for interleaving, then let the muxer flush
+  // its own buffers (e.g. the current fragment of a fragmented MP4), and
+  // hand everything to the output file
+  void flush() {
+    av_call(av_interleaved_write_frame(get(), nullptr));
+    av_call(av_write_frame(get(), nullptr));
+    if (get()->pb)
+      avio_flush(get()->pb);
+  }
+
   void end() { av_call(av_write_trailer(get())); }
 
 private:
   std::unique_ptr<AVIOContext, detail::AVIOContextDeleter> avio;
+  std::unique_ptr<AVIOContext, detail::BufferedAVIOContextDeleter>
+      buffered_avio;
+
+  void open_file(const char *url, std::size_t io_buffer_size) {
+    if (io_buffer_size > 0) {
+      buffered_avio = open_buffered_avio(url, io_buffer_size);
+      get()->pb = buffered_avio.get();
+      return;
+    }
+    AVIOContext *avio_ptr = nullptr;
+    av_call(avio_open(&avio_ptr, url, AVIO_FLAG_WRITE));
+    get()->pb = avio_ptr;
+    avio.reset(avio_ptr);
+  }
+
+  // a buffer_size-byte buffer in front of an unbuffered (AVIO_FLAG_DIRECT)
+  // context of the url, as FFmpeg has no public way to resize the buffer of
+  // an opened context
+  static std::unique_ptr<AVIOContext, detail::BufferedAVIOContextDeleter>
+  open_buffered_avio(const char *url, std::size_t buffer_size) {
+    AVIOContext *inner = nullptr;
+    av_call(avio_open(&inner, url, AVIO_FLAG_WRITE | AVIO_FLAG_DIRECT));
+
+    auto buffer = static_cast<u8 *>(av_malloc(buffer_size));
+    AVIOContext *context =
+        buffer ? avio_alloc_context(
+                     buffer, static_cast<int>(buffer_size), 1, inner, nullptr,
+                     [](void *opaque, const u8 *data, int size) {
+                       auto inner = static_cast<AVIOContext *>(opaque);
+                       avio_write(inner, data, size);
+                       return inner->error < 0 ? inner->error : size;
+                     },
+                     [](void *opaque, i64 offset, int whence) -> i64 {
+                       auto inner = static_cast<AVIOContext *>(opaque);
+                       if (whence & AVSEEK_SIZE)
+                         return avio_size(inner);
+                       return avio_seek(inner, offset, whence & ~AVSEEK_FORCE);
+                     })
+               : nullptr;
+    if (!context) {
+      av_free(buffer);
+      avio_closep(&inner);
+      throw std::bad_alloc{};
+    }
+    context->seekable = inner->seekable;
+    return std::unique_ptr<AVIOContext, detail::BufferedAVIOContextDeleter>{
+        context};
+  }
 };
 
 using Stream = AVStream;
@@ -328,6 +449,21 @@ public:
     av_call(avcodec_parameters_from_context(params, get()));
   }
 
+  void set_extradata(std::span<const u8> data) {
+    av_freep(&get()->extradata);
+    get()->extradata_size = 0;
+    if (data.empty())
+      return;
+
+    auto extradata = static_cast<u8 *>(
+        av_mallocz(data.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+    if (!extradata)
+      throw std::bad_alloc{};
+    std::memcpy(extradata, data.data(), data.size());
+    get()->extradata = extradata;
+    get()->extradata_size = static_cast<int>(data.size());
+  }
+
   // DECODE
   bool send_packet(const Packet &packet) {
     int err = avcodec_send_packet(get(), packet.get());
@@ -435,6 +571,18 @@ public:
                                dst->width, dst->height,
                                static_cast<AVPixelFormat>(dst->format),
                                SWS_BILINEAR, nullptr, nullptr, nullptr));
+    // the color ranges of the frames are not picked up by sws_scale_frame
+    if (dst->color_range != AVCOL_RANGE_UNSPECIFIED) {
+      int *inv_table, *table, src_range, dst_range, brightness, contrast,
+          saturation;
+      if (sws_getColorspaceDetails(get(), &inv_table, &src_range, &table,
+                                   &dst_range, &brightness, &contrast,
+                                   &saturation) >= 0)
+        sws_setColorspaceDetails(get(), inv_table,
+                                 src->color_range == AVCOL_RANGE_JPEG, table,
+                                 dst->color_range == AVCOL_RANGE_JPEG,
+                                 brightness, contrast, saturation);
+    }
     rescale(dst, src);
   }
 };
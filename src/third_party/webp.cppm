@@ -1,6 +1,7 @@
 module;
 
 #ifdef VKVIDEO_HAVE_WEBP
+#include <webp/decode.h>
 #include <webp/demux.h>
 #endif
 
@@ -76,15 +77,93 @@ private:
   Info info;
 };
 
+enum class DisposeMethod {
+  eNone = WEBP_MUX_DISPOSE_NONE,
+  eBackground = WEBP_MUX_DISPOSE_BACKGROUND,
+};
+
+enum class BlendMethod {
+  eBlend = WEBP_MUX_BLEND,
+  eNoBlend = WEBP_MUX_NO_BLEND,
+};
+
+struct FrameInfo {
+  i32 x_offset, y_offset, width, height;
+  i64 pts, duration; // in nanoseconds
+  DisposeMethod dispose;
+  BlendMethod blend;
+  bool has_alpha;
+  // the canvas can be reconstructed from this frame alone, without decoding
+  // any of the previous frames
+  bool key_frame;
+  std::span<const u8> bitstream;
+
+  bool covers(i32 canvas_width, i32 canvas_height) const {
+    return width == canvas_width && height == canvas_height;
+  }
+};
+
+// decode a single frame bitstream to non-premultiplied RGBA, writing
+// directly into (possibly external) memory with the given stride
+inline void decode_rgba(std::span<const u8> bitstream, u8 *output, i32 stride,
+                        i32 height) {
+  WebPDecoderConfig config;
+  if (!WebPInitDecoderConfig(&config)) {
+    throw std::runtime_error{"WebP decoder version mismatch."};
+  }
+
+  config.output.colorspace = MODE_RGBA;
+  config.output.is_external_memory = 1;
+  config.output.u.RGBA.rgba = output;
+  config.output.u.RGBA.stride = stride;
+  config.output.u.RGBA.size = static_cast<std::size_t>(stride) * height;
+  auto status = WebPDecode(bitstream.data(), bitstream.size(), &config);
+  WebPFreeDecBuffer(&config.output);
+  if (status != VP8_STATUS_OK) {
+    throw std::runtime_error{"WebP decoding error."};
+  }
+}
+
 class Demuxer {
 public:
   Demuxer(std::span<const u8> data)
       : data{.bytes = data.data(), .size = data.size_bytes()},
         demuxer{WebPDemux(&this->data)} {
+    if (!demuxer) {
+      throw std::runtime_error{"Unable to parse WebP data."};
+    }
+
+    i32 canvas_width = width(), canvas_height = height();
     if (WebPDemuxGetFrame(demuxer.get(), 1, &iter))
       do {
-        duration += iter.duration * 1000000;
+        auto &info = frame_infos.emplace_back(FrameInfo{
+            .x_offset = iter.x_offset,
+            .y_offset = iter.y_offset,
+            .width = iter.width,
+            .height = iter.height,
+            .pts = duration,
+            .duration = iter.duration * 1000000ll,
+            .dispose = static_cast<DisposeMethod>(iter.dispose_method),
+            .blend = static_cast<BlendMethod>(iter.blend_method),
+            .has_alpha = static_cast<bool>(iter.has_alpha),
+            .bitstream = {iter.fragment.bytes, iter.fragment.size},
+        });
+        duration += info.duration;
+
+        // same rules as libwebp's WebPAnimDecoder
+        if (frame_infos.size() == 1) {
+          info.key_frame = true;
+        } else if ((!info.has_alpha || info.blend == BlendMethod::eNoBlend) &&
+                   info.covers(canvas_width, canvas_height)) {
+          info.key_frame = true;
+        } else {
+          const auto &prev = frame_infos[frame_infos.size() - 2];
+          info.key_frame = prev.dispose == DisposeMethod::eBackground &&
+                           (prev.covers(canvas_width, canvas_height) ||
+                            prev.key_frame);
+        }
       } while (WebPDemuxNextFrame(&iter));
+    WebPDemuxReleaseIterator(&iter);
   }
 
   u32 width() const {
@@ -101,11 +180,14 @@ public:
 
   i64 total_duration() { return duration; }
 
+  std::span<const FrameInfo> frames() const { return frame_infos; }
+
 private:
   WebPData data;
   std::unique_ptr<WebPDemuxer, details::WebPDemuxerDeleter> demuxer;
   WebPIterator iter;
   i64 duration = 0;
+  std::vector<FrameInfo> frame_infos;
 };
 
 } // namespace vkvideo::tp::webp
@@ -0,0 +1,194 @@
+import std;
+import vulkan_hpp;
+import vk_mem_alloc_hpp;
+import vkvideo;
+
+using namespace vkvideo;
+using namespace vkvideo::medias;
+using namespace vkvideo::graphics;
+using namespace vkvideo::tp;
+
+// exit code telling ctest that the test was skipped
+constexpr int skip_exit_code = 77;
+
+// draws a video like the frame loop of vkvideo_player does (through a
+// Compositor), but headless, into an offscreen image, and fails if a frame
+// past the warm-up ones made a heap allocation on this thread. Skipped if the
+// library is built without VKVIDEO_TRACK_ALLOCATIONS.
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <input> [frames=120]" << std::endl;
+    return 1;
+  }
+  if (!allocation_tracking) {
+    std::println("Allocations are not tracked in this build, skipping");
+    return skip_exit_code;
+  }
+
+  auto num_frames = argc > 2 ? std::atoi(argv[2]) : 120;
+  static constexpr i32 warmup_frames = 60;
+  static constexpr i32 fif_cnt = 3;
+  // the video is played at 30 fps, however fast the frames are drawn
+  static constexpr i64 frame_duration = 1'000'000'000 / 30;
+  static constexpr vk::Format color_format = vk::Format::eR8G8B8A8Unorm;
+  static constexpr vk::Extent2D extent{640, 360};
+
+  ffmpeg::Instance ffmpeg;
+  // the validation layer allocates in every Vulkan call
+  VkContext vk{VkContextOptions{
+      .headless = true,
+      .validation = false,
+      .video_encode = false,
+  }};
+
+  auto &allocator = vk.get_vma_allocator();
+  auto [target, target_allocation] = allocator.createImageUnique(
+      {
+          .imageType = vk::ImageType::e2D,
+          .format = color_format,
+          .extent = vk::Extent3D{extent.width, extent.height, 1},
+          .mipLevels = 1,
+          .arrayLayers = 1,
+          .samples = vk::SampleCountFlagBits::e1,
+          .tiling = vk::ImageTiling::eOptimal,
+          .usage = vk::ImageUsageFlagBits::eColorAttachment,
+          .sharingMode = vk::SharingMode::eExclusive,
+          .initialLayout = vk::ImageLayout::eUndefined,
+      },
+      {
+          .requiredFlags = vk::MemoryPropertyFlagBits::eDeviceLocal,
+      });
+  vk::ImageSubresourceRange color_range{
+      .aspectMask = vk::ImageAspectFlagBits::eColor,
+      .levelCount = 1,
+      .layerCount = 1,
+  };
+  vk::raii::ImageView target_view{vk.get_device(),
+                                  vk::ImageViewCreateInfo{
+                                      .image = target.get(),
+                                      .viewType = vk::ImageViewType::e2D,
+                                      .format = color_format,
+                                      .subresourceRange = color_range,
+                                  }};
+
+  vk::raii::CommandPool pool{
+      vk.get_device(),
+      vk::CommandPoolCreateInfo{
+          .flags = vk::CommandPoolCreateFlagBits::eTransient |
+                   vk::CommandPoolCreateFlagBits::eResetCommandBuffer,
+          .queueFamilyIndex =
+              static_cast<u32>(vk.get_queues().get_qf_graphics()),
+      }};
+  vk::raii::CommandBuffers cmd_bufs{
+      vk.get_device(), vk::CommandBufferAllocateInfo{
+                           .commandPool = *pool,
+                           .level = vk::CommandBufferLevel::ePrimary,
+                           .commandBufferCount = static_cast<u32>(fif_cnt),
+                       }};
+  std::vector<TimelineSemaphore> cmd_buf_end_sems;
+  std::vector<u64> cmd_buf_sem_values(fif_cnt, 0);
+  cmd_buf_end_sems.reserve(fif_cnt);
+  for (i32 i = 0; i < fif_cnt; ++i) {
+    auto name = std::format("cmd_buf_end_sems[{}]", i);
+    cmd_buf_end_sems.emplace_back(vk.get_device(), 0, name.c_str());
+  }
+
+  Compositor compositor{vk, color_format, fif_cnt};
+  compositor.layers.push_back(
+      CompositorLayer{.video = open_video(vk, argv[1])});
+  std::vector<CompositedFrames> composited_frames(fif_cnt);
+  FrameArena frame_arena;
+  std::vector<vk::SemaphoreSubmitInfo> wait_sem_info, sig_sem_info;
+
+  int exit_code = 0;
+  for (i32 i = 0; i < warmup_frames + num_frames; ++i) {
+    AllocationCounter allocations;
+    vk.get_temp_pools().garbage_collect();
+
+    auto fif_idx = i % fif_cnt;
+    cmd_buf_end_sems[fif_idx].wait(cmd_buf_sem_values[fif_idx],
+                                   std::numeric_limits<i64>::max());
+    composited_frames[fif_idx].clear();
+    for (auto &composited : composited_frames)
+      composited.unlock();
+    frame_arena.reset();
+
+    auto &cmd_buf = cmd_bufs[fif_idx];
+    cmd_buf.begin(vk::CommandBufferBeginInfo{
+        .flags = vk::CommandBufferUsageFlagBits::eOneTimeSubmit});
+    // the previous frame is overwritten
+    vk::ImageMemoryBarrier2 target_barrier{
+        .srcStageMask = vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+        .srcAccessMask = vk::AccessFlagBits2::eColorAttachmentWrite,
+        .dstStageMask = vk::PipelineStageFlagBits2::eColorAttachmentOutput,
+        .dstAccessMask = vk::AccessFlagBits2::eColorAttachmentWrite |
+                         vk::AccessFlagBits2::eColorAttachmentRead,
+        .oldLayout = vk::ImageLayout::eUndefined,
+        .newLayout = vk::ImageLayout::eColorAttachmentOptimal,
+        .srcQueueFamilyIndex = vk::QueueFamilyIgnored,
+        .dstQueueFamilyIndex = vk::QueueFamilyIgnored,
+        .image = target.get(),
+        .subresourceRange = color_range,
+    };
+    cmd_buf.pipelineBarrier2(
+        vk::DependencyInfo{}.setImageMemoryBarriers(target_barrier));
+
+    vk::RenderingAttachmentInfo color_attachment{
+        .imageView = *target_view,
+        .imageLayout = vk::ImageLayout::eColorAttachmentOptimal,
+        .loadOp = vk::AttachmentLoadOp::eClear,
+        .storeOp = vk::AttachmentStoreOp::eStore,
+        .clearValue = {vk::ClearColorValue{
+            .float32 = std::array<float, 4>{0.0f, 0.0f, 0.0f, 0.0f},
+        }},
+    };
+    cmd_buf.beginRendering(vk::RenderingInfo{
+        .renderArea = {{0, 0}, extent},
+        .layerCount = 1,
+    }
+                               .setColorAttachments(color_attachment));
+    auto &composited = composited_frames[fif_idx];
+    compositor.record(cmd_buf, fif_idx, i * frame_duration, extent,
+                      composited, &frame_arena);
+    cmd_buf.endRendering();
+    cmd_buf.end();
+
+    vk::CommandBufferSubmitInfo cmd_buf_info{.commandBuffer = cmd_buf};
+    wait_sem_info.clear();
+    sig_sem_info.assign({
+        {
+            .semaphore = cmd_buf_end_sems[fif_idx],
+            .value = ++cmd_buf_sem_values[fif_idx],
+            .stageMask = vk::PipelineStageFlagBits2::eAllCommands,
+        },
+    });
+    for (auto *plane : composited.planes) {
+      wait_sem_info.push_back(plane->wait_sem_info());
+      sig_sem_info.push_back(
+          plane->signal_sem_info(vk::PipelineStageFlagBits2::eFragmentShader));
+      plane->set_semaphore_value(plane->get_semaphore_value() + 1);
+    }
+    {
+      auto [q_lock, graphics_queue] = vk.get_queues().get_graphics_queue();
+      graphics_queue.submit2(vk::SubmitInfo2{}
+                                 .setCommandBufferInfos(cmd_buf_info)
+                                 .setWaitSemaphoreInfos(wait_sem_info)
+                                 .setSignalSemaphoreInfos(sig_sem_info));
+    }
+    // the composited frames are kept until the commands are done
+    composited.unlock();
+
+    if (i < warmup_frames)
+      continue;
+    if (auto count = allocations.get(); count > 0) {
+      std::println(std::cerr, "Frame {} made {} heap allocation(s)", i, count);
+      exit_code = 1;
+      break;
+    }
+  }
+
+  vk.get_device().waitIdle();
+  if (exit_code == 0)
+    std::println("{} frames without heap allocations", num_frames);
+  return exit_code;
+}